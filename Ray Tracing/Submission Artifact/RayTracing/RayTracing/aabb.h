@@ -13,6 +13,11 @@
 
 #include "constants.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AABB_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
 
 class aabb {
     public:
@@ -22,18 +27,54 @@ class aabb {
         point min() const {return _min; }
         point max() const {return _max; }
 
+        // Branchless slab test using the ray's cached reciprocal direction. An axis-parallel
+        // ray gets infinite slab distances, or a NaN one (0 * inf) when its origin lies
+        // exactly on a slab plane. That ray stays on the plane, inside the closed slab, so
+        // when either distance is NaN both are made NaN, and the min/max operand order below
+        // (the SSE minpd/maxpd rule of returning the second operand when either is NaN) then
+        // lets the axis place no limit on the span. Rays on the min and max planes both hit.
+        // The span may be empty of width, so a flat box is hit by rays that cross its plane.
         bool hit(const ray& r, double tmin, double tmax) const {
+            const auto& o = r.origin();
+            const auto& inv = r.inverse_direction();
+#ifdef AABB_USE_SSE2
+            auto o_xy = _mm_loadu_pd(o.e);
+            auto inv_xy = _mm_loadu_pd(inv.e);
+            auto t0_xy = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(_min.e), o_xy), inv_xy);
+            auto t1_xy = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(_max.e), o_xy), inv_xy);
+            auto t0_z = _mm_mul_sd(_mm_sub_sd(_mm_load_sd(_min.e + 2), _mm_load_sd(o.e + 2)),
+                                   _mm_load_sd(inv.e + 2));
+            auto t1_z = _mm_mul_sd(_mm_sub_sd(_mm_load_sd(_max.e + 2), _mm_load_sd(o.e + 2)),
+                                   _mm_load_sd(inv.e + 2));
+
+            auto nan_xy = _mm_cmpunord_pd(t0_xy, t1_xy);
+            auto nan_z = _mm_cmpunord_sd(t0_z, t1_z);
+            t0_xy = _mm_or_pd(t0_xy, nan_xy);
+            t1_xy = _mm_or_pd(t1_xy, nan_xy);
+            t0_z = _mm_or_pd(t0_z, nan_z);
+            t1_z = _mm_or_pd(t1_z, nan_z);
+
+            auto near_xy = _mm_max_pd(_mm_min_pd(t0_xy, t1_xy), _mm_set1_pd(tmin));
+            auto far_xy  = _mm_min_pd(_mm_max_pd(t0_xy, t1_xy), _mm_set1_pd(tmax));
+            auto near_z  = _mm_max_sd(_mm_min_sd(t0_z, t1_z), _mm_set_sd(tmin));
+            auto far_z   = _mm_min_sd(_mm_max_sd(t0_z, t1_z), _mm_set_sd(tmax));
+
+            auto near = _mm_max_sd(_mm_max_sd(near_xy, _mm_unpackhi_pd(near_xy, near_xy)), near_z);
+            auto far  = _mm_min_sd(_mm_min_sd(far_xy, _mm_unpackhi_pd(far_xy, far_xy)), far_z);
+            return _mm_comile_sd(near, far) != 0;
+#else
             for (int a = 0; a < 3; a++) {
-                auto t0 = fmin((_min[a] - r.origin()[a]) / r.direction()[a],
-                               (_max[a] - r.origin()[a]) / r.direction()[a]);
-                auto t1 = fmax((_min[a] - r.origin()[a]) / r.direction()[a],
-                               (_max[a] - r.origin()[a]) / r.direction()[a]);
-                tmin = fmax(t0, tmin);
-                tmax = fmin(t1, tmax);
-                if (tmax <= tmin)
-                    return false;
+                auto t0 = (_min[a] - o[a]) * inv[a];
+                auto t1 = (_max[a] - o[a]) * inv[a];
+                if (std::isnan(t0) || std::isnan(t1))
+                    continue;
+                auto t_near = t0 < t1 ? t0 : t1;
+                auto t_far  = t0 > t1 ? t0 : t1;
+                tmin = t_near > tmin ? t_near : tmin;
+                tmax = t_far  < tmax ? t_far  : tmax;
             }
-            return true;
+            return tmin <= tmax;
+#endif
         }
 
         double area() const {
@@ -60,7 +101,7 @@ class aabb {
         point _max;
 };
 
-aabb surrounding_box(aabb box0, aabb box1) {
+inline aabb surrounding_box(aabb box0, aabb box1) {
     vector3 small(fmin(box0.min().x(), box1.min().x()),
                fmin(box0.min().y(), box1.min().y()),
                fmin(box0.min().z(), box1.min().z()));
@@ -0,0 +1,103 @@
+#include "constants.h"
+#include "aabb.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+// Box-test throughput of aabb::hit against the original six-division slab loop.
+// A quarter of the rays are axis-parallel, as the Cornell walls produce, and an eighth
+// also start exactly on one of a box's slab planes. Every hit count is checked against a
+// reference test that treats an axis the ray doesn't move along as a containment test.
+
+static bool legacy_aabb_hit(const aabb& box, const ray& r, double tmin, double tmax) {
+	for (int a = 0; a < 3; a++) {
+		auto t0 = fmin((box.min()[a] - r.origin()[a]) / r.direction()[a],
+			(box.max()[a] - r.origin()[a]) / r.direction()[a]);
+		auto t1 = fmax((box.min()[a] - r.origin()[a]) / r.direction()[a],
+			(box.max()[a] - r.origin()[a]) / r.direction()[a]);
+		tmin = fmax(t0, tmin);
+		tmax = fmin(t1, tmax);
+		if (tmax <= tmin)
+			return false;
+	}
+	return true;
+}
+
+static bool reference_aabb_hit(const aabb& box, const ray& r, double tmin, double tmax) {
+	for (int a = 0; a < 3; a++) {
+		if (r.direction()[a] == 0) {
+			if (r.origin()[a] < box.min()[a] || r.origin()[a] > box.max()[a])
+				return false;
+			continue;
+		}
+		auto t0 = (box.min()[a] - r.origin()[a]) / r.direction()[a];
+		auto t1 = (box.max()[a] - r.origin()[a]) / r.direction()[a];
+		tmin = fmax(fmin(t0, t1), tmin);
+		tmax = fmin(fmax(t0, t1), tmax);
+	}
+	return tmin <= tmax;
+}
+
+template <typename HitFn>
+static double time_box_tests(
+	const std::vector<aabb>& boxes, const std::vector<ray>& rays, HitFn hit, long& hits
+) {
+	auto start = std::chrono::steady_clock::now();
+	hits = 0;
+	for (const auto& r : rays)
+		for (const auto& box : boxes)
+			hits += hit(box, r);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+void run_aabb_benchmark() {
+	const int box_count = 1024;
+	const int ray_count = 4096;
+
+	std::vector<aabb> boxes;
+	for (int i = 0; i < box_count; i++) {
+		auto lo = point::random(0, 555);
+		boxes.push_back(aabb(lo, lo + vector3::random(1, 100)));
+	}
+
+	std::vector<ray> rays;
+	for (int i = 0; i < ray_count; i++) {
+		auto origin = point::random(0, 555);
+		auto dir = vector3::random(-1, 1);
+		if (i % 4 == 0) {
+			auto axis = random_int(0, 2);
+			dir[axis] = 0;
+			if (i % 8 == 0) {
+				const auto& box = boxes[random_int(0, box_count - 1)];
+				origin[axis] = random_int(0, 1) ? box.max()[axis] : box.min()[axis];
+			}
+		}
+		rays.push_back(ray(origin, dir));
+	}
+
+	long reference_hits, legacy_hits, hits;
+	time_box_tests(boxes, rays,
+		[](const aabb& b, const ray& r) { return reference_aabb_hit(b, r, 0.001, infinity); },
+		reference_hits);
+	auto legacy_time = time_box_tests(boxes, rays,
+		[](const aabb& b, const ray& r) { return legacy_aabb_hit(b, r, 0.001, infinity); },
+		legacy_hits);
+	auto time = time_box_tests(boxes, rays,
+		[](const aabb& b, const ray& r) { return b.hit(r, 0.001, infinity); },
+		hits);
+
+	auto tests = static_cast<double>(box_count) * ray_count;
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "legacy slab test: " << tests / legacy_time / 1e6 << " Mtests/s\n";
+	std::cout << "aabb::hit:        " << tests / time / 1e6 << " Mtests/s ("
+		<< legacy_time / time << "x)\n";
+	std::cout << "hits: " << legacy_hits << " legacy, " << hits << " aabb::hit, "
+		<< reference_hits << " reference\n";
+}
+
+//int main() {
+//	run_aabb_benchmark();
+//}
@@ -16,25 +16,206 @@
 #include "hittable.h"
 
 
+// Directions from `origin` towards a rectangle, spread evenly over the solid angle it covers
+// (Urena, Fajardo and King, "An Area-Preserving Parametrization for Spherical Rectangles").
+// Picking points evenly by area instead weights each by squared distance over cosine, which
+// runs away close to the rectangle. Farther off, or once the solid angle is tiny, points
+// are picked by area after all; there that is well behaved, and the corner angles sampling
+// needs lose their precision.
+//
+// The solid angle, all the pdf needs, comes from the two triangles that make up the
+// rectangle (Van Oosterom and Strackee) and costs two atan2s; the corner angles are only
+// worked out to sample.
+class spherical_rectangle {
+    public:
+        // The rectangle `corner` + a x + b y, for a in [0, width] and b in [0, height], where
+        // x and y are unit vectors at right angles.
+        spherical_rectangle(
+            const point& origin, const point& corner,
+            const vector3& x, double width, const vector3& y, double height);
+
+        // The density of `direction` by solid angle, or zero if it misses the rectangle.
+        double pdf(const vector3& direction) const;
+
+        // The vector from the origin to a point on the rectangle.
+        vector3 sample(const sample_2d& s) const;
+
+    private:
+        // In the frame of x, y and z, the rectangle spans [x0, x1] by [y0, y1] at z0 <= 0.
+        vector3 x, y, z;
+        double x0, x1, y0, y1, z0;
+        double solid_angle;
+        bool by_area;
+};
+
+
+spherical_rectangle::spherical_rectangle(
+    const point& origin, const point& corner,
+    const vector3& x, double width, const vector3& y, double height
+) : x(x), y(y), z(cross(x, y)) {
+    auto d = corner - origin;
+    z0 = dot(d, z);
+    if (z0 > 0) {
+        z = -z;
+        z0 = -z0;
+    }
+    x0 = dot(d, x);
+    y0 = dot(d, y);
+    x1 = x0 + width;
+    y1 = y0 + height;
+
+    // More than a diagonal from the rectangle's centre, squared distance and cosine change
+    // little over it, and picking by area does nearly as well for much less.
+    solid_angle = 0;
+    auto cx = x0 + width / 2, cy = y0 + height / 2;
+    by_area = !(z0 < 0) || cx * cx + cy * cy + z0 * z0 > width * width + height * height;
+    if (by_area)
+        return;
+
+    // tan(omega / 2) = |a . (b x c)| / (|a||b||c| + (a.b)|c| + (a.c)|b| + (b.c)|a|) for
+    // the triangle a b c. Both halves have the triple product -z0 times the area.
+    vector3 v00(x0, y0, z0), v10(x1, y0, z0), v11(x1, y1, z0), v01(x0, y1, z0);
+    auto l00 = v00.length(), l10 = v10.length(), l11 = v11.length(), l01 = v01.length();
+    auto triple = -z0 * width * height;
+    auto below0 = l00 * l10 * l11 + dot(v00, v10) * l11 + dot(v00, v11) * l10 + dot(v10, v11) * l00;
+    auto below1 = l00 * l11 * l01 + dot(v00, v11) * l01 + dot(v00, v01) * l11 + dot(v11, v01) * l00;
+    solid_angle = 2 * (atan2(triple, below0) + atan2(triple, below1));
+    by_area = !(solid_angle > 1e-6);
+}
+
+
+double spherical_rectangle::pdf(const vector3& direction) const {
+    auto dz = dot(direction, z);
+    if (!(dz < 0))
+        return 0;
+
+    auto t = z0 / dz;
+    auto px = t * dot(direction, x), py = t * dot(direction, y);
+    if (px < x0 || px > x1 || py < y0 || py > y1)
+        return 0;
+
+    if (!by_area)
+        return 1 / solid_angle;
+
+    auto length_squared = direction.length_squared();
+    auto distance_squared = t * t * length_squared;
+    auto cosine = -dz / sqrt(length_squared);
+    return distance_squared / (cosine * (x1 - x0) * (y1 - y0));
+}
+
+
+vector3 spherical_rectangle::sample(const sample_2d& s) const {
+    if (by_area)
+        return (x0 + s.u * (x1 - x0)) * x + (y0 + s.v * (y1 - y0)) * y + z0 * z;
+
+    // The planes through the origin and the edges at y0, x1, y1 and x0 have the normals
+    // (0, z0, -y0), (-z0, 0, x1), (0, -z0, y1) and (z0, 0, -x0), unnormalized, and meet at
+    // the rectangle's corner angles on the sphere, g0 to g3, which sum to the solid angle
+    // plus 2 pi. Sampling wants au = u * solid angle + k, with k = 2 pi - g2 - g3, only
+    // through its sine and cosine, so k is taken apart with the angle sum formulas instead
+    // of being worked out.
+    auto l0 = sqrt(z0 * z0 + y0 * y0), l2 = sqrt(z0 * z0 + y1 * y1), l3 = sqrt(z0 * z0 + x0 * x0);
+    auto cos_g2 = clamp(x0 * y1 / (l2 * l3), -1.0, 1.0);
+    auto cos_g3 = clamp(-x0 * y0 / (l3 * l0), -1.0, 1.0);
+    auto sin_g2 = sqrt(1 - cos_g2 * cos_g2), sin_g3 = sqrt(1 - cos_g3 * cos_g3);
+    auto cos_k = cos_g2 * cos_g3 - sin_g2 * sin_g3;
+    auto sin_k = -(sin_g2 * cos_g3 + cos_g2 * sin_g3);
+    auto b0 = -y0 / l0, b1 = y1 / l2;
+
+    // Pick the sub-rectangle [x0, xu] with the solid angle wanted, then a height along it
+    // evenly by solid angle.
+    auto a = s.u * solid_angle;
+    auto cos_au = cos(a) * cos_k - sin(a) * sin_k;
+    auto sin_au = sin(a) * cos_k + cos(a) * sin_k;
+    auto fu = (cos_au * b0 - b1) / sin_au;
+    auto cu = clamp((fu > 0 ? 1 : -1) / sqrt(fu * fu + b0 * b0), -1.0, 1.0);
+    auto xu = clamp(-(cu * z0) / sqrt(fmax(1 - cu * cu, 1e-300)), x0, x1);
+
+    auto d = sqrt(xu * xu + z0 * z0);
+    auto h0 = y0 / sqrt(d * d + y0 * y0);
+    auto h1 = y1 / sqrt(d * d + y1 * y1);
+    auto hv = h0 + s.v * (h1 - h0);
+    auto hv2 = hv * hv;
+    auto yv = hv2 < 1 - 1e-12 ? hv * d / sqrt(1 - hv2) : y1;
+
+    return xu * x + yv * y + z0 * z;
+}
+
+
+// The rectangles' hit() across every lane of a packet, for a rectangle spanning [a0,a1] by
+// [b0,b1] in the plane where the k axis is k. The same arithmetic as hit(), without branches
+// so the loop vectorizes. Returns the lanes that hit, with their distances in t.
+inline uint32_t rect_packet_hits(
+    const ray_packet& packet, double k, const double* origin_k, const double* direction_k,
+    double a0, double a1, const double* origin_a, const double* direction_a,
+    double b0, double b1, const double* origin_b, const double* direction_b, double* t
+) {
+    uint32_t hits = 0;
+    for (int i = 0; i < packet_size; i++) {
+        t[i] = (k - origin_k[i]) / direction_k[i];
+        auto a = origin_a[i] + t[i]*direction_a[i];
+        auto b = origin_b[i] + t[i]*direction_b[i];
+        auto inside = t[i] > packet.t_min && t[i] <= packet.t_max[i]
+                   && a >= a0 && a <= a1 && b >= b0 && b <= b1;
+        hits |= static_cast<uint32_t>(inside) << i;
+    }
+    return hits;
+}
+
+
+// Sets rec.p for a hit at rec.t on the plane where the `axis` coordinate is k. That
+// coordinate is put on the plane exactly; the others are off by the rounding in t and in
+// r.at(t).
+inline void set_plane_point(const ray& r, hit_record& rec, int axis, double k) {
+    rec.p = r.at(rec.t);
+    rec.p_error = rounding_gamma<double>(4) * (abs(r.origin()) + abs(rec.t * r.direction()));
+    rec.p[axis] = k;
+    rec.p_error[axis] = 0;
+    rec.geometric_normal = vector3(0, 0, 0);
+    rec.geometric_normal[axis] = 1;
+}
+
+
 class xy_rect: public hittable {
     public:
         xy_rect() {}
 
         xy_rect(
-            double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat
+            double _x0, double _x1, double _y0, double _y1, double _k, const material* mat
         ) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
         virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+        virtual void finalize_hit(const ray& r, hit_record& rec) const;
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const;
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const;
 
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
-            // The bounding box must have non-zero width in each dimension, so pad the Z
-            // dimension a small amount.
-            output_box = aabb(point(x0,y0, k-0.0001), point(x1, y1, k+0.0001));
+            // Flat in Z, which the slab tests allow for.
+            output_box = aabb(point(x0, y0, k), point(x1, y1, k));
             return true;
         }
 
+		virtual double pdf_value(const point& origin, const vector3& v) const {
+			return spherical_rectangle(origin, point(x0, y0, k), vector3(1, 0, 0), x1 - x0, vector3(0, 1, 0), y1 - y0).pdf(v);
+		}
+
+		virtual vector3 random(const point& origin) const {
+			return spherical_rectangle(origin, point(x0, y0, k), vector3(1, 0, 0), x1 - x0, vector3(0, 1, 0), y1 - y0).sample(random_2d());
+		}
+
+		virtual vector3 random_with_pdf(const point& origin, double& pdf) const {
+			auto rectangle = spherical_rectangle(origin, point(x0, y0, k), vector3(1, 0, 0), x1 - x0, vector3(0, 1, 0), y1 - y0);
+			auto v = rectangle.sample(random_2d());
+			pdf = rectangle.pdf(v);
+			return v;
+		}
+
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {
+            shapes.push_back({ this, this, mp, point((x0 + x1) / 2, (y0 + y1) / 2, k), (x1 - x0) * (y1 - y0), vector3(0, 0, 1) });
+        }
+
     public:
-        shared_ptr<material> mp;
+        const material* mp;
         double x0, x1, y0, y1, k;
 };
 
@@ -42,37 +223,41 @@ class xz_rect: public hittable {
     public:
         xz_rect() {}
         xz_rect(
-            double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat
+            double _x0, double _x1, double _z0, double _z1, double _k, const material* mat
         ) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
         virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+        virtual void finalize_hit(const ray& r, hit_record& rec) const;
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const;
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const;
 
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
-            // The bounding box must have non-zero width in each dimension, so pad the Y
-            // dimension a small amount.
-            output_box = aabb(point(x0,k-0.0001,z0), point(x1, k+0.0001, z1));
+            // Flat in Y, which the slab tests allow for.
+            output_box = aabb(point(x0, k, z0), point(x1, k, z1));
             return true;
         }
 
 		virtual double pdf_value(const point& origin, const vector3& v) const {
-			hit_record rec;
-			if (!this->hit(ray(origin, v), 0.001, infinity, rec))
-				return 0;
-
-			auto area = (x1 - x0) * (z1 - z0);
-			auto distance_squared = rec.t * rec.t * v.length_squared();
-			auto cosine = fabs(dot(v, rec.normal) / v.length());
-
-			return distance_squared / (cosine * area);
+			return spherical_rectangle(origin, point(x0, k, z0), vector3(1, 0, 0), x1 - x0, vector3(0, 0, 1), z1 - z0).pdf(v);
 		}
 
 		virtual vector3 random(const point& origin) const {
-			auto random_point = point(random_double(x0, x1), k, random_double(z0, z1));
-			return random_point - origin;
+			return spherical_rectangle(origin, point(x0, k, z0), vector3(1, 0, 0), x1 - x0, vector3(0, 0, 1), z1 - z0).sample(random_2d());
+		}
+
+		virtual vector3 random_with_pdf(const point& origin, double& pdf) const {
+			auto rectangle = spherical_rectangle(origin, point(x0, k, z0), vector3(1, 0, 0), x1 - x0, vector3(0, 0, 1), z1 - z0);
+			auto v = rectangle.sample(random_2d());
+			pdf = rectangle.pdf(v);
+			return v;
 		}
 
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {
+            shapes.push_back({ this, this, mp, point((x0 + x1) / 2, k, (z0 + z1) / 2), (x1 - x0) * (z1 - z0), vector3(0, 1, 0) });
+        }
+
     public:
-        shared_ptr<material> mp;
+        const material* mp;
         double x0, x1, z0, z1, k;
 };
 
@@ -81,26 +266,47 @@ class yz_rect: public hittable {
         yz_rect() {}
 
         yz_rect(
-            double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat
+            double _y0, double _y1, double _z0, double _z1, double _k, const material* mat
         ) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
         virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+        virtual void finalize_hit(const ray& r, hit_record& rec) const;
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const;
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const;
 
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
-            // The bounding box must have non-zero width in each dimension, so pad the X
-            // dimension a small amount.
-            output_box = aabb(point(k-0.0001, y0, z0), point(k+0.0001, y1, z1));
+            // Flat in X, which the slab tests allow for.
+            output_box = aabb(point(k, y0, z0), point(k, y1, z1));
             return true;
         }
 
+		virtual double pdf_value(const point& origin, const vector3& v) const {
+			return spherical_rectangle(origin, point(k, y0, z0), vector3(0, 1, 0), y1 - y0, vector3(0, 0, 1), z1 - z0).pdf(v);
+		}
+
+		virtual vector3 random(const point& origin) const {
+			return spherical_rectangle(origin, point(k, y0, z0), vector3(0, 1, 0), y1 - y0, vector3(0, 0, 1), z1 - z0).sample(random_2d());
+		}
+
+		virtual vector3 random_with_pdf(const point& origin, double& pdf) const {
+			auto rectangle = spherical_rectangle(origin, point(k, y0, z0), vector3(0, 1, 0), y1 - y0, vector3(0, 0, 1), z1 - z0);
+			auto v = rectangle.sample(random_2d());
+			pdf = rectangle.pdf(v);
+			return v;
+		}
+
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {
+            shapes.push_back({ this, this, mp, point(k, (y0 + y1) / 2, (z0 + z1) / 2), (y1 - y0) * (z1 - z0), vector3(1, 0, 0) });
+        }
+
     public:
-        shared_ptr<material> mp;
+        const material* mp;
         double y0, y1, z0, z1, k;
 };
 
 bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     auto t = (k-r.origin().z()) / r.direction().z();
-    if (t < t0 || t > t1)
+    if (!(t > t0 && t <= t1))
         return false;
 
     auto x = r.origin().x() + t*r.direction().x();
@@ -108,20 +314,40 @@ bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
 
-    rec.u = (x-x0)/(x1-x0);
-    rec.v = (y-y0)/(y1-y0);
     rec.t = t;
+    rec.object = this;
+
+    return true;
+}
+
+void xy_rect::finalize_hit(const ray& r, hit_record& rec) const {
+    set_plane_point(r, rec, 2, k);
+    rec.u = (rec.p.x()-x0)/(x1-x0);
+    rec.v = (rec.p.y()-y0)/(y1-y0);
     auto outward_normal = vector3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
+}
 
-    return true;
+uint32_t xy_rect::hit_packet(ray_packet& packet, uint32_t lanes) const {
+    double t[packet_size];
+    auto hits = rect_packet_hits(packet, k, packet.origin_z, packet.direction_z,
+        x0, x1, packet.origin_x, packet.direction_x,
+        y0, y1, packet.origin_y, packet.direction_y, t) & lanes;
+    packet.record_hits(hits, t, this);
+    return hits;
+}
+
+uint32_t xy_rect::occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+    double t[packet_size];
+    return rect_packet_hits(packet, k, packet.origin_z, packet.direction_z,
+        x0, x1, packet.origin_x, packet.direction_x,
+        y0, y1, packet.origin_y, packet.direction_y, t) & lanes;
 }
 
 bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     auto t = (k-r.origin().y()) / r.direction().y();
-    if (t < t0 || t > t1)
+    if (!(t > t0 && t <= t1))
         return false;
 
     auto x = r.origin().x() + t*r.direction().x();
@@ -129,20 +355,40 @@ bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
 
-    rec.u = (x-x0)/(x1-x0);
-    rec.v = (z-z0)/(z1-z0);
     rec.t = t;
+    rec.object = this;
+
+    return true;
+}
+
+void xz_rect::finalize_hit(const ray& r, hit_record& rec) const {
+    set_plane_point(r, rec, 1, k);
+    rec.u = (rec.p.x()-x0)/(x1-x0);
+    rec.v = (rec.p.z()-z0)/(z1-z0);
     auto outward_normal = vector3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
+}
 
-    return true;
+uint32_t xz_rect::hit_packet(ray_packet& packet, uint32_t lanes) const {
+    double t[packet_size];
+    auto hits = rect_packet_hits(packet, k, packet.origin_y, packet.direction_y,
+        x0, x1, packet.origin_x, packet.direction_x,
+        z0, z1, packet.origin_z, packet.direction_z, t) & lanes;
+    packet.record_hits(hits, t, this);
+    return hits;
+}
+
+uint32_t xz_rect::occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+    double t[packet_size];
+    return rect_packet_hits(packet, k, packet.origin_y, packet.direction_y,
+        x0, x1, packet.origin_x, packet.direction_x,
+        z0, z1, packet.origin_z, packet.direction_z, t) & lanes;
 }
 
 bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     auto t = (k-r.origin().x()) / r.direction().x();
-    if (t < t0 || t > t1)
+    if (!(t > t0 && t <= t1))
         return false;
 
     auto y = r.origin().y() + t*r.direction().y();
@@ -150,15 +396,35 @@ bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
 
-    rec.u = (y-y0)/(y1-y0);
-    rec.v = (z-z0)/(z1-z0);
     rec.t = t;
+    rec.object = this;
+
+    return true;
+}
+
+void yz_rect::finalize_hit(const ray& r, hit_record& rec) const {
+    set_plane_point(r, rec, 0, k);
+    rec.u = (rec.p.y()-y0)/(y1-y0);
+    rec.v = (rec.p.z()-z0)/(z1-z0);
     auto outward_normal = vector3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
+}
 
-    return true;
+uint32_t yz_rect::hit_packet(ray_packet& packet, uint32_t lanes) const {
+    double t[packet_size];
+    auto hits = rect_packet_hits(packet, k, packet.origin_x, packet.direction_x,
+        y0, y1, packet.origin_y, packet.direction_y,
+        z0, z1, packet.origin_z, packet.direction_z, t) & lanes;
+    packet.record_hits(hits, t, this);
+    return hits;
+}
+
+uint32_t yz_rect::occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+    double t[packet_size];
+    return rect_packet_hits(packet, k, packet.origin_x, packet.direction_x,
+        y0, y1, packet.origin_y, packet.direction_y,
+        z0, z1, packet.origin_z, packet.direction_z, t) & lanes;
 }
 
 #endif
@@ -0,0 +1,85 @@
+#ifndef ADAPTIVE_SAMPLING_H
+#define ADAPTIVE_SAMPLING_H
+
+#include "constants.h"
+
+#include "vec3.h"
+
+
+// Adaptive mode samples the image in square blocks of pixels, a batch per pixel at a time,
+// and stops a block once its estimate is good enough: once the RMS over its pixels of the
+// standard error of the mean luminance, relative to that mean, is within `max_error`. The
+// render's samples per pixel becomes the cap.
+//
+// Judging single pixels doesn't work: path samples are heavy tailed, so a pixel that has
+// not met a firefly yet looks converged and stops early. Pooled over a block the estimate
+// is steady.
+struct adaptive_settings {
+    bool enabled = false;
+    double max_error = 0.2;
+    int min_samples = 32;
+    int batch_size = 16;
+    int block_size = 8;
+};
+
+
+// Running mean and variance of one pixel's sample luminance (Welford's method), next to the
+// sum of the samples themselves.
+class pixel_estimate {
+    public:
+        pixel_estimate() : sum(0, 0, 0), count(0), mean(0), m2(0) {}
+
+        void add(const colour& sample) {
+            // NaN samples are dropped from the sum when written out; keep them out of the
+            // error estimate too.
+            auto y = 0.2126 * sample.x() + 0.7152 * sample.y() + 0.0722 * sample.z();
+            if (y != y)
+                y = 0;
+
+            sum += sample;
+            count++;
+            auto delta = y - mean;
+            mean += delta / count;
+            m2 += delta * (y - mean);
+        }
+
+        // Squared standard error of the mean relative to the mean. Pixels darker than
+        // `floor` are judged against it instead, so a nearly black pixel doesn't chase a tiny
+        // absolute error.
+        double relative_variance(double floor = 1e-3) const {
+            if (count < 2)
+                return infinity;
+            auto variance_of_mean = m2 / (count - 1) / count;
+            auto scale = mean > floor ? mean : floor;
+            return variance_of_mean / (scale * scale);
+        }
+
+    public:
+        colour sum;
+        int count;
+
+    private:
+        double mean;
+        double m2;
+};
+
+
+// Colour for a heatmap of samples taken, `t` being the fraction of the cap: black through
+// blue, red and yellow to white. Squared because the image writers apply gamma 2.
+colour heatmap_colour(double t) {
+    static const colour stops[] = {
+        colour(0, 0, 0), colour(0.1, 0.1, 0.8), colour(0.9, 0.1, 0.1),
+        colour(1, 0.9, 0.1), colour(1, 1, 1)
+    };
+    const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+
+    t = clamp(t, 0.0, 1.0) * last;
+    int k = static_cast<int>(t);
+    if (k >= last)
+        k = last - 1;
+    auto c = stops[k] + (t - k) * (stops[k + 1] - stops[k]);
+    return c * c;
+}
+
+
+#endif
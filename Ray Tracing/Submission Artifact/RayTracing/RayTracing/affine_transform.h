@@ -0,0 +1,137 @@
+#ifndef AFFINE_TRANSFORM_H
+#define AFFINE_TRANSFORM_H
+
+#include "constants.h"
+
+#include "aabb.h"
+
+
+// A 3x4 matrix: a linear map in the first three columns and a translation in the fourth.
+// Compose with *, where (a * b) applies b first.
+class affine_transform {
+    public:
+        affine_transform() {
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 4; j++)
+                    m[i][j] = i == j ? 1 : 0;
+        }
+
+        static affine_transform translation(const vector3& offset) {
+            affine_transform t;
+            for (int i = 0; i < 3; i++)
+                t.m[i][3] = offset[i];
+            return t;
+        }
+
+        static affine_transform scaling(const vector3& factors) {
+            affine_transform t;
+            for (int i = 0; i < 3; i++)
+                t.m[i][i] = factors[i];
+            return t;
+        }
+
+        // Right-handed rotation about `axis` through the origin.
+        static affine_transform rotation(const vector3& axis, double degrees) {
+            auto a = unit_vector(axis);
+            auto s = sin(degrees_to_radians(degrees));
+            auto c = cos(degrees_to_radians(degrees));
+            affine_transform t;
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    t.m[i][j] = (1 - c) * a[i] * a[j] + (i == j ? c : 0);
+            t.m[0][1] -= s * a[2];  t.m[1][0] += s * a[2];
+            t.m[0][2] += s * a[1];  t.m[2][0] -= s * a[1];
+            t.m[1][2] -= s * a[0];  t.m[2][1] += s * a[0];
+            return t;
+        }
+
+        affine_transform operator*(const affine_transform& b) const {
+            affine_transform t;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 4; j++) {
+                    t.m[i][j] = m[i][0]*b.m[0][j] + m[i][1]*b.m[1][j] + m[i][2]*b.m[2][j];
+                    if (j == 3)
+                        t.m[i][j] += m[i][3];
+                }
+            }
+            return t;
+        }
+
+        // Inverse by cofactors. The linear part must not be singular.
+        affine_transform inverse() const {
+            affine_transform t;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    int r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+                    int c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+                    t.m[i][j] = m[r0][c0]*m[r1][c1] - m[r0][c1]*m[r1][c0];
+                }
+            }
+            auto det = m[0][0]*t.m[0][0] + m[0][1]*t.m[1][0] + m[0][2]*t.m[2][0];
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    t.m[i][j] /= det;
+            for (int i = 0; i < 3; i++)
+                t.m[i][3] = -(t.m[i][0]*m[0][3] + t.m[i][1]*m[1][3] + t.m[i][2]*m[2][3]);
+            return t;
+        }
+
+        point apply_point(const point& p) const {
+            return point(
+                m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+        }
+
+        // A bound on the error in apply_point(p) for a p that is itself off by up to
+        // p_error: the error carried through the matrix plus that of three products and
+        // three sums per component.
+        vector3 apply_point_error(const point& p, const vector3& p_error) const {
+            auto g = rounding_gamma<double>(3);
+            vector3 error;
+            for (int i = 0; i < 3; i++) {
+                error[i] = g * (fabs(m[i][0]*p[0]) + fabs(m[i][1]*p[1]) + fabs(m[i][2]*p[2]) + fabs(m[i][3]))
+                         + (1 + g) * (fabs(m[i][0])*p_error[0] + fabs(m[i][1])*p_error[1] + fabs(m[i][2])*p_error[2]);
+            }
+            return error;
+        }
+
+        vector3 apply_vector(const vector3& v) const {
+            return vector3(
+                m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+        }
+
+        // Multiplies by the transpose of the linear part. Called on the inverse of a
+        // transform this carries normals through it.
+        vector3 apply_transposed(const vector3& v) const {
+            return vector3(
+                m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+                m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+                m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+        }
+
+        aabb apply_box(const aabb& box) const {
+            point lo( infinity,  infinity,  infinity);
+            point hi(-infinity, -infinity, -infinity);
+            for (int corner = 0; corner < 8; corner++) {
+                point p(
+                    (corner & 1 ? box.max() : box.min()).x(),
+                    (corner & 2 ? box.max() : box.min()).y(),
+                    (corner & 4 ? box.max() : box.min()).z());
+                auto q = apply_point(p);
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = fmin(lo[a], q[a]);
+                    hi[a] = fmax(hi[a], q[a]);
+                }
+            }
+            return aabb(lo, hi);
+        }
+
+    public:
+        double m[3][4];
+};
+
+
+#endif
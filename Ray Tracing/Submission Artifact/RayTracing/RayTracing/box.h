@@ -20,9 +20,22 @@
 class box: public hittable  {
     public:
         box() {}
-        box(const point& p0, const point& p1, shared_ptr<material> ptr);
+        box(const point& p0, const point& p1, const material* ptr);
 
         virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double t0, double t1) const {
+            return sides.occluded(r, t0, t1);
+        }
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const {
+            return sides.hit_packet(packet, lanes);
+        }
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+            return sides.occluded_packet(packet, lanes);
+        }
+
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {
+            sides.gather_light_shapes(shapes);
+        }
 
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             output_box = aabb(box_min, box_max);
@@ -36,7 +49,7 @@ class box: public hittable  {
 };
 
 
-box::box(const point& p0, const point& p1, shared_ptr<material> ptr) {
+box::box(const point& p0, const point& p1, const material* ptr) {
     box_min = p0;
     box_max = p1;
 
@@ -14,24 +14,67 @@
 #include "constants.h"
 
 #include "hittable.h"
+#include "hittable_list.h"
 
 #include <algorithm>
 
 
+enum class bvh_split {
+    random_median,  // random axis, split at the median object
+    sah             // binned surface area heuristic
+};
+
+
+struct bvh_options {
+    bvh_split split = bvh_split::random_median;
+
+    // SAH only: number of centroid bins per node, the largest leaf that may be created,
+    // and the cost of one node traversal relative to one primitive intersection.
+    int bins = 12;
+    int max_leaf_size = 4;
+    double traversal_cost = 0.5;
+    double intersection_cost = 1.0;
+
+    // Children per node of the flattened BVHs that render the scene: 2, or 4 or 8 for the
+    // binary tree collapsed into a wide one (see wide_bvh.h).
+    int width = 4;
+};
+
+
 class bvh_node : public hittable  {
     public:
         bvh_node();
 
-        bvh_node(hittable_list& list, double time0, double time1)
-            : bvh_node(list.objects, 0, list.objects.size(), time0, time1)
+        bvh_node(hittable_list& list, double time0, double time1,
+                 const bvh_options& options = bvh_options())
+            : bvh_node(list.objects, 0, list.objects.size(), time0, time1, options)
         {}
 
         bvh_node(
             std::vector<shared_ptr<hittable>>& objects,
-            size_t start, size_t end, double time0, double time1);
+            size_t start, size_t end, double time0, double time1,
+            const bvh_options& options = bvh_options());
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const;
+
+    private:
+        bvh_node(
+            std::vector<shared_ptr<hittable>>& objects,
+            size_t start, size_t mid, size_t end, double time0, double time1,
+            const bvh_options& options);
+
+        void build_children(
+            std::vector<shared_ptr<hittable>>& objects,
+            size_t start, size_t mid, size_t end, double time0, double time1,
+            const bvh_options& options);
+
+        static shared_ptr<hittable> build_subtree(
+            std::vector<shared_ptr<hittable>>& objects,
+            size_t start, size_t end, double time0, double time1,
+            const bvh_options& options);
 
     public:
         shared_ptr<hittable> left;
@@ -40,6 +83,98 @@ class bvh_node : public hittable  {
 };
 
 
+// Reorders [begin,end) about the cheapest of options.bins candidate planes along the longest
+// axis of the primitive centroids, scored with the surface area heuristic. Returns the first
+// element of the right-hand group, or begin when allow_leaf is set and keeping the range as
+// one leaf is cheaper than any split. bounds_of maps an element to its aabb.
+template <typename Iterator, typename BoundsFn>
+Iterator sah_partition(
+    Iterator begin, Iterator end, BoundsFn bounds_of, const bvh_options& options, bool allow_leaf
+) {
+    const auto count = static_cast<size_t>(end - begin);
+    const point empty_min( infinity,  infinity,  infinity);
+    const point empty_max(-infinity, -infinity, -infinity);
+
+    aabb bounds(empty_min, empty_max);
+    aabb centroid_bounds(empty_min, empty_max);
+    for (auto it = begin; it != end; ++it) {
+        auto b = bounds_of(*it);
+        auto c = 0.5 * (b.min() + b.max());
+        bounds = surrounding_box(bounds, b);
+        centroid_bounds = surrounding_box(centroid_bounds, aabb(c, c));
+    }
+
+    auto leaf_cost = options.intersection_cost * count;
+    auto can_leaf = allow_leaf && count <= static_cast<size_t>(options.max_leaf_size);
+
+    auto axis = centroid_bounds.longest_axis();
+    auto axis_min = centroid_bounds.min()[axis];
+    auto axis_extent = centroid_bounds.max()[axis] - axis_min;
+
+    // Every centroid coincides, so no plane separates them.
+    if (count < 2 || !(axis_extent > 0))
+        return can_leaf ? begin : begin + count/2;
+
+    const int bin_count = options.bins < 2 ? 2 : options.bins;
+    auto bin_of = [&](const aabb& b) {
+        auto c = 0.5 * (b.min()[axis] + b.max()[axis]);
+        auto index = static_cast<int>(bin_count * ((c - axis_min) / axis_extent));
+        return index < bin_count ? index : bin_count - 1;
+    };
+
+    std::vector<aabb> bin_bounds(bin_count, aabb(empty_min, empty_max));
+    std::vector<size_t> bin_sizes(bin_count, 0);
+    for (auto it = begin; it != end; ++it) {
+        auto b = bounds_of(*it);
+        auto index = bin_of(b);
+        bin_bounds[index] = surrounding_box(bin_bounds[index], b);
+        bin_sizes[index]++;
+    }
+
+    // Sweep from the right to get the area and size of every right-hand group, then from the
+    // left to score each plane.
+    std::vector<double> right_area(bin_count, 0);
+    std::vector<size_t> right_size(bin_count, 0);
+    aabb sweep(empty_min, empty_max);
+    size_t sweep_size = 0;
+    for (int i = bin_count - 1; i > 0; i--) {
+        sweep = surrounding_box(sweep, bin_bounds[i]);
+        sweep_size += bin_sizes[i];
+        right_area[i] = sweep_size ? sweep.area() : 0;
+        right_size[i] = sweep_size;
+    }
+
+    auto best_cost = infinity;
+    auto best_plane = 0;
+    sweep = aabb(empty_min, empty_max);
+    sweep_size = 0;
+    for (int i = 1; i < bin_count; i++) {
+        sweep = surrounding_box(sweep, bin_bounds[i-1]);
+        sweep_size += bin_sizes[i-1];
+        if (sweep_size == 0 || right_size[i] == 0)
+            continue;
+
+        auto cost = options.traversal_cost
+                  + options.intersection_cost
+                    * (sweep.area() * sweep_size + right_area[i] * right_size[i]) / bounds.area();
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_plane = i;
+        }
+    }
+
+    if (can_leaf && leaf_cost <= best_cost)
+        return begin;
+
+    if (best_plane == 0)
+        return begin + count/2;
+
+    return std::partition(begin, end, [&](const auto& e) {
+        return bin_of(bounds_of(e)) < best_plane;
+    });
+}
+
+
 inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
     aabb box_a;
     aabb box_b;
@@ -64,10 +199,32 @@ bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b)
 }
 
 
+// Bounds of a scene object over the shutter interval, as sah_partition wants them.
+struct object_bounds {
+    double time0, time1;
+
+    aabb operator()(const shared_ptr<hittable>& object) const {
+        aabb b;
+        if (!object->bounding_box(time0, time1, b))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+        return b;
+    }
+};
+
+
 bvh_node::bvh_node(
     std::vector<shared_ptr<hittable>>& objects,
-    size_t start, size_t end, double time0, double time1
+    size_t start, size_t end, double time0, double time1,
+    const bvh_options& options
 ) {
+    if (options.split == bvh_split::sah && end - start > 2) {
+        auto split = sah_partition(
+            objects.begin() + start, objects.begin() + end, object_bounds{time0, time1}, options, false);
+        build_children(
+            objects, start, static_cast<size_t>(split - objects.begin()), end, time0, time1, options);
+        return;
+    }
+
     int axis = random_int(0,2);
     auto comparator = (axis == 0) ? box_x_compare
                     : (axis == 1) ? box_y_compare
@@ -89,8 +246,8 @@ bvh_node::bvh_node(
         std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
         auto mid = start + object_span/2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+        left = make_shared<bvh_node>(objects, start, mid, time0, time1, options);
+        right = make_shared<bvh_node>(objects, mid, end, time0, time1, options);
     }
 
     aabb box_left, box_right;
@@ -104,6 +261,57 @@ bvh_node::bvh_node(
 }
 
 
+bvh_node::bvh_node(
+    std::vector<shared_ptr<hittable>>& objects,
+    size_t start, size_t mid, size_t end, double time0, double time1,
+    const bvh_options& options
+) {
+    build_children(objects, start, mid, end, time0, time1, options);
+}
+
+
+void bvh_node::build_children(
+    std::vector<shared_ptr<hittable>>& objects,
+    size_t start, size_t mid, size_t end, double time0, double time1,
+    const bvh_options& options
+) {
+    left = build_subtree(objects, start, mid, time0, time1, options);
+    right = build_subtree(objects, mid, end, time0, time1, options);
+
+    aabb box_left, box_right;
+
+    if (  !left->bounding_box (time0, time1, box_left)
+       || !right->bounding_box(time0, time1, box_right)
+    )
+        std::cerr << "No bounding box in bvh_node constructor.\n";
+
+    box = surrounding_box(box_left, box_right);
+}
+
+
+shared_ptr<hittable> bvh_node::build_subtree(
+    std::vector<shared_ptr<hittable>>& objects,
+    size_t start, size_t end, double time0, double time1,
+    const bvh_options& options
+) {
+    if (end - start == 1)
+        return objects[start];
+
+    auto split = sah_partition(
+        objects.begin() + start, objects.begin() + end, object_bounds{time0, time1}, options, true);
+    auto mid = static_cast<size_t>(split - objects.begin());
+
+    if (mid == start) {
+        auto leaf = make_shared<hittable_list>();
+        for (auto i = start; i < end; i++)
+            leaf->add(objects[i]);
+        return leaf;
+    }
+
+    return shared_ptr<hittable>(new bvh_node(objects, start, mid, end, time0, time1, options));
+}
+
+
 bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     if (!box.hit(r, t_min, t_max))
         return false;
@@ -115,10 +323,26 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 }
 
 
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+    if (!box.hit(r, t_min, t_max))
+        return false;
+
+    return left->occluded(r, t_min, t_max) || right->occluded(r, t_min, t_max);
+}
+
+
 bool bvh_node::bounding_box(double t0, double t1, aabb& output_box) const {
     output_box = box;
     return true;
 }
 
 
+void bvh_node::gather_light_shapes(std::vector<light_shape>& shapes) const {
+    // A node over a single object holds it as both children.
+    left->gather_light_shapes(shapes);
+    if (right != left)
+        right->gather_light_shapes(shapes);
+}
+
+
 #endif
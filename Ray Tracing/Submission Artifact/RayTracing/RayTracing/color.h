@@ -13,29 +13,44 @@
 
 #include "vec3.h"
 
-#include <iostream>
+#include <cstddef>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COLOR_USE_SSE2 1
+#include <emmintrin.h>
+#endif
 
-void write_color(std::ostream &out, colour pixel_color, int samples_per_pixel) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
-    // Replace NaN components with zero. See explanation in Ray Tracing: The Rest of Your Life.
-    if (r != r) r = 0.0;
-    if (g != g) g = 0.0;
-    if (b != b) b = 0.0;
 
-    // Divide the color by the number of samples and gamma-correct for gamma=2.0.
-    auto scale = 1.0 / samples_per_pixel;
-    r = sqrt(scale * r);
-    g = sqrt(scale * g);
-    b = sqrt(scale * b);
+// Converts `count` summed sample components to bytes: divide by the number of samples,
+// gamma-correct for gamma=2.0 and scale to [0,255]. NaN components come out as zero. See
+// explanation in Ray Tracing: The Rest of Your Life.
+void colour_to_bytes(const float* sums, size_t count, int samples_per_pixel, unsigned char* out) {
+    const float scale = 1.0f / samples_per_pixel;
+    size_t k = 0;
+
+#ifdef COLOR_USE_SSE2
+    // Sixteen components per step. max(NaN, 0) is 0 in SSE, which also takes care of NaN.
+    const auto s = _mm_set1_ps(scale);
+    const auto zero = _mm_setzero_ps();
+    const auto full = _mm_set1_ps(256.0f);
+    const auto top = _mm_set1_ps(255.0f);
+    auto convert = [&](const float* p) {
+        auto v = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(p), s), zero);
+        v = _mm_min_ps(_mm_mul_ps(_mm_sqrt_ps(v), full), top);
+        return _mm_cvttps_epi32(v);
+    };
+    for (; k + 16 <= count; k += 16) {
+        auto lo = _mm_packs_epi32(convert(sums + k), convert(sums + k + 4));
+        auto hi = _mm_packs_epi32(convert(sums + k + 8), convert(sums + k + 12));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + k), _mm_packus_epi16(lo, hi));
+    }
+#endif
 
-    // Write the translated [0,255] value of each color component.
-    out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
+    for (; k < count; k++) {
+        auto v = sums[k] * scale;
+        v = v > 0 ? sqrt(v) * 256.0f : 0.0f;
+        out[k] = static_cast<unsigned char>(v < 255.0f ? v : 255.0f);
+    }
 }
 
 
@@ -81,7 +81,10 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
     rec.normal = vector3(1,0,0);  // arbitrary
     rec.front_face = true;     // also arbitrary
-    rec.mat_ptr = phase_function;
+    rec.p_error = vector3(0,0,0);           // no surface to leave, so rays scatter from p itself
+    rec.geometric_normal = vector3(0,0,0);
+    rec.mat_ptr = phase_function.get();
+    rec.object = this;
 
     return true;
 }
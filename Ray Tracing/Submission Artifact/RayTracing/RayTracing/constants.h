@@ -2,10 +2,13 @@
 #define CONSTANTS_H
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
 
+#include "sampler.h"
+
 
 // Usings
 
@@ -30,8 +33,69 @@ inline double clamp(double x, double min, double max) {
 	return x;
 }
 
+// A bound on the relative error gathered by n rounded operations in type T: (1 + u)^n - 1,
+// where u is the unit roundoff, is at most n u / (1 - n u).
+template <typename T>
+inline constexpr T rounding_gamma(int n) {
+	return n * (std::numeric_limits<T>::epsilon() / 2) / (1 - n * (std::numeric_limits<T>::epsilon() / 2));
+}
+
+// Counter-based random numbers. Each value is addressed by a stream key and the index of the
+// draw (its dimension), so there is no shared state to lock and a pixel sample sees the
+// same numbers no matter which thread renders it. Once seeded for a pixel sample the values
+// come from the active sampler; before that (building BVHs, textures) they are independent.
+class random_stream {
+public:
+	constexpr random_stream() : method(nullptr), pixel(0), sample(0), key(0), dimension(0) {}
+
+	void seed(uint64_t pixel, uint64_t sample) {
+		method = &active_sampler();
+		this->pixel = pixel;
+		this->sample = sample;
+		key = sampler::independent_key(pixel, sample);
+		dimension = 0;
+	}
+
+	double next_double() {
+		auto d = dimension++;
+		if (!method || method->type_of() == sampler_type::independent)
+			return sampler::independent_value(key, d);
+		return method->get_1d(pixel, sample, static_cast<uint32_t>(d));
+	}
+
+	sample_2d next_2d() {
+		auto d = dimension;
+		dimension += 2;
+		if (!method || method->type_of() == sampler_type::independent)
+			return { sampler::independent_value(key, d), sampler::independent_value(key, d + 1) };
+		return method->get_2d(pixel, sample, static_cast<uint32_t>(d));
+	}
+
+private:
+	const sampler* method;
+	uint64_t pixel;
+	uint64_t sample;
+	uint64_t key;
+	uint64_t dimension;
+};
+
+inline random_stream& thread_random_stream() {
+	thread_local random_stream stream;
+	return stream;
+}
+
+inline void seed_random(uint64_t pixel, uint64_t sample) {
+	// Restarts the calling thread's stream at the first dimension of a pixel sample.
+	thread_random_stream().seed(pixel, sample);
+}
+
 inline double random_double() {
-	return rand() / (RAND_MAX + 1.0);
+	return thread_random_stream().next_double();
+}
+
+inline sample_2d random_2d() {
+	// Two dimensions drawn together, so samplers that stratify in 2D can.
+	return thread_random_stream().next_2d();
 }
 
 inline double random_double(double min, double max) {
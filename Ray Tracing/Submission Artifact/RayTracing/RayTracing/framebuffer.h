@@ -0,0 +1,41 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "constants.h"
+
+#include <vector>
+
+
+// Float RGB accumulation buffer. Pixel (i,j) uses the camera convention of main(): i runs
+// left to right and j bottom to top. Rows are stored top row first, the order they are
+// written out in, so each tile touches a disjoint set of entries and needs no locking.
+class framebuffer {
+    public:
+        framebuffer() : width(0), height(0) {}
+        framebuffer(int w, int h) : width(w), height(h), pixels(3 * static_cast<size_t>(w) * h, 0.0f) {}
+
+        void set(int i, int j, const colour& c) {
+            auto index = offset(i, j);
+            pixels[index]   = static_cast<float>(c.x());
+            pixels[index+1] = static_cast<float>(c.y());
+            pixels[index+2] = static_cast<float>(c.z());
+        }
+
+        colour at(int i, int j) const {
+            auto index = offset(i, j);
+            return colour(pixels[index], pixels[index+1], pixels[index+2]);
+        }
+
+    private:
+        size_t offset(int i, int j) const {
+            return 3 * (static_cast<size_t>(height - 1 - j) * width + i);
+        }
+
+    public:
+        int width;
+        int height;
+        std::vector<float> pixels;
+};
+
+
+#endif
@@ -15,7 +15,10 @@
 
 #include "aabb.h"
 
+#include <vector>
 
+
+class hittable;
 class material;
 
 void get_sphere_uv(const point& p, double& u, double& v) {
@@ -26,19 +29,118 @@ void get_sphere_uv(const point& p, double& u, double& v) {
 }
 
 
+// hit() only has to fill in t and object, the primitive that was hit. Everything else is
+// filled in by object->finalize_hit() once traversal has settled on the closest hit, so
+// normals, texture coordinates and materials are worked out once per ray.
 struct hit_record {
     point p;
     vector3 normal;
-    shared_ptr<material> mat_ptr;
+    const material* mat_ptr;
     double t;
     double u;
     double v;
     bool front_face;
+    const hittable* object;
+    const hittable* leaf;   // set by instance: what was hit inside it
+    uint32_t primitive;     // which part of object was hit, for objects made of many
+
+    // A bound on the rounding error in each component of p, and the unit normal of the
+    // true surface there, facing either way. A point inside a volume has a zero normal.
+    vector3 p_error;
+    vector3 geometric_normal;
 
     inline void set_face_normal(const ray& r, const vector3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal :-outward_normal;
     }
+
+    // A ray leaving p towards `direction`. Its origin is pushed off the surface along the
+    // geometric normal, to the side the ray leaves by, past the bound on p's error, so the
+    // ray can't find the surface it starts on again and needs no epsilon t_min. The bound
+    // takes in p rounded to float as well, which is how the BVHs and float meshes see it.
+    ray spawn_ray(const vector3& direction, double time) const {
+        double distance = 0;
+        for (int a = 0; a < 3; a++)
+            distance += fabs(geometric_normal[a]) * (p_error[a] + rounding_gamma<float>(2) * fabs(p[a]));
+        auto offset = distance * geometric_normal;
+        if (dot(direction, geometric_normal) < 0)
+            offset = -offset;
+
+        // Adding the offset rounds too, so step once more away from the surface.
+        auto origin = p + offset;
+        for (int a = 0; a < 3; a++) {
+            if (offset[a] > 0)
+                origin[a] = std::nextafter(origin[a], infinity);
+            else if (offset[a] < 0)
+                origin[a] = std::nextafter(origin[a], -infinity);
+        }
+        return ray(origin, direction, time);
+    }
+};
+
+
+// Up to packet_size rays traced together, each in a lane of its own. The rays are kept
+// whole for objects that test them one at a time, and split into arrays of components for
+// tests that run across the lanes. Every lane has its own t_max and record; calls take a
+// bit mask of the lanes they work on.
+const int packet_size = 8;
+
+struct ray_packet {
+    ray_packet() {
+        // Unused lanes still go through the lane loops, so give them a harmless ray.
+        for (int i = 0; i < packet_size; i++)
+            set(i, ray(point(0, 0, 0), vector3(1, 1, 1)), 0);
+    }
+
+    void set(int lane, const ray& r, double lane_t_max) {
+        rays[lane] = r;
+        origin_x[lane] = r.origin().x();
+        origin_y[lane] = r.origin().y();
+        origin_z[lane] = r.origin().z();
+        direction_x[lane] = r.direction().x();
+        direction_y[lane] = r.direction().y();
+        direction_z[lane] = r.direction().z();
+        t_max[lane] = lane_t_max;
+    }
+
+    // Records hits by `object` at distances t in the lanes of `hits`.
+    void record_hits(uint32_t hits, const double* t, const hittable* object) {
+        for (int i = 0; i < packet_size; i++) {
+            if (in_lanes(hits, i)) {
+                t_max[i] = t[i];
+                records[i].t = t[i];
+                records[i].object = object;
+            }
+        }
+    }
+
+    static bool in_lanes(uint32_t lanes, int lane) { return (lanes >> lane) & 1; }
+
+    ray rays[packet_size];
+    double origin_x[packet_size], origin_y[packet_size], origin_z[packet_size];
+    double direction_x[packet_size], direction_y[packet_size], direction_z[packet_size];
+    double t_min = 0;
+    double t_max[packet_size];
+    hit_record records[packet_size];
+
+    // Each lane's random stream, if set. Objects tested lane by lane may draw random
+    // numbers, as participating media do, and each lane then draws from its own.
+    random_stream* streams = nullptr;
+};
+
+
+// A shape that can sample directions towards itself through pdf_value() and random(), with
+// what it takes to judge how much light it gives off: its material, a point to look the
+// emission up at and its surface area. `object` is what a hit on it names in rec.object,
+// which is a wrapper for a flipped shape. `normal` is the side a flat shape emits towards,
+// or zero for a shape that emits every way.
+struct light_shape {
+    const hittable* shape;
+    const hittable* object;
+    const material* mat;
+    point centre;
+    double area;
+    vector3 normal;
 };
 
 
@@ -46,6 +148,50 @@ class hittable {
     public:
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const = 0;
+
+        // Completes a record this object's hit() produced for the same ray. Objects whose
+        // hit() already fills in the whole record leave this empty.
+        virtual void finalize_hit(const ray& r, hit_record& rec) const {}
+
+        // True if anything lies along the ray within (t_min, t_max). Stops at the first hit
+        // found, in any order, and never finalizes a record. Visibility tests should use this.
+        // Primitives whose hit() only sets t can rely on this default.
+        virtual bool occluded(const ray& r, double t_min, double t_max) const {
+            hit_record rec;
+            return hit(r, t_min, t_max, rec);
+        }
+
+        // hit() and occluded() for the packet lanes in `lanes`, returning the lanes that hit
+        // or are blocked. hit_packet lowers a lane's t_max to each hit it records. Objects
+        // that can test many rays at once override these; the defaults go lane by lane.
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const {
+            uint32_t hits = 0;
+            for (int i = 0; i < packet_size; i++) {
+                if (!ray_packet::in_lanes(lanes, i))
+                    continue;
+                if (packet.streams) thread_random_stream() = packet.streams[i];
+                if (hit(packet.rays[i], packet.t_min, packet.t_max[i], packet.records[i])) {
+                    packet.t_max[i] = packet.records[i].t;
+                    hits |= 1u << i;
+                }
+                if (packet.streams) packet.streams[i] = thread_random_stream();
+            }
+            return hits;
+        }
+
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+            uint32_t blocked = 0;
+            for (int i = 0; i < packet_size; i++) {
+                if (!ray_packet::in_lanes(lanes, i))
+                    continue;
+                if (packet.streams) thread_random_stream() = packet.streams[i];
+                if (occluded(packet.rays[i], packet.t_min, packet.t_max[i]))
+                    blocked |= 1u << i;
+                if (packet.streams) packet.streams[i] = thread_random_stream();
+            }
+            return blocked;
+        }
+
 		virtual double pdf_value(const point& o, const vector3& v) const {
 			return 0.0;
 		}
@@ -53,6 +199,20 @@ class hittable {
 		virtual vector3 random(const vector3& o) const {
 			return vector3(1, 0, 0);
 		}
+
+		// random() along with the pdf_value() of the direction it returns, for shapes that
+		// can share the work between the two.
+		virtual vector3 random_with_pdf(const point& o, double& pdf) const {
+			auto v = random(o);
+			pdf = pdf_value(o, v);
+			return v;
+		}
+
+        // Adds the shapes in this object that can be sampled as lights to `shapes`. Those
+        // whose material emits become the scene's lights. Containers pass the call on;
+        // transforms and meshes don't, so anything emitting inside them is only found by
+        // scattering into it.
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {}
 };
 
 
@@ -64,14 +224,46 @@ class flip_face : public hittable {
             if (!ptr->hit(r, t_min, t_max, rec))
                 return false;
 
+            rec.object->finalize_hit(r, rec);
             rec.front_face = !rec.front_face;
+            rec.object = this;
             return true;
         }
 
+        virtual bool occluded(const ray& r, double t_min, double t_max) const {
+            return ptr->occluded(r, t_min, t_max);
+        }
+
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const {
+            auto hits = ptr->hit_packet(packet, lanes);
+            for (int i = 0; i < packet_size; i++) {
+                if (ray_packet::in_lanes(hits, i)) {
+                    auto& rec = packet.records[i];
+                    rec.object->finalize_hit(packet.rays[i], rec);
+                    rec.front_face = !rec.front_face;
+                    rec.object = this;
+                }
+            }
+            return hits;
+        }
+
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+            return ptr->occluded_packet(packet, lanes);
+        }
+
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             return ptr->bounding_box(t0, t1, output_box);
         }
 
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {
+            auto first = shapes.size();
+            ptr->gather_light_shapes(shapes);
+            for (auto i = first; i < shapes.size(); i++) {
+                shapes[i].object = this;
+                shapes[i].normal = -shapes[i].normal;
+            }
+        }
+
     public:
         shared_ptr<hittable> ptr;
 };
@@ -83,6 +275,9 @@ class translate : public hittable {
             : ptr(p), offset(displacement) {}
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const {
+            return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+        }
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
     public:
@@ -96,8 +291,12 @@ bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
 
+    // The wrapped object needs the moved ray to finish its record, so do it here.
+    rec.object->finalize_hit(moved_r, rec);
     rec.p += offset;
+    rec.p_error += rounding_gamma<double>(1) * abs(rec.p);
     rec.set_face_normal(moved_r, rec.normal);
+    rec.object = this;
 
     return true;
 }
@@ -120,11 +319,16 @@ class rotate_y : public hittable {
         rotate_y(shared_ptr<hittable> p, double angle);
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const {
+            return ptr->occluded(rotate(r), t_min, t_max);
+        }
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             output_box = bbox;
             return hasbox;
         }
 
+        ray rotate(const ray& r) const;
+
     public:
         shared_ptr<hittable> ptr;
         double sin_theta;
@@ -167,7 +371,8 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 }
 
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// Takes a world-space ray into the object's unrotated frame.
+ray rotate_y::rotate(const ray& r) const {
     point origin = r.origin();
     vector3 direction = r.direction();
 
@@ -177,11 +382,17 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
     direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
+    return ray(origin, direction, r.time());
+}
+
+
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    ray rotated_r = rotate(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
 
+    rec.object->finalize_hit(rotated_r, rec);
     point p = rec.p;
     vector3 normal = rec.normal;
 
@@ -191,8 +402,22 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     normal[0] =  cos_theta*rec.normal[0] + sin_theta*rec.normal[2];
     normal[2] = -sin_theta*rec.normal[0] + cos_theta*rec.normal[2];
 
+    // Each rotated component is two products and a sum, each rounded.
+    auto g = rounding_gamma<double>(2);
+    auto c = fabs(cos_theta), s = fabs(sin_theta);
+    vector3 p_error = rec.p_error;
+    p_error[0] = (1 + g) * (c*rec.p_error[0] + s*rec.p_error[2]) + g * (c*fabs(rec.p[0]) + s*fabs(rec.p[2]));
+    p_error[2] = (1 + g) * (s*rec.p_error[0] + c*rec.p_error[2]) + g * (s*fabs(rec.p[0]) + c*fabs(rec.p[2]));
+
+    vector3 geometric_normal = rec.geometric_normal;
+    geometric_normal[0] =  cos_theta*rec.geometric_normal[0] + sin_theta*rec.geometric_normal[2];
+    geometric_normal[2] = -sin_theta*rec.geometric_normal[0] + cos_theta*rec.geometric_normal[2];
+
     rec.p = p;
+    rec.p_error = p_error;
+    rec.geometric_normal = geometric_normal;
     rec.set_face_normal(rotated_r, normal);
+    rec.object = this;
 
     return true;
 }
@@ -27,9 +27,16 @@ class hittable_list: public hittable  {
         void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
         virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const;
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const;
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 		virtual double pdf_value(const vector3& o, const vector3& v) const;
 		virtual vector3 random(const vector3& o) const;
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {
+            for (const auto& object : objects)
+                object->gather_light_shapes(shapes);
+        }
 
     public:
         std::vector<shared_ptr<hittable>> objects;
@@ -37,15 +44,14 @@ class hittable_list: public hittable  {
 
 
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
     auto hit_anything = false;
     auto closest_so_far = t_max;
 
+    // hit() only writes rec when it finds a closer hit, so no scratch record is needed.
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (object->hit(r, t_min, closest_so_far, rec)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
 
@@ -53,6 +59,36 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 }
 
 
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+    for (const auto& object : objects)
+        if (object->occluded(r, t_min, t_max))
+            return true;
+
+    return false;
+}
+
+
+uint32_t hittable_list::hit_packet(ray_packet& packet, uint32_t lanes) const {
+    uint32_t hits = 0;
+    for (const auto& object : objects)
+        hits |= object->hit_packet(packet, lanes);
+
+    return hits;
+}
+
+
+uint32_t hittable_list::occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+    uint32_t blocked = 0;
+    for (const auto& object : objects) {
+        blocked |= object->occluded_packet(packet, lanes & ~blocked);
+        if (blocked == lanes)
+            break;
+    }
+
+    return blocked;
+}
+
+
 bool hittable_list::bounding_box(double t0, double t1, aabb& output_box) const {
     if (objects.empty()) return false;
 
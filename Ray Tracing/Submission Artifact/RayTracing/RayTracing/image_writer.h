@@ -0,0 +1,240 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "constants.h"
+
+#include "color.h"
+#include "framebuffer.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// Writes a finished framebuffer once, in one of
+//   ppm  binary P6, 8 bits per component, gamma 2
+//   png  8-bit RGB, gamma 2, stored without compression
+//   pfm  32-bit float RGB, linear, for HDR work
+// Each image is put together in memory and written with a single call.
+enum class image_format {
+    ppm,
+    png,
+    pfm
+};
+
+
+// Picks the format from a file name's extension. Returns false for one it doesn't know.
+bool image_format_for(const std::string& filename, image_format& format) {
+    auto dot = filename.find_last_of('.');
+    auto extension = dot == std::string::npos ? std::string() : filename.substr(dot + 1);
+    for (auto& c : extension)
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+
+    if (extension == "ppm") format = image_format::ppm;
+    else if (extension == "png") format = image_format::png;
+    else if (extension == "pfm") format = image_format::pfm;
+    else return false;
+    return true;
+}
+
+
+namespace image_detail {
+
+inline void append(std::vector<unsigned char>& out, const void* data, size_t size) {
+    auto p = static_cast<const unsigned char*>(data);
+    out.insert(out.end(), p, p + size);
+}
+
+inline void append_big_endian(std::vector<unsigned char>& out, uint32_t value) {
+    unsigned char bytes[4] = {
+        static_cast<unsigned char>(value >> 24), static_cast<unsigned char>(value >> 16),
+        static_cast<unsigned char>(value >> 8),  static_cast<unsigned char>(value) };
+    append(out, bytes, 4);
+}
+
+// Slicing-by-8: table k gives the CRC of a byte followed by k zero bytes, so eight bytes are
+// folded in per step rather than one.
+inline uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(8 * 256);
+        for (uint32_t n = 0; n < 256; n++) {
+            auto c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        for (int k = 1; k < 8; k++)
+            for (int n = 0; n < 256; n++)
+                t[k*256 + n] = (t[(k-1)*256 + n] >> 8) ^ t[t[(k-1)*256 + n] & 0xFF];
+        return t;
+    }();
+    const auto t = table.data();
+
+    auto word = [](const unsigned char* p) {
+        return p[0] | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+    };
+
+    crc = ~crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        auto one = crc ^ word(data);
+        auto two = word(data + 4);
+        crc = t[7*256 + (one & 0xFF)] ^ t[6*256 + ((one >> 8) & 0xFF)]
+            ^ t[5*256 + ((one >> 16) & 0xFF)] ^ t[4*256 + (one >> 24)]
+            ^ t[3*256 + (two & 0xFF)] ^ t[2*256 + ((two >> 8) & 0xFF)]
+            ^ t[1*256 + ((two >> 16) & 0xFF)] ^ t[two >> 24];
+    }
+    for (; size > 0; size--)
+        crc = t[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline uint32_t adler32(const unsigned char* data, size_t size, uint32_t adler = 1) {
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (size > 0) {
+        // 5552 bytes is the most that can be summed before b could overflow.
+        auto block = size < 5552 ? size : 5552;
+        size -= block;
+        while (block--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+// A chunk is its length, type and data followed by a CRC of the type and data. The data is
+// whatever `fill` appends to `out`.
+template <typename Fill>
+void append_png_chunk(std::vector<unsigned char>& out, const char* type, uint32_t size, Fill fill) {
+    append_big_endian(out, size);
+    auto start = out.size();
+    append(out, type, 4);
+    fill();
+    append_big_endian(out, crc32(out.data() + start, out.size() - start));
+}
+
+} // namespace image_detail
+
+
+void encode_ppm(const framebuffer& image, int samples_per_pixel, std::vector<unsigned char>& out) {
+    auto header = "P6\n" + std::to_string(image.width) + ' ' + std::to_string(image.height) + "\n255\n";
+    out.assign(header.begin(), header.end());
+    auto start = out.size();
+    out.resize(start + image.pixels.size());
+    colour_to_bytes(image.pixels.data(), image.pixels.size(), samples_per_pixel, out.data() + start);
+}
+
+
+// The pixel rows, each after a "no filter" byte, go into deflate blocks that are stored as
+// they are. Encoding costs little more than a copy; the file is as large as a P6.
+void encode_png(const framebuffer& image, int samples_per_pixel, std::vector<unsigned char>& out) {
+    using namespace image_detail;
+
+    size_t row_bytes = 3 * static_cast<size_t>(image.width);
+    std::vector<unsigned char> raw((row_bytes + 1) * image.height);
+    for (int row = 0; row < image.height; row++) {
+        auto line = raw.data() + row * (row_bytes + 1);
+        line[0] = 0;
+        colour_to_bytes(image.pixels.data() + row * row_bytes, row_bytes, samples_per_pixel, line + 1);
+    }
+
+    const size_t block_size = 65535;
+    auto blocks = (raw.size() + block_size - 1) / block_size;
+    auto stream_size = 2 + 5 * blocks + raw.size() + 4;
+
+    const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    out.clear();
+    out.reserve(8 + 25 + 12 + stream_size + 12);
+    append(out, signature, 8);
+
+    append_png_chunk(out, "IHDR", 13, [&] {
+        append_big_endian(out, static_cast<uint32_t>(image.width));
+        append_big_endian(out, static_cast<uint32_t>(image.height));
+        const unsigned char format[5] = { 8, 2, 0, 0, 0 };     // 8-bit RGB, no interlace
+        append(out, format, 5);
+    });
+
+    append_png_chunk(out, "IDAT", static_cast<uint32_t>(stream_size), [&] {
+        const unsigned char zlib_header[2] = { 0x78, 0x01 };
+        append(out, zlib_header, 2);
+        for (size_t done = 0; done < raw.size(); done += block_size) {
+            auto block = raw.size() - done < block_size ? raw.size() - done : block_size;
+            const unsigned char block_header[5] = {
+                static_cast<unsigned char>(done + block == raw.size() ? 1 : 0),
+                static_cast<unsigned char>(block), static_cast<unsigned char>(block >> 8),
+                static_cast<unsigned char>(~block), static_cast<unsigned char>(~block >> 8) };
+            append(out, block_header, 5);
+            append(out, raw.data() + done, block);
+        }
+        append_big_endian(out, adler32(raw.data(), raw.size()));
+    });
+
+    append_png_chunk(out, "IEND", 0, [] {});
+}
+
+
+// Little-endian floats, bottom row first, averaged over the samples but otherwise as
+// rendered. NaNs are written as zero as in the 8-bit formats.
+void encode_pfm(const framebuffer& image, int samples_per_pixel, std::vector<unsigned char>& out) {
+    auto header = "PF\n" + std::to_string(image.width) + ' ' + std::to_string(image.height) + "\n-1.0\n";
+    out.assign(header.begin(), header.end());
+
+    const float scale = 1.0f / samples_per_pixel;
+    size_t row_floats = 3 * static_cast<size_t>(image.width);
+    auto start = out.size();
+    out.resize(start + 4 * image.pixels.size());
+    auto p = out.data() + start;
+
+    for (int r = image.height - 1; r >= 0; r--) {
+        auto source = image.pixels.data() + r * row_floats;
+        for (size_t k = 0; k < row_floats; k++, p += 4) {
+            // Written little endian whatever order this machine keeps floats in.
+            auto value = source[k] == source[k] ? source[k] * scale : 0.0f;
+            uint32_t bits;
+            memcpy(&bits, &value, 4);
+            p[0] = static_cast<unsigned char>(bits);
+            p[1] = static_cast<unsigned char>(bits >> 8);
+            p[2] = static_cast<unsigned char>(bits >> 16);
+            p[3] = static_cast<unsigned char>(bits >> 24);
+        }
+    }
+}
+
+
+bool write_image(std::ostream& out, image_format format, const framebuffer& image, int samples_per_pixel) {
+    std::vector<unsigned char> encoded;
+    switch (format) {
+        case image_format::ppm: encode_ppm(image, samples_per_pixel, encoded); break;
+        case image_format::png: encode_png(image, samples_per_pixel, encoded); break;
+        case image_format::pfm: encode_pfm(image, samples_per_pixel, encoded); break;
+    }
+    out.write(reinterpret_cast<const char*>(encoded.data()), static_cast<std::streamsize>(encoded.size()));
+    out.flush();
+    return static_cast<bool>(out);
+}
+
+
+// Writes `image` to `filename` in the format its extension names.
+bool write_image(const std::string& filename, const framebuffer& image, int samples_per_pixel) {
+    image_format format;
+    if (!image_format_for(filename, format)) {
+        std::cerr << "ERROR: Unknown image format for '" << filename << "'; use .ppm, .png or .pfm.\n";
+        return false;
+    }
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out || !write_image(out, format, image, samples_per_pixel)) {
+        std::cerr << "ERROR: Could not write image file '" << filename << "'.\n";
+        return false;
+    }
+    return true;
+}
+
+
+#endif
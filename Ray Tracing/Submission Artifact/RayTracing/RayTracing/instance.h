@@ -0,0 +1,108 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "constants.h"
+
+#include "affine_transform.h"
+#include "hittable.h"
+
+
+// A placed copy of a shared object. The object keeps its own acceleration structure (the
+// bottom level) and is only referenced, so a thousand copies of one mesh cost one mesh and
+// a thousand of these records; a linear_bvh over instances forms the top level.
+//
+// Rays are taken into object space rather than the object into world space. The transform
+// is affine, so t means the same distance along the ray in both spaces and needs no
+// rescaling.
+//
+// On a hit the instance reports itself as rec.object and keeps the primitive that was hit
+// in rec.leaf, so finalize_hit() can finish the record in object space and bring it back.
+class instance : public hittable {
+    public:
+        instance() {}
+
+        instance(shared_ptr<hittable> object, const affine_transform& object_to_world)
+            : object(object), object_to_world(object_to_world),
+              world_to_object(object_to_world.inverse())
+        {
+            aabb object_box;
+            has_box = object->bounding_box(0, 1, object_box);
+            if (has_box)
+                box = object_to_world.apply_box(object_box);
+        }
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual void finalize_hit(const ray& r, hit_record& rec) const;
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const {
+            return object->occluded(to_object(r), t_min, t_max);
+        }
+
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+            output_box = box;
+            return has_box;
+        }
+
+    private:
+        ray to_object(const ray& r) const {
+            return ray(world_to_object.apply_point(r.origin()),
+                       world_to_object.apply_vector(r.direction()), r.time());
+        }
+
+        void to_world(hit_record& rec) const {
+            rec.p_error = object_to_world.apply_point_error(rec.p, rec.p_error);
+            rec.p = object_to_world.apply_point(rec.p);
+            rec.normal = unit_vector(world_to_object.apply_transposed(rec.normal));
+            if (rec.geometric_normal.length_squared() > 0)
+                rec.geometric_normal = unit_vector(world_to_object.apply_transposed(rec.geometric_normal));
+        }
+
+    public:
+        shared_ptr<hittable> object;
+        affine_transform object_to_world;
+        affine_transform world_to_object;
+        aabb box;
+        bool has_box;
+};
+
+
+bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    // rec.leaf is only meaningful while rec.object is an instance. Clearing it shows whether
+    // the object below reported an instance of its own, and on a miss it is put back for
+    // whichever closer hit rec already holds.
+    auto previous_leaf = rec.leaf;
+    rec.leaf = nullptr;
+
+    ray local = to_object(r);
+    if (!object->hit(local, t_min, t_max, rec)) {
+        rec.leaf = previous_leaf;
+        return false;
+    }
+
+    if (rec.leaf) {
+        // Nested instance: finish it here, in this instance's object space, and report a
+        // complete record.
+        rec.object->finalize_hit(local, rec);
+        to_world(rec);
+        rec.leaf = nullptr;
+    } else {
+        rec.leaf = rec.object;
+    }
+
+    rec.object = this;
+    return true;
+}
+
+
+void instance::finalize_hit(const ray& r, hit_record& rec) const {
+    if (!rec.leaf)
+        return;     // already finished in hit()
+
+    // The dot product of ray and normal keeps its sign through the transform, so the
+    // front_face the leaf works out in object space holds in world space too.
+    rec.leaf->finalize_hit(to_object(r), rec);
+    to_world(rec);
+}
+
+
+#endif
@@ -0,0 +1,409 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "constants.h"
+
+#include "hittable.h"
+#include "light_sampler.h"
+#include "material.h"
+#include "pdf.h"
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+
+struct integrator_settings {
+    int max_depth = 50;
+    int roulette_depth = 3;     // bounces before Russian roulette may end a path
+    colour background = colour(0, 0, 0);
+};
+
+
+// Per-depth counts of path segments and of how paths ended, and the number of shadow rays
+// cast. Each tile fills its own copy and merges it into the shared one once, so counting
+// needs no atomics.
+class path_stats {
+    public:
+        enum end_reason { escaped, absorbed, roulette, max_depth, end_reason_count };
+
+        path_stats() {}
+        explicit path_stats(int max_depth)
+            : rays(max_depth + 1, 0), ends(end_reason_count, std::vector<uint64_t>(max_depth + 1, 0)) {}
+
+        void trace(int depth) { rays[depth]++; }
+        void trace_shadow() { shadow_rays++; }
+        void end(int depth, end_reason reason) { ends[reason][depth]++; }
+
+        void merge(const path_stats& other) {
+            for (size_t d = 0; d < rays.size(); d++) {
+                rays[d] += other.rays[d];
+                for (int e = 0; e < end_reason_count; e++)
+                    ends[e][d] += other.ends[e][d];
+            }
+            shadow_rays += other.shadow_rays;
+        }
+
+        void print(std::ostream& out) const {
+            if (rays.empty() || rays[0] == 0)
+                return;
+
+            // Every path traces its depth 0 ray, so rays[0] is the number of samples.
+            uint64_t paths = rays[0], total_rays = 0;
+            for (auto count : rays)
+                total_rays += count;
+
+            out << "Path lengths over " << paths << " samples, "
+                << std::setprecision(3) << static_cast<double>(total_rays) / paths
+                << " rays and " << static_cast<double>(shadow_rays) / paths
+                << " shadow rays per sample:\n";
+            out << " depth        rays     escaped    absorbed    roulette   max depth\n";
+            for (size_t d = 0; d < rays.size(); d++) {
+                if (rays[d] == 0 && ends[max_depth][d] == 0)
+                    continue;
+                out << std::setw(6) << d << std::setw(12) << rays[d];
+                for (int e = 0; e < end_reason_count; e++)
+                    out << std::setw(12) << ends[e][d];
+                out << '\n';
+            }
+        }
+
+    private:
+        std::vector<uint64_t> rays;
+        std::vector<std::vector<uint64_t>> ends;
+        uint64_t shadow_rays = 0;
+};
+
+
+// Veach's power heuristic with exponent 2: the weight for a sample drawn with pdf `a`
+// when another strategy could have drawn it with pdf `b`.
+inline double power_heuristic(double a, double b) {
+    if (a >= infinity)
+        return 1;
+    auto a2 = a * a, b2 = b * b;
+    return a2 + b2 > 0 ? a2 / (a2 + b2) : 0;
+}
+
+
+// A shadow ray for next event estimation, up to the point sampled on a light, and what it
+// adds to the path's radiance if nothing is in the way.
+struct shadow_ray {
+    bool pending = false;
+    ray r;
+    double t_max;
+    colour contribution;
+};
+
+
+// Next event estimation at `rec` on `mat`: the emission from a point sampled on `light`,
+// which was picked with `probability`, weighted against the material's own sampling by the
+// power heuristic. Leaves the shadow ray that decides whether it counts in `shadow`, or
+// returns false if the light can't contribute whatever the ray finds.
+template <typename Material>
+bool sample_light(
+    const ray& r_in,
+    const hit_record& rec,
+    const Material& mat,
+    const scatter_record& srec,
+    const light_sampler& lights,
+    size_t light,
+    double probability,
+    shadow_ray& shadow
+) {
+    const auto& shape = lights.lights[light];
+    double shape_pdf;
+    auto to_light = rec.spawn_ray(shape.shape->random_with_pdf(rec.p, shape_pdf), r_in.time());
+    auto light_pdf = probability * shape_pdf;
+    if (!(light_pdf > 0))
+        return false;
+
+    auto scattering_pdf = mat.scattering_pdf(r_in, rec, to_light);
+    if (scattering_pdf <= 0)
+        return false;
+
+    // Hit the light through the object that names it, so a flipped light's faces are the
+    // right way round.
+    hit_record light_rec;
+    if (!shape.object->hit(to_light, 0, infinity, light_rec))
+        return false;
+    light_rec.object->finalize_hit(to_light, light_rec);
+    auto emitted = light_rec.mat_ptr->emitted(to_light, light_rec, light_rec.u, light_rec.v, light_rec.p);
+    if (emitted.length_squared() <= 0)
+        return false;
+
+    // Stop short of the light so it doesn't shadow itself.
+    auto weight = power_heuristic(light_pdf, srec.pdf.value(to_light.direction()));
+    shadow.pending = true;
+    shadow.r = to_light;
+    shadow.t_max = light_rec.t * (1 - 1e-6);
+    shadow.contribution = srec.attenuation * scattering_pdf * emitted * (weight / light_pdf);
+    return true;
+}
+
+
+// A path between bounces: what it has gathered, its throughput, the ray it traces next,
+// and the vertex that ray left from if it was sampled from a lobe, for weighting what it
+// reaches. Paths advance a bounce at a time, so a caller can trace the rays of many paths
+// together and shade each alone. The functions taking a `Path` work as well on anything
+// with these members, such as a path_ref into a path_batch.
+struct path_state {
+    path_state() {}
+    explicit path_state(const ray& r) : radiance(0, 0, 0), throughput(1, 1, 1), r(r) {}
+
+    colour radiance;
+    colour throughput;
+    ray r;
+    int depth = 0;
+
+    bool weighted = false;
+    double material_pdf;
+    size_t picked;              // the light sampled there and its chance, to save a lookup
+    double picked_probability;
+    point origin;
+    vector3 normal;
+};
+
+
+// Whether the path has a ray left to trace, counting it if so.
+template <typename Path>
+bool start_bounce(Path& path, const integrator_settings& settings, path_stats& stats) {
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (path.depth >= settings.max_depth) {
+        stats.end(path.depth, path_stats::max_depth);
+        return false;
+    }
+    stats.trace(path.depth);
+    return true;
+}
+
+
+// Ends a path whose ray hit nothing: it sees the background.
+template <typename Path>
+void shade_miss(Path& path, const integrator_settings& settings, path_stats& stats) {
+    auto depth = path.depth++;
+    path.radiance += path.throughput * settings.background;
+    stats.end(depth, path_stats::escaped);
+}
+
+
+// Shades the finalized hit `rec` on its material `mat`: gathers emission, samples a light
+// into `shadow` and moves the path on to its next ray. Returns false once the path has ended.
+// The shadow ray, if any, still needs tracing; its contribution is already scaled by the
+// throughput it was gathered with. With `Material` a concrete material class its calls are
+// bound statically; with `material` they go through the vtable.
+template <typename Path, typename Material>
+bool shade_hit(
+    Path& path,
+    const Material& mat,
+    const hit_record& rec,
+    const light_sampler& lights,
+    const integrator_settings& settings,
+    path_stats& stats,
+    shadow_ray& shadow
+) {
+    shadow.pending = false;
+    auto depth = path.depth++;
+    const auto& r = path.r;
+
+    auto emitted = mat.emitted(r, rec, rec.u, rec.v, rec.p);
+    if (path.weighted && emitted.length_squared() > 0) {
+        auto reached = lights.index_of(rec.object);
+        if (reached != light_sampler::none) {
+            auto probability = reached == path.picked
+                ? path.picked_probability : lights.probability(path.origin, path.normal, reached);
+            auto light_pdf = probability * lights.shape(reached).pdf_value(path.origin, r.direction());
+            emitted *= power_heuristic(path.material_pdf, light_pdf);
+        }
+    }
+    path.radiance += path.throughput * emitted;
+
+    scatter_record srec;
+    if (!mat.scatter(r, rec, srec)) {
+        stats.end(depth, path_stats::absorbed);
+        return false;
+    }
+
+    // What the throughput is expected to become, for roulette.
+    colour expected = path.throughput * srec.attenuation;
+
+    if (srec.is_specular) {
+        path.weighted = false;
+        path.throughput = expected;
+        path.r = srec.specular_ray;
+    } else {
+        path.picked = light_sampler::none;
+        if (!lights.empty() && lights.sample(rec.p, rec.normal, random_double(), path.picked, path.picked_probability)) {
+            if (sample_light(r, rec, mat, srec, lights, path.picked, path.picked_probability, shadow))
+                shadow.contribution = path.throughput * shadow.contribution;
+        } else {
+            path.picked = light_sampler::none;
+        }
+
+        auto scattered = rec.spawn_ray(srec.pdf.generate(), r.time());
+        auto scattering_pdf = mat.scattering_pdf(r, rec, scattered);
+        auto material_pdf = srec.pdf.value(scattered.direction());
+        if (scattering_pdf <= 0 || material_pdf <= 0) {
+            stats.end(depth, path_stats::absorbed);
+            return false;
+        }
+
+        path.weighted = true;
+        path.material_pdf = material_pdf;
+        path.origin = rec.p;
+        path.normal = rec.normal;
+        path.throughput = path.throughput * srec.attenuation * (scattering_pdf / material_pdf);
+        path.r = scattered;
+    }
+
+    if (depth + 1 >= settings.roulette_depth) {
+        auto survive = fmax(expected.x(), fmax(expected.y(), expected.z()));
+        if (survive < 1) {
+            if (random_double() >= survive) {
+                stats.end(depth, path_stats::roulette);
+                return false;
+            }
+            path.throughput /= survive;
+        }
+    }
+    return true;
+}
+
+
+// Shades what the path's ray found (`rec`, if `hit`), as shade_hit or shade_miss.
+bool shade(
+    path_state& path,
+    bool hit,
+    hit_record& rec,
+    const light_sampler& lights,
+    const integrator_settings& settings,
+    path_stats& stats,
+    shadow_ray& shadow
+) {
+    shadow.pending = false;
+    if (!hit) {
+        shade_miss(path, settings, stats);
+        return false;
+    }
+
+    rec.object->finalize_hit(path.r, rec);
+    return shade_hit(path, *rec.mat_ptr, rec, lights, settings, stats, shadow);
+}
+
+
+// Adds the shadow ray's contribution to the path if the ray gets through.
+template <typename Path>
+void trace_shadow(const hittable& world, shadow_ray& shadow, Path& path, path_stats& stats) {
+    if (!shadow.pending)
+        return;
+    stats.trace_shadow();
+    if (!world.occluded(shadow.r, 0, shadow.t_max))
+        path.radiance += shadow.contribution;
+    shadow.pending = false;
+}
+
+
+// Runs a path to its end, one ray at a time.
+void trace_path(
+    path_state& path,
+    const hittable& world,
+    const light_sampler& lights,
+    const integrator_settings& settings,
+    path_stats& stats
+) {
+    shadow_ray shadow;
+    while (start_bounce(path, settings, stats)) {
+        hit_record rec;
+        auto hit = world.hit(path.r, 0, infinity, rec);
+        auto more = shade(path, hit, rec, lights, settings, stats, shadow);
+        trace_shadow(world, shadow, path, stats);
+        if (!more)
+            break;
+    }
+}
+
+
+// Iterative path tracer. The path's throughput is carried forward instead of being
+// multiplied in on the way back out of a recursion. From roulette_depth bounces on, a path
+// survives each bounce with probability equal to the largest component of its expected throughput (at
+// most 1) and is reweighted by the inverse, so dim paths stop early without bias.
+//
+// Every vertex whose material has a lobe to evaluate gathers light two ways: a shadow ray
+// to a point on a picked light, and the material's own sample that carries the path on.
+// When that sample reaches a light that could have been picked, its emission is weighted
+// against the light sample by the power heuristic, so nothing is counted twice. Emission
+// seen from the camera, after a specular bounce or from emitters the light sampler doesn't
+// know of counts in full, as there was no light sample to share it with.
+colour ray_colour(
+    const ray& camera_ray,
+    const hittable& world,
+    const light_sampler& lights,
+    const integrator_settings& settings,
+    path_stats& stats
+) {
+    path_state path(camera_ray);
+    trace_path(path, world, lights, settings, stats);
+    return path.radiance;
+}
+
+
+// ray_colour for up to packet_size camera rays at once. The camera rays are traced as a
+// packet, then the shadow rays from where they land; after that each path carries on alone,
+// as bounces scatter too widely for their rays to share a walk. `streams` holds each ray's
+// random stream as it was left by making the ray, and each path draws only from its own,
+// so the result for every ray is the one ray_colour gives it.
+void ray_colours(
+    const ray* camera_rays,
+    random_stream* streams,
+    int count,
+    const hittable& world,
+    const light_sampler& lights,
+    const integrator_settings& settings,
+    path_stats& stats,
+    colour* radiance
+) {
+    path_state paths[packet_size];
+    bool more[packet_size] = {};
+    ray_packet packet;
+    packet.streams = streams;
+    uint32_t lanes = 0;
+    for (int i = 0; i < count; i++) {
+        paths[i] = path_state(camera_rays[i]);
+        if (start_bounce(paths[i], settings, stats)) {
+            packet.set(i, camera_rays[i], infinity);
+            lanes |= 1u << i;
+        }
+    }
+    auto hits = world.hit_packet(packet, lanes);
+
+    auto& stream = thread_random_stream();
+    shadow_ray shadows[packet_size];
+    ray_packet shadow_packet;
+    shadow_packet.streams = streams;
+    uint32_t shadow_lanes = 0;
+    for (int i = 0; i < count; i++) {
+        if (!ray_packet::in_lanes(lanes, i))
+            continue;
+        stream = streams[i];
+        more[i] = shade(paths[i], ray_packet::in_lanes(hits, i), packet.records[i], lights, settings, stats, shadows[i]);
+        streams[i] = stream;
+        if (shadows[i].pending) {
+            stats.trace_shadow();
+            shadow_packet.set(i, shadows[i].r, shadows[i].t_max);
+            shadow_lanes |= 1u << i;
+        }
+    }
+    auto blocked = world.occluded_packet(shadow_packet, shadow_lanes);
+
+    for (int i = 0; i < count; i++) {
+        if (ray_packet::in_lanes(shadow_lanes & ~blocked, i))
+            paths[i].radiance += shadows[i].contribution;
+        if (more[i]) {
+            stream = streams[i];
+            trace_path(paths[i], world, lights, settings, stats);
+        }
+        radiance[i] = paths[i].radiance;
+    }
+}
+
+
+#endif
@@ -0,0 +1,387 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include "constants.h"
+
+#include "aabb.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// The directions within an angle theta of w, kept as cos(theta).
+struct direction_cone {
+    vector3 w = vector3(0, 0, 1);
+    double cos_theta = 1;
+
+    static direction_cone entire_sphere() {
+        direction_cone cone;
+        cone.cos_theta = -1;
+        return cone;
+    }
+};
+
+
+// Rotates v by `angle` about the unit vector `axis` (Rodrigues' formula).
+inline vector3 rotate_about(const vector3& v, const vector3& axis, double angle) {
+    auto c = cos(angle), s = sin(angle);
+    return v * c + cross(axis, v) * s + axis * dot(axis, v) * (1 - c);
+}
+
+
+// The smallest cone holding both.
+inline direction_cone cone_union(const direction_cone& a, const direction_cone& b) {
+    if (a.cos_theta <= -1 || b.cos_theta <= -1)
+        return direction_cone::entire_sphere();
+
+    auto theta_a = acos(clamp(a.cos_theta, -1.0, 1.0));
+    auto theta_b = acos(clamp(b.cos_theta, -1.0, 1.0));
+    auto theta_d = acos(clamp(dot(a.w, b.w), -1.0, 1.0));
+    if (fmin(theta_d + theta_b, pi) <= theta_a)
+        return a;
+    if (fmin(theta_d + theta_a, pi) <= theta_b)
+        return b;
+
+    auto theta_o = (theta_a + theta_d + theta_b) / 2;
+    if (theta_o >= pi)
+        return direction_cone::entire_sphere();
+
+    // Turn a's axis towards b's until the cone just reaches round both.
+    auto axis = cross(a.w, b.w);
+    if (axis.length_squared() < 1e-12)
+        return direction_cone::entire_sphere();
+
+    direction_cone cone;
+    cone.w = unit_vector(rotate_about(a.w, unit_vector(axis), theta_o - theta_a));
+    cone.cos_theta = cos(theta_o);
+    return cone;
+}
+
+
+// What a light, or a group of them, can give off: where (the box), how much (power) and
+// which way. Surfaces face within `normals`, and each emits to within theta_e of its own
+// normal; for diffuse emitters that is a right angle, so cos_theta_e is 0.
+struct light_bounds {
+    aabb box;
+    double power = 0;
+    direction_cone normals;
+    double cos_theta_e = 0;
+
+    // An estimate of how much of this light reaches `p` on a surface facing `n`: power over
+    // squared distance, times the best cosines any light within the bounds could manage
+    // at either end (Conty Estevez and Kulla, "Importance Sampling of Many Lights with
+    // Adaptive Tree Splitting"). Zero means no light inside can reach `p`.
+    double importance(const point& p, const vector3& n) const;
+};
+
+
+namespace light_bvh_detail {
+
+// cos(a - b) and sin(a - b), clamped to the angle 0 when a < b.
+inline double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+    return cos_a > cos_b ? 1 : cos_a * cos_b + sin_a * sin_b;
+}
+
+inline double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+    return cos_a > cos_b ? 0 : sin_a * cos_b - cos_a * sin_b;
+}
+
+inline double safe_sqrt(double x) {
+    return sqrt(fmax(0.0, x));
+}
+
+} // namespace light_bvh_detail
+
+
+double light_bounds::importance(const point& p, const vector3& n) const {
+    using namespace light_bvh_detail;
+
+    auto centre = 0.5 * (box.min() + box.max());
+    auto to_p = p - centre;
+    auto d2 = to_p.length_squared();
+    // Inside or near the box, distance says little; don't let it run off to infinity.
+    d2 = fmax(d2, (box.max() - box.min()).length() / 2);
+
+    // The angle between the cone's axis and p, less the cone's spread and the angle the
+    // box covers as seen from p, is the least angle any emitter could see p at.
+    auto cos_w = to_p.length_squared() > 0 ? dot(normals.w, unit_vector(to_p)) : 1.0;
+    auto sin_w = safe_sqrt(1 - cos_w * cos_w);
+
+    auto radius_squared = (box.max() - centre).length_squared();
+    auto cos_b = to_p.length_squared() < radius_squared ? -1.0 : safe_sqrt(1 - radius_squared / to_p.length_squared());
+    auto sin_b = safe_sqrt(1 - cos_b * cos_b);
+
+    auto cos_o = normals.cos_theta, sin_o = safe_sqrt(1 - cos_o * cos_o);
+    auto cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+    auto sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+    auto cos_emit = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+    if (cos_emit <= cos_theta_e)
+        return 0;
+
+    auto result = power * cos_emit / d2;
+
+    // Likewise at p, against its normal, from whichever side.
+    if (n.length_squared() > 0 && to_p.length_squared() > 0) {
+        auto cos_i = fabs(dot(unit_vector(-to_p), n));
+        auto sin_i = safe_sqrt(1 - cos_i * cos_i);
+        result *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+    }
+    return fmax(result, 0.0);
+}
+
+
+inline light_bounds bounds_union(const light_bounds& a, const light_bounds& b) {
+    if (a.power <= 0) return b;
+    if (b.power <= 0) return a;
+
+    light_bounds u;
+    u.box = surrounding_box(a.box, b.box);
+    u.power = a.power + b.power;
+    u.normals = cone_union(a.normals, b.normals);
+    u.cos_theta_e = fmin(a.cos_theta_e, b.cos_theta_e);
+    return u;
+}
+
+
+// A BVH over the lights with bounds on power and orientation at every node. Picking a
+// light walks it from the root, choosing between children in proportion to their
+// importance to the shading point, so the pick costs O(log n) however many lights there
+// are and favours the near ones that face the point. Each light is a leaf of its own.
+class light_bvh {
+    public:
+        light_bvh() {}
+        light_bvh(const std::vector<light_shape>& lights, const std::vector<double>& power);
+
+        bool empty() const { return nodes.empty(); }
+
+        // Picks a light for a point `p` on a surface facing `n` (zero for none), returning its
+        // index and the probability of picking it, or false if no light can reach p.
+        bool sample(const point& p, const vector3& n, double u, size_t& light, double& probability) const;
+
+        // The probability sample() picks `light` for the same point.
+        double probability(const point& p, const vector3& n, size_t light) const;
+
+    private:
+        struct node {
+            light_bounds bounds;
+            uint32_t second_child;  // the first follows its parent
+            uint32_t light;         // for a leaf
+            bool leaf;
+        };
+
+        struct build_item {
+            light_bounds bounds;
+            point centroid;
+            uint32_t light;
+        };
+
+        uint32_t build(std::vector<build_item>& items, size_t start, size_t end, uint64_t trail, int depth);
+
+        // Probabilities of taking each child of an interior node; false if neither has any
+        // importance.
+        bool child_probabilities(size_t parent, const point& p, const vector3& n, double& first) const;
+
+    private:
+        std::vector<node> nodes;
+        std::vector<uint64_t> trails;   // per light, the children taken from the root as bits
+};
+
+
+namespace light_bvh_detail {
+
+// The measure of directions a cone of normals emits into, for comparing splits.
+inline double cone_measure(const direction_cone& normals, double cos_theta_e) {
+    auto theta_o = acos(clamp(normals.cos_theta, -1.0, 1.0));
+    auto theta_e = acos(clamp(cos_theta_e, -1.0, 1.0));
+    auto theta_w = fmin(theta_o + theta_e, pi);
+    auto sin_o = sin(theta_o);
+    return 2 * pi * (1 - normals.cos_theta)
+         + pi / 2 * (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_o + normals.cos_theta);
+}
+
+// Light trees split by the surface area orientation heuristic: power times the box's area
+// times the cone's measure, summed over the two sides.
+inline double split_cost(const light_bounds& b) {
+    if (b.power <= 0)
+        return 0;
+    return b.power * b.box.area() * cone_measure(b.normals, b.cos_theta_e);
+}
+
+} // namespace light_bvh_detail
+
+
+light_bvh::light_bvh(const std::vector<light_shape>& lights, const std::vector<double>& power) {
+    std::vector<build_item> items;
+    for (size_t i = 0; i < lights.size(); i++) {
+        const auto& light = lights[i];
+        build_item item;
+        if (!light.shape->bounding_box(0, 1, item.bounds.box))
+            item.bounds.box = aabb(light.centre, light.centre);
+        item.bounds.power = power[i];
+        if (light.normal.length_squared() > 0)
+            item.bounds.normals.w = unit_vector(light.normal);
+        else
+            item.bounds.normals = direction_cone::entire_sphere();
+        item.centroid = 0.5 * (item.bounds.box.min() + item.bounds.box.max());
+        item.light = static_cast<uint32_t>(i);
+        items.push_back(item);
+    }
+
+    trails.assign(lights.size(), 0);
+    if (!items.empty())
+        build(items, 0, items.size(), 0, 0);
+}
+
+
+uint32_t light_bvh::build(std::vector<build_item>& items, size_t start, size_t end, uint64_t trail, int depth) {
+    using namespace light_bvh_detail;
+
+    auto index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(node());
+
+    if (end - start == 1) {
+        nodes[index].bounds = items[start].bounds;
+        nodes[index].light = items[start].light;
+        nodes[index].leaf = true;
+        trails[items[start].light] = trail;
+        return index;
+    }
+
+    light_bounds all;
+    aabb centroids(items[start].centroid, items[start].centroid);
+    for (auto i = start; i < end; i++) {
+        all = bounds_union(all, items[i].bounds);
+        centroids = surrounding_box(centroids, aabb(items[i].centroid, items[i].centroid));
+    }
+
+    // Bin the centroids along each axis and take the cheapest boundary. Long thin
+    // boxes are discouraged from splitting across their short side.
+    const int bucket_count = 12;
+    size_t mid = (start + end) / 2;
+    double best_cost = infinity;
+    int best_axis = -1, best_split = 0;
+    auto extent = centroids.max() - centroids.min();
+    auto longest = fmax(extent.x(), fmax(extent.y(), extent.z()));
+
+    // Even splits take ceil(log2(count)) more levels to reach single lights. Other splits are
+    // only tried while that many levels are still free below bit 64, so trails fit in 64 bits.
+    int even_levels = 0;
+    while ((size_t(1) << even_levels) < end - start)
+        even_levels++;
+    for (int axis = 0; axis < 3 && depth + even_levels < 64; axis++) {
+        if (extent[axis] <= 0)
+            continue;
+
+        light_bounds buckets[bucket_count];
+        for (auto i = start; i < end; i++) {
+            auto b = std::min(static_cast<int>(bucket_count * (items[i].centroid[axis] - centroids.min()[axis]) / extent[axis]), bucket_count - 1);
+            buckets[b] = bounds_union(buckets[b], items[i].bounds);
+        }
+
+        // above[k] covers buckets k onwards.
+        light_bounds above[bucket_count];
+        above[bucket_count - 1] = buckets[bucket_count - 1];
+        for (int b = bucket_count - 2; b > 0; b--)
+            above[b] = bounds_union(buckets[b], above[b + 1]);
+
+        light_bounds below;
+        for (int split = 1; split < bucket_count; split++) {
+            below = bounds_union(below, buckets[split - 1]);
+            auto cost = (longest / extent[axis]) * (split_cost(below) + split_cost(above[split]));
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = split;
+            }
+        }
+    }
+
+    if (best_axis >= 0) {
+        auto axis = best_axis;
+        auto middle = std::partition(items.begin() + start, items.begin() + end, [&](const build_item& item) {
+            auto b = static_cast<int>(bucket_count * (item.centroid[axis] - centroids.min()[axis]) / extent[axis]);
+            return std::min(b, bucket_count - 1) < best_split;
+        });
+        auto m = static_cast<size_t>(middle - items.begin());
+        if (m > start && m < end)
+            mid = m;
+    }
+
+    build(items, start, mid, trail, depth + 1);
+    auto second = build(items, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+    nodes[index].bounds = all;
+    nodes[index].second_child = second;
+    nodes[index].leaf = false;
+    return index;
+}
+
+
+bool light_bvh::child_probabilities(size_t parent, const point& p, const vector3& n, double& first) const {
+    auto i0 = nodes[parent + 1].bounds.importance(p, n);
+    auto i1 = nodes[nodes[parent].second_child].bounds.importance(p, n);
+    if (!(i0 + i1 > 0))
+        return false;
+    first = i0 / (i0 + i1);
+    return true;
+}
+
+
+bool light_bvh::sample(const point& p, const vector3& n, double u, size_t& light, double& probability) const {
+    if (nodes.empty())
+        return false;
+
+    probability = 1;
+    size_t current = 0;
+    while (!nodes[current].leaf) {
+        double first;
+        if (!child_probabilities(current, p, n, first))
+            return false;
+
+        // Reuse what is left of u once it has chosen, rescaled to [0,1).
+        if (u < first) {
+            u = first > 0 ? u / first : 0;
+            probability *= first;
+            current = current + 1;
+        } else {
+            u = first < 1 ? (u - first) / (1 - first) : 0;
+            u = fmin(u, 0.99999999999999989);
+            probability *= 1 - first;
+            current = nodes[current].second_child;
+        }
+    }
+
+    // A tree of one light has no interior node to have checked it.
+    if (nodes[current].bounds.importance(p, n) <= 0)
+        return false;
+
+    light = nodes[current].light;
+    return true;
+}
+
+
+double light_bvh::probability(const point& p, const vector3& n, size_t light) const {
+    if (nodes.empty() || light >= trails.size())
+        return 0;
+
+    double probability = 1;
+    size_t current = 0;
+    for (int depth = 0; !nodes[current].leaf; depth++) {
+        double first;
+        if (!child_probabilities(current, p, n, first))
+            return 0;
+        if ((trails[light] >> depth) & 1) {
+            probability *= 1 - first;
+            current = nodes[current].second_child;
+        } else {
+            probability *= first;
+            current = current + 1;
+        }
+    }
+
+    return nodes[current].bounds.importance(p, n) > 0 ? probability : 0;
+}
+
+
+#endif
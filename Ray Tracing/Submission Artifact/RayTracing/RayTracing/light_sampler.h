@@ -0,0 +1,190 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include "constants.h"
+
+#include "hittable.h"
+#include "light_bvh.h"
+#include "material.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Walker's alias method, built with Vose's algorithm: each of n equal bins keeps an index
+// with probability q and otherwise hands over to its alias, so picking index i with
+// probability weight_i / total takes one random number and no search.
+class alias_table {
+    public:
+        alias_table() {}
+        explicit alias_table(const std::vector<double>& weights);
+
+        size_t size() const { return bins.size(); }
+        bool empty() const { return bins.empty(); }
+
+        size_t sample(double u) const {
+            auto scaled = u * bins.size();
+            auto i = static_cast<size_t>(scaled);
+            if (i >= bins.size())
+                i = bins.size() - 1;
+            return scaled - i < bins[i].q ? i : bins[i].alias;
+        }
+
+        // The probability sample() returns i.
+        double probability(size_t i) const { return bins[i].probability; }
+
+    private:
+        struct bin {
+            double q;
+            size_t alias;
+            double probability;
+        };
+
+        std::vector<bin> bins;
+};
+
+
+alias_table::alias_table(const std::vector<double>& weights) {
+    double total = 0;
+    for (auto w : weights)
+        total += w;
+    if (weights.empty() || !(total > 0))
+        return;
+
+    auto n = weights.size();
+    bins.resize(n);
+    std::vector<size_t> small, large;
+    std::vector<double> scaled(n);
+    for (size_t i = 0; i < n; i++) {
+        bins[i].probability = weights[i] / total;
+        scaled[i] = bins[i].probability * n;
+        (scaled[i] < 1 ? small : large).push_back(i);
+    }
+
+    // Fill each under-full bin from an over-full one, which may then become under-full.
+    while (!small.empty() && !large.empty()) {
+        auto s = small.back(), l = large.back();
+        small.pop_back();
+        bins[s].q = scaled[s];
+        bins[s].alias = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // What is left is full, up to rounding.
+    for (auto i : small) bins[i].q = 1, bins[i].alias = i;
+    for (auto i : large) bins[i].q = 1, bins[i].alias = i;
+}
+
+
+// How a light is picked for a shading point:
+//   power  in proportion to power alone, through an alias table in O(1)
+//   tree   walking a light BVH by each node's importance to the point, in O(log n)
+//   auto   the tree once a scene has more than a few dozen lights, power otherwise
+// With few lights the tree's better picks don't pay for the walk.
+enum class light_strategy {
+    power,
+    tree,
+    automatic
+};
+
+
+bool light_strategy_from_name(const std::string& name, light_strategy& strategy) {
+    if (name == "power") strategy = light_strategy::power;
+    else if (name == "tree") strategy = light_strategy::tree;
+    else if (name == "auto") strategy = light_strategy::automatic;
+    else return false;
+    return true;
+}
+
+
+// The scene's lights, found by walking the scene for shapes whose material emits, and
+// weighted by their power: emitted luminance times area.
+class light_sampler {
+    public:
+        static const size_t none = static_cast<size_t>(-1);
+
+        light_sampler() {}
+        light_sampler(const hittable& world, light_strategy strategy);
+
+        bool empty() const { return lights.empty(); }
+        size_t size() const { return lights.size(); }
+        bool uses_tree() const { return strategy == light_strategy::tree; }
+
+        // Picks a light for a point `p` on a surface facing `n`, returning it and the
+        // probability it had, or false if none can light p.
+        bool sample(const point& p, const vector3& n, double u, size_t& light, double& probability) const {
+            if (strategy == light_strategy::tree)
+                return tree.sample(p, n, u, light, probability);
+            if (table.empty())
+                return false;
+            light = table.sample(u);
+            probability = table.probability(light);
+            return true;
+        }
+
+        double probability(const point& p, const vector3& n, size_t light) const {
+            if (strategy == light_strategy::tree)
+                return tree.probability(p, n, light);
+            return table.probability(light);
+        }
+
+        const hittable& shape(size_t i) const { return *lights[i].shape; }
+
+        // The light a hit record's object is, or none.
+        size_t index_of(const hittable* object) const {
+            auto found = index.find(object);
+            return found == index.end() ? none : found->second;
+        }
+
+    public:
+        std::vector<light_shape> lights;
+        std::vector<double> power;
+
+    private:
+        light_strategy strategy = light_strategy::power;
+        alias_table table;
+        light_bvh tree;
+        std::unordered_map<const hittable*, size_t> index;
+};
+
+
+light_sampler::light_sampler(const hittable& world, light_strategy strategy) : strategy(strategy) {
+    std::vector<light_shape> shapes;
+    world.gather_light_shapes(shapes);
+
+    for (const auto& shape : shapes) {
+        if (!shape.mat || !(shape.area > 0))
+            continue;
+
+        // Look the emission up as a hit on the shape's front face at its centre. Textured
+        // lights are judged by that one point.
+        hit_record rec;
+        rec.p = shape.centre;
+        rec.u = rec.v = 0.5;
+        rec.front_face = true;
+        rec.object = shape.shape;
+        rec.mat_ptr = shape.mat;
+        auto emitted = shape.mat->emitted(ray(shape.centre, vector3(0, 1, 0)), rec, rec.u, rec.v, rec.p);
+        auto luminance = 0.2126 * emitted.x() + 0.7152 * emitted.y() + 0.0722 * emitted.z();
+        if (luminance > 0) {
+            index[shape.object] = lights.size();
+            lights.push_back(shape);
+            power.push_back(luminance * shape.area);
+        }
+    }
+
+    if (strategy == light_strategy::automatic)
+        this->strategy = strategy = lights.size() > 64 ? light_strategy::tree : light_strategy::power;
+
+    if (strategy == light_strategy::tree)
+        tree = light_bvh(lights, power);
+    else
+        table = alias_table(power);
+}
+
+
+#endif
@@ -0,0 +1,524 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "constants.h"
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// One node of a flattened BVH, 32 bytes so two share a cache line. Nodes are stored depth
+// first: an interior node's first child follows it directly and `offset` holds the index
+// of the second child. A leaf has count > 0 and covers primitives [offset, offset+count).
+struct linear_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset;
+    uint16_t count;
+    uint8_t axis;       // axis the children were split on; the second lies towards +axis
+    uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node must stay 32 bytes");
+
+
+// Deepest tree the traversal stack can hold. Builders switch to median splits well before
+// this so the bound holds for any input.
+const int linear_bvh_max_depth = 64;
+
+
+// Splits [begin,end) at the median centroid of a random axis, the same rule bvh_node uses.
+template <typename Iterator, typename BoundsFn>
+Iterator median_partition(Iterator begin, Iterator end, BoundsFn bounds_of) {
+    int axis = random_int(0,2);
+    auto mid = begin + (end - begin)/2;
+    std::nth_element(begin, mid, end, [&](const auto& a, const auto& b) {
+        return bounds_of(a).min()[axis] < bounds_of(b).min()[axis];
+    });
+    return mid;
+}
+
+
+inline void set_node_bounds(linear_bvh_node& node, const aabb& box) {
+    // Round outwards so the float box always contains the double one.
+    for (int a = 0; a < 3; a++) {
+        auto lo = static_cast<float>(box.min()[a]);
+        auto hi = static_cast<float>(box.max()[a]);
+        if (lo > box.min()[a]) lo = std::nextafter(lo, -std::numeric_limits<float>::infinity());
+        if (hi < box.max()[a]) hi = std::nextafter(hi,  std::numeric_limits<float>::infinity());
+        node.bounds_min[a] = lo;
+        node.bounds_max[a] = hi;
+    }
+}
+
+
+template <typename Element, typename BoundsFn>
+aabb range_bounds(const std::vector<Element>& primitives, BoundsFn bounds_of, size_t start, size_t end) {
+    aabb box = bounds_of(primitives[start]);
+    for (auto i = start + 1; i < end; i++)
+        box = surrounding_box(box, bounds_of(primitives[i]));
+    return box;
+}
+
+
+// `box` bounds primitives [start,end); the parent has already worked it out.
+template <typename Element, typename BoundsFn>
+void build_linear_bvh_range(
+    std::vector<Element>& primitives, BoundsFn bounds_of, const bvh_options& options,
+    std::vector<linear_bvh_node>& nodes, size_t start, size_t end, const aabb& box, int depth
+) {
+    auto index = nodes.size();
+    nodes.push_back(linear_bvh_node());
+    set_node_bounds(nodes[index], box);
+
+    auto count = end - start;
+    auto begin_it = primitives.begin() + start;
+    auto end_it = primitives.begin() + end;
+
+    size_t mid = start;
+    if (count > 1) {
+        if (depth >= linear_bvh_max_depth/2)
+            mid = start + count/2;
+        else if (options.split == bvh_split::sah)
+            mid = static_cast<size_t>(sah_partition(begin_it, end_it, bounds_of, options, true) - primitives.begin());
+        else if (count > 2)
+            mid = static_cast<size_t>(median_partition(begin_it, end_it, bounds_of) - primitives.begin());
+        else
+            mid = start + 1;
+    }
+
+    // The leaf count is 16 bits wide; anything larger must be split.
+    if (mid == start && count > 0xFFFF)
+        mid = start + count/2;
+
+    if (mid == start) {
+        nodes[index].offset = static_cast<uint32_t>(start);
+        nodes[index].count = static_cast<uint16_t>(count);
+        nodes[index].axis = 0;
+        return;
+    }
+
+    auto left_box = range_bounds(primitives, bounds_of, start, mid);
+    auto right_box = range_bounds(primitives, bounds_of, mid, end);
+    auto separation = (right_box.min() + right_box.max()) - (left_box.min() + left_box.max());
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (fabs(separation[a]) > fabs(separation[axis]))
+            axis = a;
+
+    // Traversal takes the second child first when the ray runs towards -axis, so the half
+    // on the negative side of the split must be the first child.
+    bool swap = separation[axis] < 0;
+    build_linear_bvh_range(primitives, bounds_of, options, nodes,
+        swap ? mid : start, swap ? end : mid, swap ? right_box : left_box, depth + 1);
+    nodes[index].offset = static_cast<uint32_t>(nodes.size());
+    nodes[index].count = 0;
+    nodes[index].axis = static_cast<uint8_t>(axis);
+    build_linear_bvh_range(primitives, bounds_of, options, nodes,
+        swap ? start : mid, swap ? mid : end, swap ? left_box : right_box, depth + 1);
+}
+
+
+// Builds a depth-first node array over `primitives`, reordering them so every leaf covers
+// a contiguous range. Works for any element type given a functor returning its aabb.
+template <typename Element, typename BoundsFn>
+std::vector<linear_bvh_node> build_linear_bvh(
+    std::vector<Element>& primitives, BoundsFn bounds_of, const bvh_options& options
+) {
+    std::vector<linear_bvh_node> nodes;
+    if (primitives.empty())
+        return nodes;
+
+    nodes.reserve(2 * primitives.size());
+    build_linear_bvh_range(
+        primitives, bounds_of, options, nodes, 0, primitives.size(),
+        range_bounds(primitives, bounds_of, 0, primitives.size()), 0);
+    return nodes;
+}
+
+
+// Per-ray values the float slab test needs, converted once per traversal. Lane 3 of each
+// array is padding: its NaN reciprocal makes the fourth lane of the SSE test drop out.
+struct linear_bvh_ray {
+    linear_bvh_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            origin[a] = static_cast<float>(r.origin()[a]);
+            inv_dir[a] = static_cast<float>(r.inverse_direction()[a]);
+            dir_is_neg[a] = r.sign(a) != 0;
+        }
+        origin[3] = 0;
+        inv_dir[3] = std::numeric_limits<float>::quiet_NaN();
+    }
+
+    // Same NaN rules as aabb::hit, so a ray on either slab plane of a node reaches it, as
+    // it reaches the box. The far distance is widened by a few ulps to cover
+    // rounding in the float math.
+    bool hit(const linear_bvh_node& node, float t_min, float t_max) const {
+        const float widen = 1 + 3 * std::numeric_limits<float>::epsilon();
+#ifdef AABB_USE_SSE2
+        auto o = _mm_loadu_ps(origin);
+        auto inv = _mm_loadu_ps(inv_dir);
+        auto t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds_min), o), inv);
+        auto t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds_max), o), inv);
+        auto nan = _mm_cmpunord_ps(t0, t1);
+        t0 = _mm_or_ps(t0, nan);
+        t1 = _mm_or_ps(t1, nan);
+
+        auto t_near = _mm_max_ps(_mm_min_ps(t0, t1), _mm_set1_ps(t_min));
+        auto t_far  = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t0, t1), _mm_set1_ps(widen)),
+                                 _mm_set1_ps(t_max));
+
+        t_near = _mm_max_ps(t_near, _mm_shuffle_ps(t_near, t_near, _MM_SHUFFLE(2, 3, 0, 1)));
+        t_near = _mm_max_ps(t_near, _mm_shuffle_ps(t_near, t_near, _MM_SHUFFLE(1, 0, 3, 2)));
+        t_far  = _mm_min_ps(t_far,  _mm_shuffle_ps(t_far,  t_far,  _MM_SHUFFLE(2, 3, 0, 1)));
+        t_far  = _mm_min_ps(t_far,  _mm_shuffle_ps(t_far,  t_far,  _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm_comile_ss(t_near, t_far) != 0;
+#else
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (node.bounds_min[a] - origin[a]) * inv_dir[a];
+            auto t1 = (node.bounds_max[a] - origin[a]) * inv_dir[a];
+            if (std::isnan(t0) || std::isnan(t1))
+                continue;
+            auto near_a = t0 < t1 ? t0 : t1;
+            auto far_a  = (t0 > t1 ? t0 : t1) * widen;
+            t_min = near_a > t_min ? near_a : t_min;
+            t_max = far_a  < t_max ? far_a  : t_max;
+        }
+        return t_min <= t_max;
+#endif
+    }
+
+    float origin[4];
+    float inv_dir[4];
+    bool dir_is_neg[3];
+};
+
+
+// A packet's rays in float for the slab tests, and bounds on their origins and reciprocal
+// directions. When every ray's direction has the same signs, the bounds give by interval
+// arithmetic a span of entry and exit distances that covers every ray, so a node none of
+// them can reach is culled with one test before any ray is tried. Float rounding is
+// monotonic, so the bounds hold for the rounded per-ray values too.
+struct linear_bvh_packet {
+    linear_bvh_packet(const ray_packet& packet, uint32_t lanes);
+
+    // False only if no ray in the packet can reach the box.
+    bool may_hit(const float* bounds_min, const float* bounds_max) const;
+
+    // The lanes among `lanes` whose ray reaches the box within its t_max. Same NaN rules
+    // and widening as linear_bvh_ray::hit.
+    uint32_t hit(const float* bounds_min, const float* bounds_max, const ray_packet& packet, uint32_t lanes) const;
+
+    // Whether the nearer child along `axis` is the second, for the rays in `lanes`: the
+    // packet's common sign when it has one, else the first ray's.
+    bool dir_is_neg(int axis, uint32_t lanes) const {
+        if (coherent)
+            return negative[axis];
+        int first = 0;
+        while (!ray_packet::in_lanes(lanes, first))
+            first++;
+        return inv_dir[axis][first] < 0;
+    }
+
+    alignas(16) float origin[3][packet_size];
+    alignas(16) float inv_dir[3][packet_size];
+    float t_min;
+    float t_max_bound;      // the largest t_max, which only shrinks during a walk
+    bool coherent;
+    bool negative[3];
+    float origin_lo[3], origin_hi[3], inv_lo[3], inv_hi[3];
+};
+
+
+linear_bvh_packet::linear_bvh_packet(const ray_packet& packet, uint32_t lanes)
+    : t_min(static_cast<float>(packet.t_min)), t_max_bound(0), coherent(lanes != 0)
+{
+    for (int i = 0; i < packet_size; i++) {
+        for (int a = 0; a < 3; a++) {
+            origin[a][i] = static_cast<float>(packet.rays[i].origin()[a]);
+            inv_dir[a][i] = static_cast<float>(packet.rays[i].inverse_direction()[a]);
+        }
+    }
+
+    for (int a = 0; a < 3; a++) {
+        origin_lo[a] = inv_lo[a] = std::numeric_limits<float>::infinity();
+        origin_hi[a] = inv_hi[a] = -std::numeric_limits<float>::infinity();
+    }
+    for (int i = 0; i < packet_size; i++) {
+        if (!ray_packet::in_lanes(lanes, i))
+            continue;
+        auto t_max = static_cast<float>(packet.t_max[i]);
+        t_max_bound = t_max > t_max_bound ? t_max : t_max_bound;
+        for (int a = 0; a < 3; a++) {
+            origin_lo[a] = std::min(origin_lo[a], origin[a][i]);
+            origin_hi[a] = std::max(origin_hi[a], origin[a][i]);
+            inv_lo[a] = std::min(inv_lo[a], inv_dir[a][i]);
+            inv_hi[a] = std::max(inv_hi[a], inv_dir[a][i]);
+        }
+    }
+
+    // Interval arithmetic needs finite reciprocals of one sign on every axis.
+    for (int a = 0; coherent && a < 3; a++) {
+        negative[a] = inv_hi[a] < 0;
+        coherent = std::isfinite(inv_lo[a]) && std::isfinite(inv_hi[a])
+                && (inv_lo[a] > 0 || inv_hi[a] < 0);
+    }
+}
+
+
+bool linear_bvh_packet::may_hit(const float* bounds_min, const float* bounds_max) const {
+    if (!coherent)
+        return true;
+
+    const float widen = 1 + 3 * std::numeric_limits<float>::epsilon();
+    auto t_near = t_min, t_far = t_max_bound;
+    for (int a = 0; a < 3; a++) {
+        // The rays enter through the near slab and leave through the far one. Take the
+        // smallest entry and largest exit any origin and reciprocal in range can give.
+        auto near_plane = negative[a] ? bounds_max[a] : bounds_min[a];
+        auto far_plane = negative[a] ? bounds_min[a] : bounds_max[a];
+        auto to_near = negative[a] ? near_plane - origin_lo[a] : near_plane - origin_hi[a];
+        auto to_far = negative[a] ? far_plane - origin_hi[a] : far_plane - origin_lo[a];
+        auto enter = to_near * (to_near >= 0 ? inv_lo[a] : inv_hi[a]);
+        auto leave = to_far * (to_far >= 0 ? inv_hi[a] : inv_lo[a]);
+        t_near = enter > t_near ? enter : t_near;
+        t_far = leave * widen < t_far ? leave * widen : t_far;
+    }
+    return t_near <= t_far;
+}
+
+
+uint32_t linear_bvh_packet::hit(
+    const float* bounds_min, const float* bounds_max, const ray_packet& packet, uint32_t lanes
+) const {
+    const float widen = 1 + 3 * std::numeric_limits<float>::epsilon();
+    uint32_t reached = 0;
+#ifdef AABB_USE_SSE2
+    for (int h = 0; h < packet_size; h += 4) {
+        auto t_near = _mm_set1_ps(t_min);
+        auto t_far = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(packet.t_max + h)),
+                                   _mm_cvtpd_ps(_mm_loadu_pd(packet.t_max + h + 2)));
+        for (int a = 0; a < 3; a++) {
+            auto o = _mm_load_ps(origin[a] + h);
+            auto inv = _mm_load_ps(inv_dir[a] + h);
+            auto t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds_min[a]), o), inv);
+            auto t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds_max[a]), o), inv);
+            auto nan = _mm_cmpunord_ps(t0, t1);
+            t0 = _mm_or_ps(t0, nan);
+            t1 = _mm_or_ps(t1, nan);
+            t_near = _mm_max_ps(_mm_min_ps(t0, t1), t_near);
+            t_far = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t0, t1), _mm_set1_ps(widen)), t_far);
+        }
+        reached |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t_near, t_far))) << h;
+    }
+#else
+    for (int i = 0; i < packet_size; i++) {
+        auto t_near = t_min;
+        auto t_far = static_cast<float>(packet.t_max[i]);
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (bounds_min[a] - origin[a][i]) * inv_dir[a][i];
+            auto t1 = (bounds_max[a] - origin[a][i]) * inv_dir[a][i];
+            if (std::isnan(t0) || std::isnan(t1))
+                continue;
+            auto near_a = t0 < t1 ? t0 : t1;
+            auto far_a  = (t0 > t1 ? t0 : t1) * widen;
+            t_near = near_a > t_near ? near_a : t_near;
+            t_far  = far_a  < t_far  ? far_a  : t_far;
+        }
+        reached |= static_cast<uint32_t>(t_near <= t_far) << i;
+    }
+#endif
+    return reached & lanes;
+}
+
+
+// Walks a linear BVH with all the rays of a packet together on one stack. A node is culled
+// for the whole packet when interval arithmetic allows, and is otherwise tested against
+// every live ray at once; children are visited nearer first for the rays that reached the
+// parent. visit_leaf(first, count, lanes) handles a leaf's primitives for the lanes that
+// reach it and returns the lanes that are finished, which leave the walk: for shadow rays,
+// those blocked.
+template <typename VisitLeaf>
+void traverse_packet(
+    const linear_bvh_node* nodes, const ray_packet& packet, uint32_t lanes, VisitLeaf visit_leaf
+) {
+    if (lanes == 0)
+        return;
+
+    linear_bvh_packet fp(packet, lanes);
+    uint32_t stack[linear_bvh_max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const auto& node = nodes[current];
+        auto reached = fp.may_hit(node.bounds_min, node.bounds_max)
+            ? fp.hit(node.bounds_min, node.bounds_max, packet, lanes) : 0;
+        if (reached) {
+            if (node.count > 0) {
+                lanes &= ~visit_leaf(node.offset, node.count, reached);
+                if (lanes == 0 || stack_size == 0) break;
+                current = stack[--stack_size];
+            } else if (fp.dir_is_neg(node.axis, reached)) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+            }
+        } else {
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+}
+
+
+// A BVH over scene objects, flattened into one array and walked with an explicit stack,
+// nearer child first. Only the leaf objects are reached through virtual calls.
+class linear_bvh : public hittable {
+    public:
+        linear_bvh() {}
+
+        linear_bvh(const hittable_list& list, double time0, double time1,
+                   const bvh_options& options = bvh_options())
+            : objects(list.objects)
+        {
+            nodes = build_linear_bvh(objects, object_bounds{time0, time1}, options);
+            for (const auto& object : objects)
+                primitives.push_back(object.get());
+            if (!nodes.empty())
+                box = range_bounds(objects, object_bounds{time0, time1}, 0, objects.size());
+        }
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const;
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const;
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const;
+
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+            output_box = box;
+            return !nodes.empty();
+        }
+
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {
+            for (auto object : primitives)
+                object->gather_light_shapes(shapes);
+        }
+
+    public:
+        std::vector<shared_ptr<hittable>> objects;
+        std::vector<const hittable*> primitives;   // objects in leaf order, without refcounts
+        std::vector<linear_bvh_node> nodes;
+        aabb box;
+};
+
+
+bool linear_bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (nodes.empty())
+        return false;
+
+    linear_bvh_ray fr(r);
+    uint32_t stack[linear_bvh_max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+    bool hit_anything = false;
+
+    while (true) {
+        const auto& node = nodes[current];
+        if (fr.hit(node, static_cast<float>(t_min), static_cast<float>(t_max))) {
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    if (primitives[i]->hit(r, t_min, t_max, rec)) {
+                        hit_anything = true;
+                        t_max = rec.t;
+                    }
+                }
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            } else if (fr.dir_is_neg[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+            }
+        } else {
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+
+    return hit_anything;
+}
+
+
+// Same walk as hit(), but any hit ends it, so child order does not matter.
+bool linear_bvh::occluded(const ray& r, double t_min, double t_max) const {
+    if (nodes.empty())
+        return false;
+
+    linear_bvh_ray fr(r);
+    uint32_t stack[linear_bvh_max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const auto& node = nodes[current];
+        if (fr.hit(node, static_cast<float>(t_min), static_cast<float>(t_max))) {
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    if (primitives[i]->occluded(r, t_min, t_max))
+                        return true;
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+            }
+        } else {
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+
+    return false;
+}
+
+
+uint32_t linear_bvh::hit_packet(ray_packet& packet, uint32_t lanes) const {
+    if (nodes.empty())
+        return 0;
+
+    uint32_t hits = 0;
+    traverse_packet(nodes.data(), packet, lanes, [&](uint32_t first, uint32_t count, uint32_t reached) {
+        for (uint32_t i = first; i < first + count; i++)
+            hits |= primitives[i]->hit_packet(packet, reached);
+        return 0u;
+    });
+    return hits;
+}
+
+
+uint32_t linear_bvh::occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+    if (nodes.empty())
+        return 0;
+
+    uint32_t blocked = 0;
+    traverse_packet(nodes.data(), packet, lanes, [&](uint32_t first, uint32_t count, uint32_t reached) {
+        uint32_t done = 0;
+        for (uint32_t i = first; i < first + count && done != reached; i++)
+            done |= primitives[i]->occluded_packet(packet, reached & ~done);
+        blocked |= done;
+        return done;
+    });
+    return blocked;
+}
+
+
+#endif
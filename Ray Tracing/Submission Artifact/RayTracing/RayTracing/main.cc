@@ -1,63 +1,45 @@
 
 #include "constants.h"
 
+#include "adaptive_sampling.h"
 #include "box.h"
 #include "bvh.h"
 #include "camera.h"
-#include "color.h"
 #include "constant_medium.h"
+#include "framebuffer.h"
 #include "hittable_list.h"
+#include "image_writer.h"
+#include "instance.h"
+#include "integrator.h"
+#include "light_sampler.h"
+#include "linear_bvh.h"
 #include "material.h"
 #include "moving_sphere.h"
+#include "scene_loader.h"
 #include "sphere.h"
 #include "texture.h"
-
+#include "thread_pool.h"
+#include "tiles.h"
+#include "triangle_mesh.h"
+#include "wavefront.h"
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
-#include <fstream>
-
-using namespace std;
-
-colour ray_colour(
-	const ray& r,
-	const colour& background,
-	const hittable& world,
-	shared_ptr<hittable> lights,
-	int depth
-) {
-	hit_record rec;
-
-	// If we've exceeded the ray bounce limit, no more light is gathered.
-	if (depth <= 0)
-		return colour(0, 0, 0);
-
-	// If the ray hits nothing, return the background color.
-	if (!world.hit(r, 0.001, infinity, rec))
-		return background;
-
-	scatter_record srec;
-	colour emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+#include <mutex>
+#include <string>
+#include <vector>
 
-	if (!rec.mat_ptr->scatter(r, rec, srec))
-		return emitted;
-
-	if (srec.is_specular) {
-		return srec.attenuation
-			* ray_colour(srec.specular_ray, background, world, lights, depth - 1);
-	}
-
-	auto light_ptr = make_shared<hittable_pdf>(lights, rec.p);
-	mixture_pdf p(light_ptr, srec.pdf_ptr);
-	ray scattered = ray(rec.p, p.generate(), r.time());
-	auto pdf_val = p.value(scattered.direction());
-
-	return emitted
-		+ srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scattered)
-		* ray_colour(scattered, background, world, lights, depth - 1)
-		/ pdf_val;
-}
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
+using namespace std;
 
-//hittable_list random_scene() {
+//hittable_list random_scene(material_table& materials) {
 //    hittable_list world;
 //
 //    auto checker = make_shared<checker_texture>(
@@ -65,7 +47,7 @@ colour ray_colour(
 //        make_shared<solid_colour>(0.9, 0.9, 0.9)
 //    );
 //
-//    world.add(make_shared<sphere>(point(0,-1000,0), 1000, make_shared<lambertian>(checker)));
+//    world.add(make_shared<sphere>(point(0,-1000,0), 1000, materials.make<lambertian>(checker)));
 //
 //    for (int a = -11; a < 11; a++) {
 //        for (int b = -11; b < 11; b++) {
@@ -73,12 +55,12 @@ colour ray_colour(
 //            point center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
 //
 //            if ((center - vector3(4, 0.2, 0)).length() > 0.9) {
-//                shared_ptr<material> sphere_material;
+//                const material* sphere_material;
 //
 //                if (choose_mat < 0.8) {
 //                    // diffuse
 //                    auto albedo = colour::random() * colour::random();
-//                    sphere_material = make_shared<lambertian>(make_shared<solid_colour>(albedo));
+//                    sphere_material = materials.make<lambertian>(make_shared<solid_colour>(albedo));
 //                    auto center2 = center + vector3(0, random_double(0,.5), 0);
 //                    world.add(make_shared<moving_sphere>(
 //                        center, center2, 0.0, 1.0, 0.2, sphere_material));
@@ -86,30 +68,30 @@ colour ray_colour(
 //                    // metal
 //                    auto albedo = colour::random(0.5, 1);
 //                    auto fuzz = random_double(0, 0.5);
-//                    sphere_material = make_shared<metal>(albedo, fuzz);
+//                    sphere_material = materials.make<metal>(albedo, fuzz);
 //                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
 //                } else {
 //                    // glass
-//                    sphere_material = make_shared<dielectric>(1.5);
+//                    sphere_material = materials.make<dielectric>(1.5);
 //                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
 //                }
 //            }
 //        }
 //    }
 //
-//    auto material1 = make_shared<dielectric>(1.5);
+//    auto material1 = materials.make<dielectric>(1.5);
 //    world.add(make_shared<sphere>(point(0, 1, 0), 1.0, material1));
 //
-//    auto material2 = make_shared<lambertian>(make_shared<solid_colour>(colour(0.4, 0.2, 0.1)));
+//    auto material2 = materials.make<lambertian>(make_shared<solid_colour>(colour(0.4, 0.2, 0.1)));
 //    world.add(make_shared<sphere>(point(-4, 1, 0), 1.0, material2));
 //
-//    auto material3 = make_shared<metal>(colour(0.7, 0.6, 0.5), 0.0);
+//    auto material3 = materials.make<metal>(colour(0.7, 0.6, 0.5), 0.0);
 //    world.add(make_shared<sphere>(point(4, 1, 0), 1.0, material3));
 //
 //    return hittable_list(make_shared<bvh_node>(world, 0.0, 1.0));
 //}
 //
-//hittable_list two_spheres() {
+//hittable_list two_spheres(material_table& materials) {
 //    hittable_list objects;
 //
 //    auto checker = make_shared<checker_texture>(
@@ -117,51 +99,51 @@ colour ray_colour(
 //        make_shared<solid_colour>(0.9, 0.9, 0.9)
 //    );
 //
-//    objects.add(make_shared<sphere>(point(0,-10, 0), 10, make_shared<lambertian>(checker)));
-//    objects.add(make_shared<sphere>(point(0, 10, 0), 10, make_shared<lambertian>(checker)));
+//    objects.add(make_shared<sphere>(point(0,-10, 0), 10, materials.make<lambertian>(checker)));
+//    objects.add(make_shared<sphere>(point(0, 10, 0), 10, materials.make<lambertian>(checker)));
 //
 //    return objects;
 //}
 //
-//hittable_list two_perlin_spheres() {
+//hittable_list two_perlin_spheres(material_table& materials) {
 //    hittable_list objects;
 //
 //    auto pertext = make_shared<noise_texture>(4);
-//    objects.add(make_shared<sphere>(point(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
-//    objects.add(make_shared<sphere>(point(0,2,0), 2, make_shared<lambertian>(pertext)));
+//    objects.add(make_shared<sphere>(point(0,-1000,0), 1000, materials.make<lambertian>(pertext)));
+//    objects.add(make_shared<sphere>(point(0,2,0), 2, materials.make<lambertian>(pertext)));
 //
 //    return objects;
 //}
 //
-//hittable_list earth() {
+//hittable_list earth(material_table& materials) {
 //    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-//    auto earth_surface = make_shared<lambertian>(earth_texture);
+//    auto earth_surface = materials.make<lambertian>(earth_texture);
 //    auto globe = make_shared<sphere>(point(0,0,0), 2, earth_surface);
 //
 //    return hittable_list(globe);
 //}
 //
-//hittable_list simple_light() {
+//hittable_list simple_light(material_table& materials) {
 //    hittable_list objects;
 //
 //    auto pertext = make_shared<noise_texture>(4);
-//    objects.add(make_shared<sphere>(point(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
-//    objects.add(make_shared<sphere>(point(0,2,0), 2, make_shared<lambertian>(pertext)));
+//    objects.add(make_shared<sphere>(point(0,-1000,0), 1000, materials.make<lambertian>(pertext)));
+//    objects.add(make_shared<sphere>(point(0,2,0), 2, materials.make<lambertian>(pertext)));
 //
-//    auto difflight = make_shared<diffuse_light>(make_shared<solid_colour>(4,4,4));
+//    auto difflight = materials.make<diffuse_light>(make_shared<solid_colour>(4,4,4));
 //    objects.add(make_shared<sphere>(point(0,7,0), 2, difflight));
 //    objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
 //
 //    return objects;
 //}
 //
-//hittable_list cornell_balls() {
+//hittable_list cornell_balls(material_table& materials) {
 //    hittable_list objects;
 //
-//    auto red   = make_shared<lambertian>(make_shared<solid_colour>(.65, .05, .05));
-//    auto white = make_shared<lambertian>(make_shared<solid_colour>(.73, .73, .73));
-//    auto green = make_shared<lambertian>(make_shared<solid_colour>(.12, .45, .15));
-//    auto light = make_shared<diffuse_light>(make_shared<solid_colour>(5,5,5));
+//    auto red   = materials.make<lambertian>(make_shared<solid_colour>(.65, .05, .05));
+//    auto white = materials.make<lambertian>(make_shared<solid_colour>(.73, .73, .73));
+//    auto green = materials.make<lambertian>(make_shared<solid_colour>(.12, .45, .15));
+//    auto light = materials.make<diffuse_light>(make_shared<solid_colour>(5,5,5));
 //
 //    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green)));
 //    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
@@ -170,7 +152,7 @@ colour ray_colour(
 //    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
 //    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white)));
 //
-//    auto boundary = make_shared<sphere>(point(160,100,145), 100, make_shared<dielectric>(1.5));
+//    auto boundary = make_shared<sphere>(point(160,100,145), 100, materials.make<dielectric>(1.5));
 //    objects.add(boundary);
 //    objects.add(make_shared<constant_medium>(boundary, 0.1, make_shared<solid_colour>(1,1,1)));
 //
@@ -182,13 +164,13 @@ colour ray_colour(
 //    return objects;
 //}
 //
-//hittable_list cornell_smoke() {
+//hittable_list cornell_smoke(material_table& materials) {
 //    hittable_list objects;
 //
-//    auto red   = make_shared<lambertian>(make_shared<solid_colour>(.65, .05, .05));
-//    auto white = make_shared<lambertian>(make_shared<solid_colour>(.73, .73, .73));
-//    auto green = make_shared<lambertian>(make_shared<solid_colour>(.12, .45, .15));
-//    auto light = make_shared<diffuse_light>(make_shared<solid_colour>(7, 7, 7));
+//    auto red   = materials.make<lambertian>(make_shared<solid_colour>(.65, .05, .05));
+//    auto white = materials.make<lambertian>(make_shared<solid_colour>(.73, .73, .73));
+//    auto green = materials.make<lambertian>(make_shared<solid_colour>(.12, .45, .15));
+//    auto light = materials.make<diffuse_light>(make_shared<solid_colour>(7, 7, 7));
 //
 //    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green)));
 //    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
@@ -211,17 +193,17 @@ colour ray_colour(
 //    return objects;
 //}
 //
-//hittable_list cornell_final() {
+//hittable_list cornell_final(material_table& materials) {
 //    hittable_list objects;
 //
 //    auto pertext = make_shared<noise_texture>(0.1);
 //
-//    auto mat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
+//    auto mat = materials.make<lambertian>(make_shared<image_texture>("earthmap.jpg"));
 //
-//    auto red   = make_shared<lambertian>(make_shared<solid_colour>(.65, .05, .05));
-//    auto white = make_shared<lambertian>(make_shared<solid_colour>(.73, .73, .73));
-//    auto green = make_shared<lambertian>(make_shared<solid_colour>(.12, .45, .15));
-//    auto light = make_shared<diffuse_light>(make_shared<solid_colour>(7, 7, 7));
+//    auto red   = materials.make<lambertian>(make_shared<solid_colour>(.65, .05, .05));
+//    auto white = materials.make<lambertian>(make_shared<solid_colour>(.73, .73, .73));
+//    auto green = materials.make<lambertian>(make_shared<solid_colour>(.12, .45, .15));
+//    auto light = materials.make<diffuse_light>(make_shared<solid_colour>(7, 7, 7));
 //
 //    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green)));
 //    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
@@ -231,7 +213,7 @@ colour ray_colour(
 //    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white)));
 //
 //    shared_ptr<hittable> boundary2 =
-//        make_shared<box>(point(0,0,0), point(165,165,165), make_shared<dielectric>(1.5));
+//        make_shared<box>(point(0,0,0), point(165,165,165), materials.make<dielectric>(1.5));
 //    boundary2 = make_shared<rotate_y>(boundary2, -18);
 //    boundary2 = make_shared<translate>(boundary2, vector3(130,0,65));
 //
@@ -243,9 +225,9 @@ colour ray_colour(
 //    return objects;
 //}
 //
-//hittable_list final_scene() {
+//hittable_list final_scene(material_table& materials) {
 //    hittable_list boxes1;
-//    auto ground = make_shared<lambertian>(make_shared<solid_colour>(0.48, 0.83, 0.53));
+//    auto ground = materials.make<lambertian>(make_shared<solid_colour>(0.48, 0.83, 0.53));
 //
 //    const int boxes_per_side = 20;
 //    for (int i = 0; i < boxes_per_side; i++) {
@@ -266,35 +248,35 @@ colour ray_colour(
 //
 //    objects.add(make_shared<bvh_node>(boxes1, 0, 1));
 //
-//    auto light = make_shared<diffuse_light>(make_shared<solid_colour>(7, 7, 7));
+//    auto light = materials.make<diffuse_light>(make_shared<solid_colour>(7, 7, 7));
 //    objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
 //
 //    auto center1 = point(400, 400, 200);
 //    auto center2 = center1 + vector3(30,0,0);
 //    auto moving_sphere_material =
-//        make_shared<lambertian>(make_shared<solid_colour>(0.7, 0.3, 0.1));
+//        materials.make<lambertian>(make_shared<solid_colour>(0.7, 0.3, 0.1));
 //    objects.add(make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
 //
-//    objects.add(make_shared<sphere>(point(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-//    objects.add(make_shared<sphere>(point(0, 150, 145), 50, make_shared<metal>(colour(0.8, 0.8, 0.9), 10.0)
+//    objects.add(make_shared<sphere>(point(260, 150, 45), 50, materials.make<dielectric>(1.5)));
+//    objects.add(make_shared<sphere>(point(0, 150, 145), 50, materials.make<metal>(colour(0.8, 0.8, 0.9), 10.0)
 //    ));
 //
-//    auto boundary = make_shared<sphere>(point(360,150,145), 70, make_shared<dielectric>(1.5));
+//    auto boundary = make_shared<sphere>(point(360,150,145), 70, materials.make<dielectric>(1.5));
 //    objects.add(boundary);
 //    objects.add(make_shared<constant_medium>(
 //        boundary, 0.2, make_shared<solid_colour>(0.2, 0.4, 0.9)
 //    ));
-//    boundary = make_shared<sphere>(point(0,0,0), 5000, make_shared<dielectric>(1.5));
+//    boundary = make_shared<sphere>(point(0,0,0), 5000, materials.make<dielectric>(1.5));
 //    objects.add(make_shared<constant_medium>(boundary, .0001, make_shared<solid_colour>(1,1,1)));
 //
-//    auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
+//    auto emat = materials.make<lambertian>(make_shared<image_texture>("earthmap.jpg"));
 //    objects.add(make_shared<sphere>(point(400,200,400), 100, emat));
 //
 //    auto pertext = make_shared<noise_texture>(4);
-//    objects.add(make_shared<sphere>(point(220,280,300), 80, make_shared<lambertian>(pertext)));
+//    objects.add(make_shared<sphere>(point(220,280,300), 80, materials.make<lambertian>(pertext)));
 //
 //    hittable_list boxes2;
-//    auto white = make_shared<lambertian>(make_shared<solid_colour>(.73, .73, .73));
+//    auto white = materials.make<lambertian>(make_shared<solid_colour>(.73, .73, .73));
 //    int ns = 1000;
 //    for (int j = 0; j < ns; j++) {
 //        boxes2.add(make_shared<sphere>(point::random(0,165), 10, white));
@@ -311,16 +293,16 @@ colour ray_colour(
 //}
 
 
-hittable_list cornell_box(camera& cam, double aspect) 
+hittable_list cornell_box(camera& cam, double aspect, material_table& materials)
 {
 	hittable_list world;
 
-	auto red = make_shared<lambertian>(make_shared<solid_colour>(.65, .05, .05));
-	auto white = make_shared<lambertian>(make_shared<solid_colour>(.73, .73, .73));
-	auto blue = make_shared<lambertian>(make_shared<solid_colour>(.12, .85, .85));
-	auto light = make_shared<diffuse_light>(make_shared<solid_colour>(15, 15, 15));
-	auto blue_light = make_shared<diffuse_light>(make_shared<solid_colour>(0.2, 4, 4));
-	auto red_light = make_shared<diffuse_light>(make_shared<solid_colour>(4, 0.2, 0.2));
+	auto red = materials.make<lambertian>(make_shared<solid_colour>(.65, .05, .05));
+	auto white = materials.make<lambertian>(make_shared<solid_colour>(.73, .73, .73));
+	auto blue = materials.make<lambertian>(make_shared<solid_colour>(.12, .85, .85));
+	auto light = materials.make<diffuse_light>(make_shared<solid_colour>(15, 15, 15));
+	auto blue_light = materials.make<diffuse_light>(make_shared<solid_colour>(0.2, 4, 4));
+	auto red_light = materials.make<diffuse_light>(make_shared<solid_colour>(4, 0.2, 0.2));
 
 	shared_ptr<hittable> smokesphere = make_shared<sphere>(point(148, 140, 140), 60, white);
 	world.add(make_shared<constant_medium>(smokesphere, 0.01, make_shared<solid_colour>(0,0,0)));
@@ -330,22 +312,22 @@ hittable_list cornell_box(camera& cam, double aspect)
 		        make_shared<solid_colour>(0.9, 0.9, 0.9)
 		    );
 		
-	world.add(make_shared<sphere>(point(408, 420,400), 60, make_shared<lambertian>(checker)));
+	world.add(make_shared<sphere>(point(408, 420,400), 60, materials.make<lambertian>(checker)));
 	world.add(make_shared<sphere>(point(408, 140, 140), 60, red));
 
-	world.add(make_shared<sphere>(point(148, 270, 270), 60, make_shared<metal>(colour(0.8, 0.8, 0.9), 1)));
-	world.add(make_shared<sphere>(point(408, 270, 270), 60, make_shared<metal>(colour(0.8, 0.8, 0.9), 0.3)));
+	world.add(make_shared<sphere>(point(148, 270, 270), 60, materials.make<metal>(colour(0.8, 0.8, 0.9), 1)));
+	world.add(make_shared<sphere>(point(408, 270, 270), 60, materials.make<metal>(colour(0.8, 0.8, 0.9), 0.3)));
 
 	auto pertext = make_shared<noise_texture>(0.25);
-	world.add(make_shared<sphere>(point(278, 420,400), 60, make_shared<lambertian>(pertext)));
+	world.add(make_shared<sphere>(point(278, 420,400), 60, materials.make<lambertian>(pertext)));
 
-	auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
+	auto emat = materials.make<lambertian>(make_shared<image_texture>("earthmap.jpg"));
 	world.add(make_shared<sphere>(point(278,270,270), 60, emat));
 
-	auto glass = make_shared<dielectric>(1.5);
+	auto glass = materials.make<dielectric>(1.5);
 	world.add(make_shared<sphere>(point(278, 140, 140), 60, glass));
 
-	    auto boundary = make_shared<sphere>(point(148,420,400), 60, make_shared<dielectric>(1.5));
+	    auto boundary = make_shared<sphere>(point(148,420,400), 60, materials.make<dielectric>(1.5));
     world.add(boundary);
 	world.add(make_shared<constant_medium>(
 		boundary, 0.2, make_shared<solid_colour>(0.2, 0.4, 0.9)));
@@ -365,51 +347,30 @@ hittable_list cornell_box(camera& cam, double aspect)
 	box1 = make_shared<translate>(box1, vector3(263, 0, 263));
 	world.add(box1);*/
 
+	// The door frames and beams are all copies of one unit box, scaled and moved into place.
+	auto unit_box = make_shared<box>(point(0, 0, 0), point(1, 1, 1), white);
+	auto place_box = [](const vector3& corner, const vector3& size) {
+		return affine_transform::translation(corner) * affine_transform::scaling(size);
+	};
+
 	//Red Doorway
 	world.add(make_shared<yz_rect>(0, 356, 200, 356, 1, red_light));
 
-	shared_ptr<hittable> box2 = make_shared<box>(point(0, 0, 0), point(15, 356, 15), white);
-	box2 = make_shared<rotate_y>(box2, 0);
-	box2 = make_shared<translate>(box2, vector3(0, 0, 185));
-	world.add(box2);
-	shared_ptr<hittable> box3 = make_shared<box>(point(0, 0, 0), point(15, 356, 15), white);
-	box3 = make_shared<rotate_y>(box3, 0);
-	box3 = make_shared<translate>(box3, vector3(0, 0, 356));
-	world.add(box3);
-	shared_ptr<hittable> box4 = make_shared<box>(point(0, 0, 0), point(15, 15, 186), white);
-	box4 = make_shared<rotate_y>(box4, 0);
-	box4 = make_shared<translate>(box4, vector3(0, 356, 185));
-	world.add(box4);
+	world.add(make_shared<instance>(unit_box, place_box(vector3(0, 0, 185), vector3(15, 356, 15))));
+	world.add(make_shared<instance>(unit_box, place_box(vector3(0, 0, 356), vector3(15, 356, 15))));
+	world.add(make_shared<instance>(unit_box, place_box(vector3(0, 356, 185), vector3(15, 15, 186))));
 
 	//Blue Doorway
 	world.add(make_shared<flip_face>(make_shared<yz_rect>(0, 356, 200, 356, 554, blue_light)));
 
-	shared_ptr<hittable> box5 = make_shared<box>(point(0, 0, 0), point(15, 356, 15), white);
-	box5 = make_shared<rotate_y>(box5, 0);
-	box5 = make_shared<translate>(box5, vector3(540, 0, 185));
-	world.add(box5);
-	shared_ptr<hittable> box6 = make_shared<box>(point(0, 0, 0), point(15, 356, 15), white);
-	box6 = make_shared<rotate_y>(box6, 0);
-	box6 = make_shared<translate>(box6, vector3(540, 0, 356));
-	world.add(box6);
-	shared_ptr<hittable> box7 = make_shared<box>(point(0, 0, 0), point(15, 15, 186), white);
-	box7 = make_shared<rotate_y>(box7, 0);
-	box7 = make_shared<translate>(box7, vector3(540, 356, 185));
-	world.add(box7);
-
-
-	shared_ptr<hittable> box8 = make_shared<box>(point(0, 0, 0), point(10, 10, 600), white);
-	box8 = make_shared<rotate_y>(box8, 0);
-	box8 = make_shared<translate>(box8, vector3(545, 545, -50));
-	world.add(box8);
-	shared_ptr<hittable> box9 = make_shared<box>(point(0, 0, 0), point(10, 10, 600), white);
-	box9 = make_shared<rotate_y>(box9, 0);
-	box9 = make_shared<translate>(box9, vector3(0, 545, -50));
-	world.add(box9);
-	shared_ptr<hittable> box10 = make_shared<box>(point(0, 0, 0), point(555, 10, 10), white);
-	box10 = make_shared<rotate_y>(box10, 0);
-	box10 = make_shared<translate>(box10, vector3(0, 545, 545));
-	world.add(box10);
+	world.add(make_shared<instance>(unit_box, place_box(vector3(540, 0, 185), vector3(15, 356, 15))));
+	world.add(make_shared<instance>(unit_box, place_box(vector3(540, 0, 356), vector3(15, 356, 15))));
+	world.add(make_shared<instance>(unit_box, place_box(vector3(540, 356, 185), vector3(15, 15, 186))));
+
+
+	world.add(make_shared<instance>(unit_box, place_box(vector3(545, 545, -50), vector3(10, 10, 600))));
+	world.add(make_shared<instance>(unit_box, place_box(vector3(0, 545, -50), vector3(10, 10, 600))));
+	world.add(make_shared<instance>(unit_box, place_box(vector3(0, 545, 545), vector3(555, 10, 10))));
 
 	//Camera Settings
 
@@ -428,47 +389,414 @@ hittable_list cornell_box(camera& cam, double aspect)
 }
 
 
-int main() {
-    const auto aspect_ratio = 1.0 / 1.0;
-    const int image_width = 500;
-    const int image_height = static_cast<int>(image_width / aspect_ratio);
-	int samples_per_pixel = 2000;
-	int max_depth = 50;
+struct render_settings {
+	int image_width;
+	int image_height;
+	int samples_per_pixel;		// the cap when sampling adaptively
+	integrator_settings integrator;
+	adaptive_settings adaptive;
+	bool packets = true;		// trace a pixel's camera rays and first shadow rays as packets
+	bool wavefront = false;		// trace the samples of many pixels together, a bounce at a time
+};
+
+
+// Seeds the thread's random stream for sample s of pixel (i, j) and makes its camera ray.
+ray start_sample(int i, int j, int s, const render_settings& settings, const camera& cam) {
+	seed_random(static_cast<uint64_t>(j) * settings.image_width + i, s);
+	auto offset = random_2d();
+	return cam.get_ray((i + offset.u) / settings.image_width, (j + offset.v) / settings.image_height);
+}
+
+
+// Takes samples [first, first + count) of pixel (i, j), passing each one's colour to `add` in
+// sample order. With packets on, a pixel's samples are traced packet_size at a time; their
+// rays leave the camera close together, so they share most of the BVH walk.
+template <typename Add>
+void sample_pixel(
+	int i, int j, int first, int count,
+	const render_settings& settings,
+	const camera& cam,
+	const hittable& world,
+	const light_sampler& lights,
+	path_stats& stats,
+	Add add
+) {
+	if (!settings.packets) {
+		for (int s = first; s < first + count; ++s)
+		{
+			ray r = start_sample(i, j, s, settings, cam);
+			add(ray_colour(r, world, lights, settings.integrator, stats));
+		}
+		return;
+	}
+
+	ray rays[packet_size];
+	random_stream streams[packet_size];
+	colour samples[packet_size];
+	for (int s = first; s < first + count; s += packet_size)
+	{
+		auto lanes = std::min(packet_size, first + count - s);
+		for (int k = 0; k < lanes; ++k)
+		{
+			rays[k] = start_sample(i, j, s + k, settings, cam);
+			streams[k] = thread_random_stream();
+		}
+		ray_colours(rays, streams, lanes, world, lights, settings.integrator, stats, samples);
+		for (int k = 0; k < lanes; ++k)
+			add(samples[k]);
+	}
+}
+
+
+// Samples [first, first + count) of pixel (i, j).
+struct pixel_samples {
+	int i, j;
+	int first, count;
+};
 
-	std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
-	colour background(0, 0, 0);
+// sample_pixel for each of `runs`, passing each sample's colour to add(run index, colour), a
+// run's samples in sample order. In wavefront mode the samples of all the runs are traced as
+// one stream of paths, wavefront_size at a time.
+template <typename Add>
+void sample_pixels(
+	const std::vector<pixel_samples>& runs,
+	const render_settings& settings,
+	const camera& cam,
+	const hittable& world,
+	const light_sampler& lights,
+	path_stats& stats,
+	Add add
+) {
+	if (!settings.wavefront) {
+		for (size_t k = 0; k < runs.size(); ++k)
+			sample_pixel(runs[k].i, runs[k].j, runs[k].first, runs[k].count, settings, cam, world, lights, stats,
+				[&](const colour& sample) { add(k, sample); });
+		return;
+	}
 
-	camera cam;
-	auto world = cornell_box(cam, aspect_ratio);
+	thread_local wavefront_integrator wavefront;
+	std::vector<ray> rays;
+	std::vector<random_stream> streams;
+	std::vector<size_t> owners;
+	std::vector<colour> samples(wavefront_size);
+	rays.reserve(wavefront_size);
+	streams.reserve(wavefront_size);
+	owners.reserve(wavefront_size);
+
+	auto flush = [&] {
+		wavefront.trace(rays.data(), streams.data(), rays.size(), world, lights, settings.integrator, stats, samples.data());
+		for (size_t n = 0; n < rays.size(); ++n)
+			add(owners[n], samples[n]);
+		rays.clear();
+		streams.clear();
+		owners.clear();
+	};
+
+	for (size_t k = 0; k < runs.size(); ++k)
+	{
+		const auto& run = runs[k];
+		for (int s = run.first; s < run.first + run.count; ++s)
+		{
+			rays.push_back(start_sample(run.i, run.j, s, settings, cam));
+			streams.push_back(thread_random_stream());
+			owners.push_back(k);
+			if (rays.size() == wavefront_size)
+				flush();
+		}
+	}
+	if (!rays.empty())
+		flush();
+}
 
-	ofstream img("picture.ppm");
-	img << "P3" << endl;
-	img << image_width << " " << image_height << endl;
-	img << "255" << endl;
 
-	auto lights = make_shared<hittable_list>();
-	lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
-	lights->add(make_shared<sphere>(point(190, 90, 190), 90, shared_ptr<material>()));
+void render_tile(
+	const tile& t,
+	const render_settings& settings,
+	const camera& cam,
+	const hittable& world,
+	const light_sampler& lights,
+	framebuffer& image,
+	path_stats& stats
+) {
+	std::vector<pixel_samples> runs;
+	for (int j = t.y0; j < t.y1; ++j)
+		for (int i = t.x0; i < t.x1; ++i)
+			runs.push_back(pixel_samples{ i, j, 0, settings.samples_per_pixel });
+
+	std::vector<colour> pixel_colours(runs.size(), colour(0, 0, 0));
+	sample_pixels(runs, settings, cam, world, lights, stats,
+		[&](size_t k, const colour& sample) { pixel_colours[k] += sample; });
+
+	for (size_t k = 0; k < runs.size(); ++k)
+		image.set(runs[k].i, runs[k].j, pixel_colours[k]);
+}
+
+
+// The adaptive counterpart of render_tile, working through the tile a block at a time.
+// Sample numbers carry on from batch to batch, so a block that runs to the cap gets exactly
+// the samples of a uniform render.
+void render_tile_adaptive(
+	const tile& t,
+	const render_settings& settings,
+	const camera& cam,
+	const hittable& world,
+	const light_sampler& lights,
+	framebuffer& image,
+	std::vector<int>& sample_counts,
+	path_stats& stats
+) {
+	const auto& adaptive = settings.adaptive;
+	std::vector<pixel_estimate> block;
+	std::vector<pixel_samples> runs;
 
-	for (int j = image_height-1; j >= 0; --j) 
+	for (int by = t.y0; by < t.y1; by += adaptive.block_size)
 	{
-		std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-		for (int i = 0; i < image_width; ++i) 
+		for (int bx = t.x0; bx < t.x1; bx += adaptive.block_size)
 		{
-			colour pixel_color(0, 0, 0);
-				for (int s=0; s < samples_per_pixel; ++s) 
+			auto x1 = std::min(bx + adaptive.block_size, t.x1);
+			auto y1 = std::min(by + adaptive.block_size, t.y1);
+			block.assign(static_cast<size_t>(x1 - bx) * (y1 - by), pixel_estimate());
+
+			int taken = 0;
+			while (taken < settings.samples_per_pixel)
+			{
+				auto batch = taken < adaptive.min_samples ? adaptive.min_samples : adaptive.batch_size;
+				batch = std::min(batch, settings.samples_per_pixel - taken);
+
+				runs.clear();
+				for (int j = by; j < y1; ++j)
+					for (int i = bx; i < x1; ++i)
+						runs.push_back(pixel_samples{ i, j, taken, batch });
+				sample_pixels(runs, settings, cam, world, lights, stats,
+					[&](size_t k, const colour& sample) { block[k].add(sample); });
+				taken += batch;
+
+				double relative_variance = 0;
+				for (const auto& estimate : block)
+					relative_variance += estimate.relative_variance();
+
+				if (relative_variance / block.size() <= adaptive.max_error * adaptive.max_error)
+					break;
+			}
+
+			auto estimate = block.begin();
+			for (int j = by; j < y1; ++j)
+			{
+				for (int i = bx; i < x1; ++i, ++estimate)
 				{
-					auto u = (i + random_double()) / image_width;
-					auto v = (j + random_double()) / image_height;
-					ray r = cam.get_ray(u, v);
-					pixel_color += ray_colour(r, background, world, lights, max_depth);
+					image.set(i, j, estimate->sum / estimate->count);
+					sample_counts[static_cast<size_t>(j) * settings.image_width + i] = estimate->count;
 				}
-            write_color(std::cout, pixel_color, samples_per_pixel);
-        }
-    }
+			}
+		}
+	}
+}
+
+
+int main(int argc, char* argv[]) {
+	int thread_count = thread_pool::default_thread_count();
+	int tile_size = 32;
+	bvh_options bvh_settings;
+	bvh_settings.split = bvh_split::sah;
+	bool show_path_stats = false;
+	std::string scene_file;
+	bool use_mesh_cache = true;
+	bool use_packets = true;
+	bool use_wavefront = false;
+	std::string output_file;
+	std::string heatmap_file;
+	adaptive_settings adaptive;
+	sampler_type sampling = sampler_type::independent;
+	light_strategy light_picking = light_strategy::automatic;
+
+	// Command line values override the scene's own; -1 leaves them as the scene has them.
+	int image_width = -1;
+	int samples_per_pixel = -1;
+	int max_depth = -1;
+	int roulette_depth = -1;
+
+	for (int a = 1; a < argc; ++a)
+	{
+		if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+			thread_count = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--tile-size") == 0 && a + 1 < argc)
+			tile_size = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--bvh") == 0 && a + 1 < argc && strcmp(argv[a+1], "median") == 0)
+			bvh_settings.split = bvh_split::random_median, ++a;
+		else if (strcmp(argv[a], "--bvh") == 0 && a + 1 < argc && strcmp(argv[a+1], "sah") == 0)
+			bvh_settings.split = bvh_split::sah, ++a;
+		else if (strcmp(argv[a], "--bvh-width") == 0 && a + 1 < argc)
+			bvh_settings.width = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--sah-cost-ratio") == 0 && a + 1 < argc)
+			bvh_settings.traversal_cost = atof(argv[++a]) * bvh_settings.intersection_cost;
+		else if (strcmp(argv[a], "--max-leaf-size") == 0 && a + 1 < argc)
+			bvh_settings.max_leaf_size = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--max-depth") == 0 && a + 1 < argc)
+			max_depth = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--roulette-depth") == 0 && a + 1 < argc)
+			roulette_depth = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--path-stats") == 0)
+			show_path_stats = true;
+		else if (strcmp(argv[a], "--scene") == 0 && a + 1 < argc)
+			scene_file = argv[++a];
+		else if (strcmp(argv[a], "--width") == 0 && a + 1 < argc)
+			image_width = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--spp") == 0 && a + 1 < argc)
+			samples_per_pixel = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--no-mesh-cache") == 0)
+			use_mesh_cache = false;
+		else if (strcmp(argv[a], "--no-packets") == 0)
+			use_packets = false;
+		else if (strcmp(argv[a], "--wavefront") == 0)
+			use_wavefront = true;
+		else if (strcmp(argv[a], "--geometry") == 0 && a + 1 < argc && strcmp(argv[a+1], "float") == 0)
+			float_geometry() = true, ++a;
+		else if (strcmp(argv[a], "--geometry") == 0 && a + 1 < argc && strcmp(argv[a+1], "double") == 0)
+			float_geometry() = false, ++a;
+		else if (strcmp(argv[a], "--output") == 0 && a + 1 < argc)
+			output_file = argv[++a];
+		else if (strcmp(argv[a], "--sampler") == 0 && a + 1 < argc && sampler_type_from_name(argv[a+1], sampling))
+			++a;
+		else if (strcmp(argv[a], "--light-sampler") == 0 && a + 1 < argc && light_strategy_from_name(argv[a+1], light_picking))
+			++a;
+		else if (strcmp(argv[a], "--adaptive") == 0 && a + 1 < argc)
+			adaptive.enabled = true, adaptive.max_error = atof(argv[++a]);
+		else if (strcmp(argv[a], "--min-spp") == 0 && a + 1 < argc)
+			adaptive.min_samples = atoi(argv[++a]);
+		else if (strcmp(argv[a], "--heatmap") == 0 && a + 1 < argc)
+			heatmap_file = argv[++a];
+		else {
+			std::cerr << "Usage: " << argv[0] << " [--scene FILE] [--output FILE.ppm|png|pfm]"
+				<< " [--width N] [--spp N] [--sampler independent|stratified|halton|sobol|bluenoise]"
+				<< " [--light-sampler power|tree|auto] [--adaptive ERROR [--min-spp N] [--heatmap FILE]]"
+				<< " [--no-mesh-cache] [--no-packets] [--wavefront] [--geometry float|double (mesh triangles only)]"
+				<< " [--threads N] [--tile-size N] [--bvh median|sah] [--bvh-width 2|4|8]"
+				<< " [--sah-cost-ratio X] [--max-leaf-size N]"
+				<< " [--max-depth N] [--roulette-depth N] [--path-stats]\n";
+			return 1;
+		}
+	}
+
+	if (thread_count < 1) thread_count = 1;
+	if (tile_size < 1) tile_size = 1;
+	if (bvh_settings.width != 2 && bvh_settings.width != 4 && bvh_settings.width != 8) {
+		std::cerr << "ERROR: --bvh-width must be 2, 4 or 8.\n";
+		return 1;
+	}
 
+	if (adaptive.min_samples < 2) adaptive.min_samples = 2;
 
+	image_format output_format;
+	for (const auto& file : { output_file, heatmap_file }) {
+		if (!file.empty() && !image_format_for(file, output_format)) {
+			std::cerr << "ERROR: Unknown image format for '" << file << "'; use .ppm, .png or .pfm.\n";
+			return 1;
+		}
+	}
+
+	// The pool loads the scene's images and meshes before it renders.
+	thread_pool pool(thread_count);
+	material_table materials;
+	scene_description scene;
+
+	if (scene_file.empty()) {
+		scene.world = cornell_box(scene.cam, scene.aspect_ratio, materials);
+	} else {
+		scene_loader loader(materials, pool, bvh_settings);
+		loader.use_mesh_cache = use_mesh_cache;
+		if (!loader.load(scene_file, scene))
+			return 1;
+	}
+
+	render_settings settings;
+	settings.image_width = image_width > 0 ? image_width : scene.image_width;
+	settings.image_height = static_cast<int>(settings.image_width / scene.aspect_ratio);
+	settings.samples_per_pixel = samples_per_pixel > 0 ? samples_per_pixel : scene.samples_per_pixel;
+	settings.integrator = scene.integrator;
+	if (max_depth >= 0) settings.integrator.max_depth = max_depth;
+	if (roulette_depth >= 0) settings.integrator.roulette_depth = roulette_depth;
+	if (settings.integrator.max_depth < 1) settings.integrator.max_depth = 1;
+	settings.adaptive = adaptive;
+	settings.packets = use_packets;
+	settings.wavefront = use_wavefront;
+	active_sampler() = sampler(sampling, settings.samples_per_pixel, settings.image_width);
+
+	auto start = std::chrono::steady_clock::now();
+	auto world_bvh = make_scene_bvh(scene.world, 0.0, 1.0, bvh_settings);
+	const auto& world = *world_bvh;
+	std::cerr << "Top-level BVH" << bvh_settings.width << " over " << scene.world.objects.size() << " objects built in "
+		<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s.\n";
+
+	start = std::chrono::steady_clock::now();
+	light_sampler lights(scene.world, light_picking);
+	std::cerr << "Lights found: " << lights.size() << ", picked by " << (lights.uses_tree() ? "tree" : "power")
+		<< ", set up in "
+		<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s.\n";
+
+	const auto& cam = scene.cam;
+
+	framebuffer image(settings.image_width, settings.image_height);
+	std::vector<int> sample_counts(
+		settings.adaptive.enabled ? static_cast<size_t>(settings.image_width) * settings.image_height : 0);
+	auto tiles = make_tiles(settings.image_width, settings.image_height, tile_size);
+	progress_reporter progress(tiles.size());
+	path_stats stats(settings.integrator.max_depth);
+	std::mutex stats_lock;
+
+	for (const auto& t : tiles)
+	{
+		pool.submit([&, t] {
+			path_stats tile_stats(settings.integrator.max_depth);
+			if (settings.adaptive.enabled)
+				render_tile_adaptive(t, settings, cam, world, lights, image, sample_counts, tile_stats);
+			else
+				render_tile(t, settings, cam, world, lights, image, tile_stats);
+			{
+				std::lock_guard<std::mutex> guard(stats_lock);
+				stats.merge(tile_stats);
+			}
+			progress.tile_done();
+		});
+	}
+	pool.wait();
+
+	progress.finish();
+	if (show_path_stats)
+		stats.print(std::cerr);
+
+	// Adaptive pixels already hold their mean.
+	auto output_samples = settings.adaptive.enabled ? 1 : settings.samples_per_pixel;
+
+	if (settings.adaptive.enabled) {
+		uint64_t total = 0;
+		for (auto n : sample_counts)
+			total += n;
+		std::cerr << "Adaptive sampling took " << total << " samples, "
+			<< static_cast<double>(total) / sample_counts.size() << " per pixel ("
+			<< 100.0 * total / (static_cast<double>(sample_counts.size()) * settings.samples_per_pixel)
+			<< "% of a uniform render).\n";
+
+		if (!heatmap_file.empty()) {
+			framebuffer heatmap(settings.image_width, settings.image_height);
+			for (int j = 0; j < settings.image_height; ++j)
+				for (int i = 0; i < settings.image_width; ++i)
+					heatmap.set(i, j, heatmap_colour(static_cast<double>(
+						sample_counts[static_cast<size_t>(j) * settings.image_width + i]) / settings.samples_per_pixel));
+			write_image(heatmap_file, heatmap, 1);
+		}
+	}
 
-    std::cerr << "\nDone.\n";
+	start = std::chrono::steady_clock::now();
+	if (output_file.empty()) {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		if (!write_image(std::cout, image_format::ppm, image, output_samples))
+			return 1;
+	} else if (!write_image(output_file, image, output_samples)) {
+		return 1;
+	}
+	std::cerr << "Image written in "
+		<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s.\n";
 }
@@ -16,21 +16,30 @@
 #include "texture.h"
 #include "pdf.h"
 
+#include <utility>
+#include <vector>
+
 double schlick(double cosine, double ref_idx) {
     double r0 = (1-ref_idx) / (1+ref_idx);
     r0 = r0*r0;
     return r0 + (1-r0)*pow((1 - cosine),5);
 }
 
+// The material classes below, and `other` for any type defined elsewhere. The wavefront
+// integrator queues hits by type to shade each queue with its calls bound statically.
+enum class material_type { lambertian, metal, dielectric, isotropic, diffuse_light, other };
+const int material_type_count = static_cast<int>(material_type::other) + 1;
+
 struct scatter_record {
 	ray specular_ray;
 	bool is_specular;
 	colour attenuation;
-	shared_ptr<pdf> pdf_ptr;
+	scatter_pdf pdf;
 };
 
 class material  {
     public:
+		material(material_type type = material_type::other) : type(type) {}
 
 		virtual colour emitted
 		(const ray& r_in, const hit_record& rec, double u, double v, const point& p) const 
@@ -50,20 +59,23 @@ class material  {
 			return 0;
 		}
 
-		
+		material_type type_of() const { return type; }
+
+	private:
+		material_type type;
 };
 
 
-class dielectric : public material
+class dielectric final : public material
 {
 public:
-	dielectric(double ri) : ref_idx(ri) {}
+	dielectric(double ri) : material(material_type::dielectric), ref_idx(ri) {}
 
 	virtual bool scatter(
 		const ray& r_in, const hit_record& rec, scatter_record& srec
 	) const {
 		srec.is_specular = true;
-		srec.pdf_ptr = nullptr;
+		srec.pdf = scatter_pdf();
 		srec.attenuation = colour(1.0, 1.0, 1.0);
 		double etai_over_etat = (rec.front_face) ? (1.0 / ref_idx) : (ref_idx);
 
@@ -72,7 +84,7 @@ public:
 		double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 		if (etai_over_etat * sin_theta > 1.0) {
 			vector3 reflected = reflect(unit_direction, rec.normal);
-			srec.specular_ray = ray(rec.p, reflected, r_in.time());
+			srec.specular_ray = rec.spawn_ray(reflected, r_in.time());
 			return true;
 		}
 
@@ -80,12 +92,12 @@ public:
 		if (random_double() < reflect_prob)
 		{
 			vector3 reflected = reflect(unit_direction, rec.normal);
-			srec.specular_ray = ray(rec.p, reflected, r_in.time());
+			srec.specular_ray = rec.spawn_ray(reflected, r_in.time());
 			return true;
 		}
 
 		vector3 refracted = refract(unit_direction, rec.normal, etai_over_etat);
-		srec.specular_ray = ray(rec.p, refracted, r_in.time());
+		srec.specular_ray = rec.spawn_ray(refracted, r_in.time());
 		return true;
 	}
 
@@ -93,12 +105,12 @@ public:
 	double ref_idx;
 };
 
-class diffuse_light : public material {
+class diffuse_light final : public material {
     public:
-        diffuse_light(shared_ptr<texture> a) : emit(a) {}
+        diffuse_light(shared_ptr<texture> a) : material(material_type::diffuse_light), emit(a) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, scatter_record& srec
         ) const {
             return false;
         }
@@ -116,15 +128,19 @@ class diffuse_light : public material {
         shared_ptr<texture> emit;
 };
 
-class isotropic : public material {
+class isotropic final : public material {
     public:
-        isotropic(shared_ptr<texture> a) : albedo(a) {}
+        isotropic(shared_ptr<texture> a) : material(material_type::isotropic), albedo(a) {}
 
+        // The phase function is sampled exactly, so like a mirror it takes no part in light
+        // sampling.
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, scatter_record& srec
         ) const  {
-            scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
+            srec.is_specular = true;
+            srec.pdf = scatter_pdf();
+            srec.specular_ray = rec.spawn_ray(random_unit_vector(), r_in.time());
+            srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
         }
 
@@ -132,16 +148,16 @@ class isotropic : public material {
         shared_ptr<texture> albedo;
 };
 
-class lambertian : public material {
+class lambertian final : public material {
     public:
-        lambertian(shared_ptr<texture> a) : albedo(a) {}
+        lambertian(shared_ptr<texture> a) : material(material_type::lambertian), albedo(a) {}
 
 		virtual bool scatter(
 			const ray& r_in, const hit_record& rec, scatter_record& srec
 		) const {
 			srec.is_specular = false;
 			srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-			srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
+			srec.pdf = scatter_pdf::cosine(rec.normal);
 			return true;
 		}
 		double scattering_pdf(
@@ -155,26 +171,70 @@ class lambertian : public material {
         shared_ptr<texture> albedo;
 };
 
-class metal : public material {
+class metal final : public material {
     public:
-        metal(const colour& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+        metal(const colour& a, double f) : material(material_type::metal), albedo(a), fuzz(f < 1 ? f : 1) {}
 
+		// A fuzzy reflection has a lobe that can be evaluated, so it takes part in light
+		// sampling; only a perfect mirror is specular.
 		virtual bool scatter(
 			const ray& r_in, const hit_record& rec, scatter_record& srec
 		) const {
 			vector3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-			srec.specular_ray =
-				ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
 			srec.attenuation = albedo;
+			if (fuzz > 0) {
+				srec.is_specular = false;
+				srec.pdf = scatter_pdf::fuzz(reflected, fuzz);
+				return true;
+			}
+			srec.specular_ray = rec.spawn_ray(reflected, r_in.time());
 			srec.is_specular = true;
-			srec.pdf_ptr = nullptr;
+			srec.pdf = scatter_pdf();
 			return true;
 		}
 
+		// The lobe is its own pdf; the albedo is the whole of the weight.
+		double scattering_pdf(
+			const ray& r_in, const hit_record& rec, const ray& scattered
+		) const {
+			if (fuzz <= 0)
+				return 0;
+			vector3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+			return fuzz_pdf(reflected, fuzz).value(scattered.direction());
+		}
+
     public:
         colour albedo;
         double fuzz;
 };
 
 
+// Owns the materials of a scene. Primitives and hit records refer to materials through
+// plain pointers so the intersection loop never touches a reference count; the table has
+// to outlive every object built from it.
+class material_table {
+    public:
+        template <typename T, typename... Args>
+        const material* make(Args&&... args) {
+            return add(make_shared<T>(std::forward<Args>(args)...));
+        }
+
+        const material* add(shared_ptr<material> m) {
+            materials.push_back(m);
+            return m.get();
+        }
+
+        // Takes over everything another table owns, e.g. one filled by a loader thread.
+        void merge(material_table&& other) {
+            materials.insert(materials.end(), other.materials.begin(), other.materials.end());
+            other.materials.clear();
+        }
+
+        size_t size() const { return materials.size(); }
+
+    private:
+        std::vector<shared_ptr<material>> materials;
+};
+
+
 #endif
@@ -0,0 +1,462 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "constants.h"
+
+#include "linear_bvh.h"
+#include "material.h"
+#include "obj_loader.h"
+#include "triangle_mesh.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Built meshes are kept in a binary file beside their OBJ ("model.obj.cache") whose vertex,
+// triangle and BVH node arrays are laid out exactly as triangle_mesh uses them. A later run
+// maps the file and points the mesh at it, so nothing is parsed, built or copied and pages
+// are only read as rays reach them.
+//
+// A cache is used only if its key matches: a hash of the OBJ's bytes, the BVH options and
+// the format version. The MTL files are hashed too and checked when the cache is read, so
+// editing either the model or its materials rebuilds it.
+
+
+// A whole file mapped read-only into memory.
+class mapped_file {
+    public:
+        mapped_file() {}
+        ~mapped_file() { close(); }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        // Returns false if the file can't be opened or is empty.
+        bool open(const std::string& filename);
+        void close();
+
+        const char* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        const char* bytes = nullptr;
+        size_t length = 0;
+#ifdef _WIN32
+        HANDLE mapping = nullptr;
+#endif
+};
+
+
+#ifdef _WIN32
+
+bool mapped_file::open(const std::string& filename) {
+    close();
+    auto file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+
+    bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!bytes) {
+        close();
+        return false;
+    }
+    length = static_cast<size_t>(file_size.QuadPart);
+    return true;
+}
+
+void mapped_file::close() {
+    if (bytes)
+        UnmapViewOfFile(bytes);
+    if (mapping)
+        CloseHandle(mapping);
+    bytes = nullptr;
+    mapping = nullptr;
+    length = 0;
+}
+
+#else
+
+bool mapped_file::open(const std::string& filename) {
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    void* address = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+        address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED)
+        return false;
+
+    bytes = static_cast<const char*>(address);
+    length = static_cast<size_t>(info.st_size);
+    return true;
+}
+
+void mapped_file::close() {
+    if (bytes)
+        munmap(const_cast<char*>(bytes), length);
+    bytes = nullptr;
+    length = 0;
+}
+
+#endif
+
+
+// A fast 64-bit hash for cache keys: one multiply per eight bytes. Not cryptographic.
+inline uint64_t hash_bytes(const void* data, size_t size, uint64_t h = 0x9E3779B97F4A7C15ull) {
+    auto p = static_cast<const unsigned char*>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    for (; i < size; i++)
+        h = (h ^ p[i]) * 0x100000001B3ull;
+    h ^= size;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    return h ^ (h >> 33);
+}
+
+
+// Hashes a file's contents. A file that can't be read hashes to zero.
+inline uint64_t hash_file(const std::string& filename) {
+    mapped_file file;
+    return file.open(filename) ? hash_bytes(file.data(), file.size()) : 0;
+}
+
+
+const uint32_t mesh_cache_version = 2;
+
+// The start of a cache file. Each array begins at a multiple of 64 bytes from the start of
+// the file, which a mapping places on a page boundary, so every element is aligned.
+struct mesh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertex_size;       // element sizes, so a build with another layout rejects it
+    uint32_t triangle_size;
+    uint32_t node_size;
+    uint64_t key;
+    uint64_t vertex_count, vertex_offset;
+    uint64_t triangle_count, triangle_offset;
+    uint64_t node_count, node_offset;
+    uint64_t material_bytes, material_offset;
+    double bounds[6];
+};
+
+static const char mesh_cache_magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', '\r', '\n' };
+
+
+namespace mesh_cache_detail {
+
+inline uint64_t aligned(uint64_t offset) {
+    return (offset + 63) & ~uint64_t(63);
+}
+
+// The material section is a flat record of the MTL libraries with their hashes, then the
+// entries behind each material slot.
+class writer {
+    public:
+        template <typename T>
+        void put(const T& value) {
+            auto p = reinterpret_cast<const char*>(&value);
+            bytes.insert(bytes.end(), p, p + sizeof(T));
+        }
+
+        void put_string(const std::string& s) {
+            put(static_cast<uint32_t>(s.size()));
+            bytes.insert(bytes.end(), s.begin(), s.end());
+        }
+
+        std::vector<char> bytes;
+};
+
+class reader {
+    public:
+        reader(const char* data, size_t size) : p(data), end(data + size) {}
+
+        template <typename T>
+        bool get(T& value) {
+            if (static_cast<size_t>(end - p) < sizeof(T))
+                return false;
+            memcpy(&value, p, sizeof(T));
+            p += sizeof(T);
+            return true;
+        }
+
+        bool get_string(std::string& s) {
+            uint32_t size;
+            if (!get(size) || static_cast<size_t>(end - p) < size)
+                return false;
+            s.assign(p, size);
+            p += size;
+            return true;
+        }
+
+    private:
+        const char* p;
+        const char* end;
+};
+
+inline void put_entry(writer& w, const obj_detail::mtl_entry& e) {
+    for (int a = 0; a < 3; a++) w.put(e.diffuse[a]);
+    for (int a = 0; a < 3; a++) w.put(e.emission[a]);
+    w.put(e.shininess);
+    w.put(e.ior);
+    w.put(e.dissolve);
+    w.put(static_cast<int32_t>(e.illum));
+    w.put_string(e.diffuse_map);
+}
+
+inline bool get_entry(reader& r, obj_detail::mtl_entry& e) {
+    double diffuse[3], emission[3];
+    int32_t illum;
+    for (int a = 0; a < 3; a++) if (!r.get(diffuse[a])) return false;
+    for (int a = 0; a < 3; a++) if (!r.get(emission[a])) return false;
+    if (!r.get(e.shininess) || !r.get(e.ior) || !r.get(e.dissolve) || !r.get(illum)
+        || !r.get_string(e.diffuse_map))
+        return false;
+    e.diffuse = colour(diffuse[0], diffuse[1], diffuse[2]);
+    e.emission = colour(emission[0], emission[1], emission[2]);
+    e.illum = illum;
+    return true;
+}
+
+} // namespace mesh_cache_detail
+
+
+// The key for an OBJ file's cache: its contents, the options its BVH is built with, and the
+// cache format.
+inline uint64_t mesh_cache_key(const mapped_file& obj, const bvh_options& options) {
+    auto h = hash_bytes(obj.data(), obj.size(), mesh_cache_version);
+    auto split = static_cast<int>(options.split);
+    h = hash_bytes(&split, sizeof(split), h);
+    h = hash_bytes(&options.bins, sizeof(options.bins), h);
+    h = hash_bytes(&options.max_leaf_size, sizeof(options.max_leaf_size), h);
+    h = hash_bytes(&options.traversal_cost, sizeof(options.traversal_cost), h);
+    return hash_bytes(&options.intersection_cost, sizeof(options.intersection_cost), h);
+}
+
+
+// Writes `mesh` to `cache_file` under `key`. It is written beside the target and renamed
+// over it, so a reader never sees half a file. Returns false if it can't be written.
+bool write_mesh_cache(
+    const std::string& cache_file, uint64_t key, const triangle_mesh& mesh,
+    const obj_material_info& info, const std::string& directory
+) {
+    using namespace mesh_cache_detail;
+
+    writer materials;
+    materials.put(static_cast<uint32_t>(info.libraries.size()));
+    for (const auto& library : info.libraries) {
+        materials.put_string(library);
+        materials.put(hash_file(directory + library));
+    }
+    materials.put(static_cast<uint32_t>(info.slots.size()));
+    for (const auto& entry : info.slots)
+        put_entry(materials, entry);
+
+    mesh_cache_header header = {};
+    memcpy(header.magic, mesh_cache_magic, sizeof(header.magic));
+    header.version = mesh_cache_version;
+    header.vertex_size = sizeof(mesh_vertex);
+    header.triangle_size = sizeof(mesh_triangle);
+    header.node_size = sizeof(linear_bvh_node);
+    header.key = key;
+    header.vertex_count = mesh.vertices.size();
+    header.vertex_offset = aligned(sizeof(header));
+    header.triangle_count = mesh.triangles.size();
+    header.triangle_offset = aligned(header.vertex_offset + header.vertex_count * sizeof(mesh_vertex));
+    header.node_count = mesh.nodes.size();
+    header.node_offset = aligned(header.triangle_offset + header.triangle_count * sizeof(mesh_triangle));
+    header.material_bytes = materials.bytes.size();
+    header.material_offset = aligned(header.node_offset + header.node_count * sizeof(linear_bvh_node));
+    for (int a = 0; a < 3; a++) {
+        header.bounds[a] = mesh.box.min()[a];
+        header.bounds[a + 3] = mesh.box.max()[a];
+    }
+
+    auto temporary = cache_file + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        uint64_t written = 0;
+        auto write_at = [&](uint64_t offset, const void* data, uint64_t size) {
+            static const char zeros[64] = {};
+            out.write(zeros, static_cast<std::streamsize>(offset - written));
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+            written = offset + size;
+        };
+        write_at(0, &header, sizeof(header));
+        write_at(header.vertex_offset, mesh.vertices.data, header.vertex_count * sizeof(mesh_vertex));
+        write_at(header.triangle_offset, mesh.triangles.data, header.triangle_count * sizeof(mesh_triangle));
+        write_at(header.node_offset, mesh.nodes.data, header.node_count * sizeof(linear_bvh_node));
+        write_at(header.material_offset, materials.bytes.data(), header.material_bytes);
+        if (!out) {
+            out.close();
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+
+    std::remove(cache_file.c_str());
+    return std::rename(temporary.c_str(), cache_file.c_str()) == 0;
+}
+
+
+// Maps `cache_file` and, if it holds `key` and the MTL files it was made from are
+// unchanged, returns a mesh reading straight from it with its materials made afresh in
+// `materials`. Returns null otherwise.
+shared_ptr<triangle_mesh> read_mesh_cache(
+    const std::string& cache_file, uint64_t key, const std::string& directory,
+    material_table& materials
+) {
+    using namespace mesh_cache_detail;
+
+    auto file = make_shared<mapped_file>();
+    if (!file->open(cache_file) || file->size() < sizeof(mesh_cache_header))
+        return nullptr;
+
+    mesh_cache_header header;
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.magic, mesh_cache_magic, sizeof(header.magic)) != 0
+        || header.version != mesh_cache_version
+        || header.vertex_size != sizeof(mesh_vertex)
+        || header.triangle_size != sizeof(mesh_triangle)
+        || header.node_size != sizeof(linear_bvh_node)
+        || header.key != key)
+        return nullptr;
+
+    // Every array must lie inside the file, aligned as written.
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % 64 == 0 && offset <= file->size()
+            && count <= (file->size() - offset) / size;
+    };
+    if (!fits(header.vertex_offset, header.vertex_count, sizeof(mesh_vertex))
+        || !fits(header.triangle_offset, header.triangle_count, sizeof(mesh_triangle))
+        || !fits(header.node_offset, header.node_count, sizeof(linear_bvh_node))
+        || !fits(header.material_offset, header.material_bytes, 1))
+        return nullptr;
+
+    reader r(file->data() + header.material_offset, header.material_bytes);
+    uint32_t library_count, slot_count;
+    if (!r.get(library_count))
+        return nullptr;
+    for (uint32_t i = 0; i < library_count; i++) {
+        std::string library;
+        uint64_t hash;
+        if (!r.get_string(library) || !r.get(hash) || hash_file(directory + library) != hash)
+            return nullptr;
+    }
+
+    std::vector<obj_detail::mtl_entry> slots;
+    if (!r.get(slot_count))
+        return nullptr;
+    for (uint32_t i = 0; i < slot_count; i++) {
+        obj_detail::mtl_entry entry;
+        if (!get_entry(r, entry))
+            return nullptr;
+        slots.push_back(entry);
+    }
+
+    // The same materials load_obj makes, slot 0 being the default.
+    std::vector<const material*> mesh_materials;
+    mesh_materials.push_back(materials.make<lambertian>(make_shared<solid_colour>(0.73, 0.73, 0.73)));
+    for (const auto& entry : slots)
+        mesh_materials.push_back(obj_detail::make_mtl_material(entry, directory, materials));
+
+    auto base = file->data();
+    aabb box(point(header.bounds[0], header.bounds[1], header.bounds[2]),
+             point(header.bounds[3], header.bounds[4], header.bounds[5]));
+
+    return make_shared<triangle_mesh>(
+        file,
+        array_view<mesh_vertex>(reinterpret_cast<const mesh_vertex*>(base + header.vertex_offset), header.vertex_count),
+        array_view<mesh_triangle>(reinterpret_cast<const mesh_triangle*>(base + header.triangle_offset), header.triangle_count),
+        array_view<linear_bvh_node>(reinterpret_cast<const linear_bvh_node*>(base + header.node_offset), header.node_count),
+        std::move(mesh_materials), box);
+}
+
+
+// Loads an OBJ file as a triangle_mesh, from its cache when that is current. Otherwise the
+// OBJ is read and its BVH built, and the cache is (re)written for next time. Faces without
+// a material get a light grey lambertian. Returns null if the OBJ can't be read.
+shared_ptr<triangle_mesh> load_mesh(
+    const std::string& filename, material_table& materials, const bvh_options& options,
+    bool use_cache = true
+) {
+    auto start = std::chrono::steady_clock::now();
+    auto seconds_since = [](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+    };
+
+    auto directory = obj_detail::directory_of(filename);
+    auto cache_file = filename + ".cache";
+    uint64_t key = 0;
+
+    if (use_cache) {
+        mapped_file source;
+        if (!source.open(filename)) {
+            std::cerr << "ERROR: Could not open OBJ file '" << filename << "'.\n";
+            return nullptr;
+        }
+        key = mesh_cache_key(source, options);
+
+        if (auto mesh = read_mesh_cache(cache_file, key, directory, materials)) {
+            mesh->widen_bvh(options.width);
+            std::cerr << filename << ": " << mesh->triangles.size() << " triangles mapped from "
+                      << cache_file << " in " << seconds_since(start) << "s.\n";
+            return mesh;
+        }
+    }
+
+    mesh_data data;
+    obj_material_info info;
+    if (!load_obj(filename, materials, data, nullptr, &info))
+        return nullptr;
+    auto loaded = seconds_since(start);
+
+    auto mesh = make_shared<triangle_mesh>(std::move(data), options);
+    std::cerr << filename << ": " << mesh->triangles.size() << " triangles, "
+              << mesh->vertices.size() << " vertices, read in " << loaded << "s, BVH built in "
+              << seconds_since(start) - loaded << "s.\n";
+
+    if (use_cache && !write_mesh_cache(cache_file, key, *mesh, info, directory))
+        std::cerr << "ERROR: Could not write mesh cache '" << cache_file << "'.\n";
+    return mesh;
+}
+
+
+#endif
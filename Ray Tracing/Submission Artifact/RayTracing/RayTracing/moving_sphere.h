@@ -20,11 +20,12 @@ class moving_sphere : public hittable {
     public:
         moving_sphere() {}
         moving_sphere(
-            point cen0, point cen1, double t0, double t1, double r, shared_ptr<material> m)
+            point cen0, point cen1, double t0, double t1, double r, const material* m)
             : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m)
         {};
 
         virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+        virtual void finalize_hit(const ray& r, hit_record& rec) const;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
         point center(double time) const;
@@ -33,7 +34,7 @@ class moving_sphere : public hittable {
         point center0, center1;
         double time0, time1;
         double radius;
-        shared_ptr<material> mat_ptr;
+        const material* mat_ptr;
 };
 
 
@@ -69,20 +70,14 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
         auto temp = (-half_b - root)/a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.at(rec.t);
-            vector3 outward_normal = (rec.p - center(r.time())) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.object = this;
             return true;
         }
 
         temp = (-half_b + root)/a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.at(rec.t);
-            vector3 outward_normal = (rec.p - center(r.time())) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.object = this;
             return true;
         }
     }
@@ -90,4 +85,18 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     return false;
 }
 
+
+void moving_sphere::finalize_hit(const ray& r, hit_record& rec) const {
+    // Put the point back on the sphere, as sphere does.
+    auto centre = center(r.time());
+    auto to_p = r.at(rec.t) - centre;
+    to_p *= radius / to_p.length();
+    rec.p = centre + to_p;
+    rec.p_error = rounding_gamma<double>(5) * abs(to_p) + rounding_gamma<double>(1) * abs(rec.p);
+    vector3 outward_normal = to_p / radius;
+    rec.geometric_normal = outward_normal;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr;
+}
+
 #endif
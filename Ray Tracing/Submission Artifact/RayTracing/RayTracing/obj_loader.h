@@ -0,0 +1,310 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "constants.h"
+
+#include "material.h"
+#include "texture.h"
+#include "triangle_mesh.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Wavefront OBJ/MTL reading. Files are parsed a line at a time into mesh_data, so only the
+// raw position, normal and uv lists are held besides the finished mesh. Polygons are split
+// into fans; "v/vt/vn" corners that repeat are shared as one mesh_vertex.
+
+
+namespace obj_detail {
+
+inline const char* skip_space(const char* s) {
+    while (*s == ' ' || *s == '\t')
+        s++;
+    return s;
+}
+
+// Reads up to `count` numbers, leaving the rest of `out` untouched.
+inline int parse_floats(const char* s, float* out, int count) {
+    int read = 0;
+    for (; read < count; read++) {
+        char* end;
+        auto value = strtof(s, &end);
+        if (end == s)
+            break;
+        out[read] = value;
+        s = end;
+    }
+    return read;
+}
+
+// True if the line starts with `keyword` followed by whitespace; `rest` points past both.
+inline bool keyword(const char* line, const char* word, const char*& rest) {
+    auto length = strlen(word);
+    if (strncmp(line, word, length) != 0 || (line[length] != ' ' && line[length] != '\t'))
+        return false;
+    rest = skip_space(line + length);
+    return true;
+}
+
+inline std::string trimmed(const char* s) {
+    std::string text(skip_space(s));
+    while (!text.empty() && isspace(static_cast<unsigned char>(text.back())))
+        text.pop_back();
+    return text;
+}
+
+inline std::string directory_of(const std::string& path) {
+    auto slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+}
+
+// OBJ indices count from 1, or back from the end of the list when negative.
+inline long resolve_index(long index, size_t count) {
+    return index < 0 ? static_cast<long>(count) + index : index - 1;
+}
+
+struct corner_key {
+    long position, uv, normal;
+    bool operator==(const corner_key& other) const {
+        return position == other.position && uv == other.uv && normal == other.normal;
+    }
+};
+
+struct corner_hash {
+    size_t operator()(const corner_key& k) const {
+        auto h = static_cast<uint64_t>(k.position) * 0x9E3779B97F4A7C15ull;
+        h ^= static_cast<uint64_t>(k.uv) * 0xC2B2AE3D27D4EB4Full + (h << 6) + (h >> 2);
+        h ^= static_cast<uint64_t>(k.normal) * 0x165667B19E3779F9ull + (h << 6) + (h >> 2);
+        return static_cast<size_t>(h);
+    }
+};
+
+struct mtl_entry {
+    colour diffuse = colour(0.73, 0.73, 0.73);
+    colour emission = colour(0, 0, 0);
+    double shininess = 0;
+    double ior = 1.5;
+    double dissolve = 1;
+    int illum = 2;
+    std::string diffuse_map;
+};
+
+// Fills `entries` from an MTL file. Returns false if it could not be opened.
+inline bool read_mtl(const std::string& filename, std::unordered_map<std::string, mtl_entry>& entries) {
+    std::ifstream in(filename);
+    if (!in)
+        return false;
+
+    mtl_entry* current = nullptr;
+    std::string line;
+    while (std::getline(in, line)) {
+        auto s = skip_space(line.c_str());
+        const char* rest;
+        float values[3];
+
+        if (keyword(s, "newmtl", rest)) {
+            current = &entries[trimmed(rest)];
+        } else if (!current) {
+            continue;
+        } else if (keyword(s, "Kd", rest) && parse_floats(rest, values, 3) == 3) {
+            current->diffuse = colour(values[0], values[1], values[2]);
+        } else if (keyword(s, "Ke", rest) && parse_floats(rest, values, 3) == 3) {
+            current->emission = colour(values[0], values[1], values[2]);
+        } else if (keyword(s, "Ns", rest) && parse_floats(rest, values, 1) == 1) {
+            current->shininess = values[0];
+        } else if (keyword(s, "Ni", rest) && parse_floats(rest, values, 1) == 1) {
+            current->ior = values[0];
+        } else if (keyword(s, "d", rest) && parse_floats(rest, values, 1) == 1) {
+            current->dissolve = values[0];
+        } else if (keyword(s, "illum", rest)) {
+            current->illum = atoi(rest);
+        } else if (keyword(s, "map_Kd", rest)) {
+            current->diffuse_map = trimmed(rest);
+        }
+    }
+    return true;
+}
+
+// Maps an MTL entry onto the closest of our materials: emitters become diffuse lights,
+// transparent entries glass, illum 3 (reflective) metal and everything else lambertian.
+inline const material* make_mtl_material(
+    const mtl_entry& entry, const std::string& directory, material_table& materials
+) {
+    if (entry.emission.length_squared() > 0)
+        return materials.make<diffuse_light>(make_shared<solid_colour>(entry.emission));
+
+    if (entry.dissolve < 1)
+        return materials.make<dielectric>(entry.ior);
+
+    if (entry.illum == 3) {
+        // Phong exponents of around 1000 and up read as a mirror.
+        auto fuzz = entry.shininess > 0 ? clamp(1 - sqrt(entry.shininess / 1000), 0.0, 1.0) : 1.0;
+        return materials.make<metal>(entry.diffuse, fuzz);
+    }
+
+    if (!entry.diffuse_map.empty()) {
+        auto map = make_shared<image_texture>((directory + entry.diffuse_map).c_str());
+        if (map->loaded())
+            return materials.make<lambertian>(map);
+    }
+
+    return materials.make<lambertian>(make_shared<solid_colour>(entry.diffuse));
+}
+
+} // namespace obj_detail
+
+
+// What load_obj made its materials from: the MTL entry behind each slot after the default
+// one, and the MTL files it read, as named in the OBJ. Enough to make them again without
+// reading the OBJ.
+struct obj_material_info {
+    std::vector<obj_detail::mtl_entry> slots;
+    std::vector<std::string> libraries;
+};
+
+
+// Reads an OBJ file and the MTL libraries it names, creating its materials in `materials`.
+// Faces without a material use `default_material`, or a light grey lambertian if that is
+// null. Returns false, with the reason on std::cerr, if the file cannot be read.
+bool load_obj(
+    const std::string& filename, material_table& materials, mesh_data& mesh,
+    const material* default_material = nullptr, obj_material_info* info = nullptr
+) {
+    using namespace obj_detail;
+
+    std::ifstream in(filename);
+    if (!in) {
+        std::cerr << "ERROR: Could not open OBJ file '" << filename << "'.\n";
+        return false;
+    }
+
+    auto directory = directory_of(filename);
+    std::vector<float> positions, normals, uvs;
+    std::unordered_map<corner_key, uint32_t, corner_hash> corner_vertices;
+    std::unordered_map<std::string, mtl_entry> library;
+    std::unordered_map<std::string, uint32_t> material_slots;
+
+    mesh = mesh_data();
+    if (info)
+        *info = obj_material_info();
+    uint32_t current_material = 0;
+    mesh.materials.push_back(default_material
+        ? default_material
+        : materials.make<lambertian>(make_shared<solid_colour>(0.73, 0.73, 0.73)));
+
+    std::vector<uint32_t> face;
+    std::string line;
+    size_t line_number = 0;
+    size_t skipped_faces = 0;
+
+    while (std::getline(in, line)) {
+        line_number++;
+        auto s = skip_space(line.c_str());
+        const char* rest;
+        float values[3] = {0, 0, 0};
+
+        if (keyword(s, "v", rest)) {
+            parse_floats(rest, values, 3);
+            positions.insert(positions.end(), values, values + 3);
+        } else if (keyword(s, "vn", rest)) {
+            parse_floats(rest, values, 3);
+            normals.insert(normals.end(), values, values + 3);
+        } else if (keyword(s, "vt", rest)) {
+            parse_floats(rest, values, 2);
+            uvs.insert(uvs.end(), values, values + 2);
+        } else if (keyword(s, "f", rest)) {
+            face.clear();
+            bool valid = true;
+
+            while (*rest && *rest != '\r' && *rest != '\n' && valid) {
+                char* end;
+                corner_key key{ -1, -1, -1 };
+                key.position = resolve_index(strtol(rest, &end, 10), positions.size() / 3);
+                if (end == rest) break;
+                rest = end;
+                if (*rest == '/') {
+                    rest++;
+                    if (*rest != '/') {
+                        key.uv = resolve_index(strtol(rest, &end, 10), uvs.size() / 2);
+                        rest = end;
+                    }
+                    if (*rest == '/') {
+                        rest++;
+                        key.normal = resolve_index(strtol(rest, &end, 10), normals.size() / 3);
+                        rest = end;
+                    }
+                }
+                rest = skip_space(rest);
+
+                valid = key.position >= 0 && key.position < static_cast<long>(positions.size() / 3)
+                     && key.uv < static_cast<long>(uvs.size() / 2)
+                     && key.normal < static_cast<long>(normals.size() / 3);
+                if (!valid)
+                    break;
+
+                auto found = corner_vertices.find(key);
+                if (found == corner_vertices.end()) {
+                    mesh_vertex vertex = {};
+                    for (int a = 0; a < 3; a++)
+                        vertex.position[a] = positions[3 * key.position + a];
+                    if (key.normal >= 0)
+                        for (int a = 0; a < 3; a++)
+                            vertex.normal[a] = normals[3 * key.normal + a];
+                    if (key.uv >= 0)
+                        for (int a = 0; a < 2; a++)
+                            vertex.uv[a] = uvs[2 * key.uv + a];
+
+                    auto index = static_cast<uint32_t>(mesh.vertices.size());
+                    mesh.vertices.push_back(vertex);
+                    found = corner_vertices.emplace(key, index).first;
+                }
+                face.push_back(found->second);
+            }
+
+            if (!valid || face.size() < 3) {
+                skipped_faces++;
+                continue;
+            }
+            for (size_t i = 1; i + 1 < face.size(); i++)
+                mesh.triangles.push_back(mesh_triangle{ { face[0], face[i], face[i+1] }, current_material });
+        } else if (keyword(s, "usemtl", rest)) {
+            auto name = trimmed(rest);
+            auto slot = material_slots.find(name);
+            if (slot == material_slots.end()) {
+                auto entry = library.find(name);
+                if (entry == library.end()) {
+                    std::cerr << filename << ":" << line_number << ": unknown material '" << name << "'.\n";
+                    slot = material_slots.emplace(name, 0).first;
+                } else {
+                    auto index = static_cast<uint32_t>(mesh.materials.size());
+                    mesh.materials.push_back(make_mtl_material(entry->second, directory, materials));
+                    if (info)
+                        info->slots.push_back(entry->second);
+                    slot = material_slots.emplace(name, index).first;
+                }
+            }
+            current_material = slot->second;
+        } else if (keyword(s, "mtllib", rest)) {
+            auto library_file = directory + trimmed(rest);
+            if (!read_mtl(library_file, library))
+                std::cerr << "ERROR: Could not open MTL file '" << library_file << "'.\n";
+            if (info)
+                info->libraries.push_back(trimmed(rest));
+        }
+    }
+
+    if (skipped_faces > 0)
+        std::cerr << filename << ": skipped " << skipped_faces << " malformed faces.\n";
+
+    return true;
+}
+
+
+#endif
@@ -2,70 +2,122 @@
 #define PDF_H
 
 #include "constants.h"
+#include "hittable.h"
 #include "orthonormalbasis.h"
 
-class pdf {
+// Sampling distributions over directions. These are small value types with a common
+// value()/generate() shape rather than a class hierarchy, so the path loop can build
+// them on the stack without touching the heap.
+
+class cosine_pdf {
 public:
-	virtual ~pdf() {}
+	cosine_pdf() {}
+	cosine_pdf(const vector3& w) { uvw.build_from_w(w); }
 
-	virtual double value(const vector3& direction) const = 0;
-	virtual vector3 generate() const = 0;
-};
+	double value(const vector3& direction) const {
+		auto cosine = dot(unit_vector(direction), uvw.w());
+		return (cosine <= 0) ? 0 : cosine / pi;
+	}
+
+	vector3 generate() const {
+		return uvw.local(random_cosine_direction());
+	}
 
-class hittable_pdf : public pdf {
 public:
-	hittable_pdf(shared_ptr<hittable> p, const point& origin) : ptr(p), o(origin) {}
+	onb uvw;
+};
 
-	virtual double value(const vector3& direction) const {
-		return ptr->pdf_value(o, direction);
+// Directions of a mirror reflection pushed off by a random point in a ball of radius
+// `fuzz`, as fuzzy metal scatters. A direction's density is the part of the ball along it,
+// weighted by squared distance: (s2^3 - s1^3) / (4 pi fuzz^3) for the chord from s1 to s2.
+class fuzz_pdf {
+public:
+	fuzz_pdf() {}
+	fuzz_pdf(const vector3& reflected, double fuzz) : reflected(unit_vector(reflected)), fuzz(fuzz) {}
+
+	double value(const vector3& direction) const {
+		auto b = dot(unit_vector(direction), reflected);
+		auto discriminant = b * b - 1 + fuzz * fuzz;
+		if (discriminant <= 0)
+			return 0;
+		auto root = sqrt(discriminant);
+		auto s2 = b + root;
+		auto s1 = fmax(b - root, 0.0);
+		if (s2 <= 0)
+			return 0;
+		return (s2 * s2 * s2 - s1 * s1 * s1) / (4 * pi * fuzz * fuzz * fuzz);
 	}
 
-	virtual vector3 generate() const {
-		return ptr->random(o);
+	vector3 generate() const {
+		return reflected + fuzz * random_in_unit_sphere();
 	}
 
 public:
-	point o;
-	shared_ptr<hittable> ptr;
+	vector3 reflected;
+	double fuzz;
 };
 
-class cosine_pdf : public pdf {
+class hittable_pdf {
 public:
-	cosine_pdf(const vector3& w) { uvw.build_from_w(w); }
+	hittable_pdf(const hittable& p, const point& origin) : ptr(&p), o(origin) {}
 
-	virtual double value(const vector3& direction) const {
-		auto cosine = dot(unit_vector(direction), uvw.w());
-		return (cosine <= 0) ? 0 : cosine / pi;
+	double value(const vector3& direction) const {
+		return ptr->pdf_value(o, direction);
 	}
 
-	virtual vector3 generate() const {
-		return uvw.local(random_cosine_direction());
+	vector3 generate() const {
+		return ptr->random(o);
 	}
 
 public:
-	onb uvw;
+	const hittable* ptr;
+	point o;
 };
 
-class mixture_pdf : public pdf {
+// The distribution a material hands back from scatter(), stored inline as a tagged union
+// of the shapes materials use. A specular material leaves it as none.
+class scatter_pdf {
 public:
-	mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1) {
-		p[0] = p0;
-		p[1] = p1;
+	enum class kind { none, cosine, fuzz };
+
+	scatter_pdf() : type(kind::none) {}
+
+	static scatter_pdf cosine(const vector3& w) {
+		scatter_pdf p;
+		p.type = kind::cosine;
+		p.cosine_lobe = cosine_pdf(w);
+		return p;
 	}
 
-	virtual double value(const vector3& direction) const {
-		return 0.5 * p[0]->value(direction) + 0.5 * p[1]->value(direction);
+	static scatter_pdf fuzz(const vector3& reflected, double fuzz) {
+		scatter_pdf p;
+		p.type = kind::fuzz;
+		p.fuzz_lobe = fuzz_pdf(reflected, fuzz);
+		return p;
 	}
 
-	virtual vector3 generate() const {
-		if (random_double() < 0.5)
-			return p[0]->generate();
-		else
-			return p[1]->generate();
+	kind type_of() const { return type; }
+
+	double value(const vector3& direction) const {
+		switch (type) {
+		case kind::cosine: return cosine_lobe.value(direction);
+		case kind::fuzz:   return fuzz_lobe.value(direction);
+		default:           return 0;
+		}
 	}
 
-public:
-	shared_ptr<pdf> p[2];
+	vector3 generate() const {
+		switch (type) {
+		case kind::cosine: return cosine_lobe.generate();
+		case kind::fuzz:   return fuzz_lobe.generate();
+		default:           return vector3(0, 0, 1);
+		}
+	}
+
+private:
+	kind type;
+	cosine_pdf cosine_lobe;
+	fuzz_pdf fuzz_lobe;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -20,24 +20,45 @@ class ray
         ray() {}
         ray(const point& origin, const vector3& direction)
             : orig(origin), dir(direction), tm(0)
-        {}
+        {
+            set_reciprocal();
+        }
 
         ray(const point& origin, const vector3& direction, double time)
             : orig(origin), dir(direction), tm(time)
-        {}
+        {
+            set_reciprocal();
+        }
 
-        point origin() const  { return orig; }
-        vector3 direction() const { return dir; }
+        const point& origin() const  { return orig; }
+        const vector3& direction() const { return dir; }
         double time() const    { return tm; }
 
+        // 1/direction per axis, and whether that component is negative, for slab tests. A
+        // zero component gives an infinite reciprocal with the sign of the zero.
+        const vector3& inverse_direction() const { return inv_dir; }
+        int sign(int axis) const { return dir_is_neg[axis]; }
+
         point at(double t) const {
             return orig + t*dir;
         }
 
+    private:
+        void set_reciprocal() {
+            inv_dir = vector3(1/dir.x(), 1/dir.y(), 1/dir.z());
+            dir_is_neg[0] = inv_dir.x() < 0;
+            dir_is_neg[1] = inv_dir.y() < 0;
+            dir_is_neg[2] = inv_dir.z() < 0;
+        }
+
     public:
         point orig;
         vector3 dir;
         double tm;
+
+    private:
+        vector3 inv_dir;
+        int dir_is_neg[3];
 };
 
 #endif
@@ -0,0 +1,364 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// The two values of a 2D draw: a point on the pixel, the lens, a light or a scattering lobe.
+struct sample_2d {
+    double u, v;
+};
+
+
+// How the values of a pixel's samples are chosen:
+//   independent  a hash of pixel, sample and dimension; plain Monte Carlo
+//   stratified   jittered strata per dimension, correlated multi-jittered in 2D
+//   halton       Halton with a per-pixel Owen-style scramble of the digits
+//   sobol        Sobol (0,2) pairs, Owen scrambled and shuffled per pixel and dimension
+//   blue_noise   one scrambled Sobol sequence for every pixel, offset per pixel by a
+//                blue-noise mask so the error left over is spread as blue noise
+enum class sampler_type {
+    independent,
+    stratified,
+    halton,
+    sobol,
+    blue_noise
+};
+
+
+inline bool sampler_type_from_name(const std::string& name, sampler_type& type) {
+    if (name == "independent") type = sampler_type::independent;
+    else if (name == "stratified") type = sampler_type::stratified;
+    else if (name == "halton") type = sampler_type::halton;
+    else if (name == "sobol") type = sampler_type::sobol;
+    else if (name == "bluenoise" || name == "blue-noise") type = sampler_type::blue_noise;
+    else return false;
+    return true;
+}
+
+
+namespace sampler_detail {
+
+// SplitMix64 finaliser.
+inline uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+inline uint32_t hash(uint64_t a, uint64_t b) {
+    return static_cast<uint32_t>(mix(a ^ mix(b + 0x9E3779B97F4A7C15ull)) >> 32);
+}
+
+inline double to_unit(uint32_t bits) {
+    return bits * (1.0 / 4294967296.0);
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00FF00FFu) << 8) | ((x >> 8) & 0x00FF00FFu);
+    x = ((x & 0x0F0F0F0Fu) << 4) | ((x >> 4) & 0x0F0F0F0Fu);
+    x = ((x & 0x33333333u) << 2) | ((x >> 2) & 0x33333333u);
+    x = ((x & 0x55555555u) << 1) | ((x >> 1) & 0x55555555u);
+    return x;
+}
+
+// Element i of a random permutation of [0,l) picked by `p`, without building it (Kensler,
+// "Correlated Multi-Jittered Sampling").
+inline uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;             i *= 0xe170893du;
+        i ^= p >> 16;       i ^= (i & w) >> 4;
+        i ^= p >> 8;        i *= 0x0929eb3fu;
+        i ^= p >> 23;       i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;   i *= 0x6935fa69u;
+        i ^= (i & w) >> 11; i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;  i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;  i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+// Owen scrambling of the bits of a [0,1) fixed-point value by hashing (Burley, "Practical
+// Hash-based Owen Scrambling"). The hash only lets a bit change those above it, so it is run
+// on the bits reversed.
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// The first two Sobol dimensions as fixed-point fractions: van der Corput, and the (0,2)
+// partner whose direction numbers follow from v ^= v >> 1.
+inline uint32_t sobol_0(uint32_t index) {
+    return reverse_bits(index);
+}
+
+inline uint32_t sobol_1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+// The radical inverse of `index` in `base` with each digit put through an affine
+// permutation hashed from the digits above it: Owen scrambling, restricted to affine maps so
+// that a permutation costs one hash. In base 2 it is exactly Owen scrambling. Every index
+// below `count` gets the same number of digits, so they share the permutations.
+inline double scrambled_radical_inverse(uint32_t base, uint64_t index, uint64_t count, uint64_t seed) {
+    const double inv_base = 1.0 / base;
+    const double one_minus_epsilon = 0.99999999999999989;
+
+    uint64_t reversed = 0;
+    double inv_base_m = 1;
+    uint64_t cells = 1;
+    for (uint64_t digit = 0; index != 0 || cells < count; digit++, cells *= base) {
+        auto next = index / base;
+        auto value = static_cast<uint32_t>(index - next * base);
+        auto h = mix(seed + reversed * 0x9E3779B97F4A7C15ull + (digit << 56));
+        auto scale = 1 + static_cast<uint32_t>(h % (base - 1 > 0 ? base - 1 : 1));
+        auto offset = static_cast<uint32_t>((h >> 32) % base);
+        value = (value * scale + offset) % base;
+
+        reversed = reversed * base + value;
+        inv_base_m *= inv_base;
+        index = next;
+    }
+    // The digits left are all zero, and scrambling them scatters the point uniformly over
+    // the cell the digits so far pick out: one hash rather than one per digit.
+    auto tail = to_unit(static_cast<uint32_t>(mix(seed + reversed * 0x9E3779B97F4A7C15ull + ~0ull) >> 32));
+    auto result = (reversed + tail) * inv_base_m;
+    return result < one_minus_epsilon ? result : one_minus_epsilon;
+}
+
+// Bases for the Halton dimensions. Past the last one, dimensions are independent.
+inline const std::vector<uint32_t>& halton_bases() {
+    static const auto bases = [] {
+        std::vector<uint32_t> primes;
+        for (uint32_t n = 2; primes.size() < 256; n++) {
+            bool prime = true;
+            for (auto p : primes) {
+                if (p * p > n)
+                    break;
+                if (n % p == 0) {
+                    prime = false;
+                    break;
+                }
+            }
+            if (prime)
+                primes.push_back(n);
+        }
+        return primes;
+    }();
+    return bases;
+}
+
+const int blue_noise_size = 64;
+
+// A blue-noise threshold mask, each value (rank + 1/2) / count, built the first time it is
+// asked for by the insertion half of void-and-cluster (Ulichney): each pixel in turn goes
+// into the largest void, the one with the least Gaussian-weighted energy from the pixels
+// already in, wrapping around the edges so the mask tiles.
+inline const std::vector<float>& blue_noise_mask() {
+    static const auto mask = [] {
+        const int size = blue_noise_size, count = size * size;
+        const double sigma = 1.5;
+
+        std::vector<float> kernel(count);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                auto dx = x < size / 2 ? x : size - x;
+                auto dy = y < size / 2 ? y : size - y;
+                kernel[y * size + x] = static_cast<float>(exp(-(dx * dx + dy * dy) / (2 * sigma * sigma)));
+            }
+        }
+
+        std::vector<float> energy(count, 0.0f), result(count);
+        std::vector<char> placed(count, 0);
+        for (int rank = 0; rank < count; rank++) {
+            int best = -1;
+            for (int p = 0; p < count; p++)
+                if (!placed[p] && (best < 0 || energy[p] < energy[best]))
+                    best = p;
+
+            placed[best] = 1;
+            result[best] = (rank + 0.5f) / count;
+
+            auto bx = best % size, by = best / size;
+            for (int y = 0; y < size; y++) {
+                auto row = kernel.data() + ((y - by) & (size - 1)) * size;
+                auto out = energy.data() + y * size;
+                for (int x = 0; x < size; x++)
+                    out[x] += row[(x - bx) & (size - 1)];
+            }
+        }
+        return result;
+    }();
+    return mask;
+}
+
+} // namespace sampler_detail
+
+
+// Values for the samples of a render, addressed by pixel, sample number and dimension, the
+// index of the draw within the sample. Any address can be asked for in any order, so the
+// result doesn't depend on which thread renders which pixel. A 2D draw takes two dimensions.
+class sampler {
+    public:
+        sampler() : sampler(sampler_type::independent, 1, 1) {}
+
+        sampler(sampler_type type, int samples_per_pixel, int image_width)
+            : type(type),
+              samples_per_pixel(static_cast<uint32_t>(samples_per_pixel > 0 ? samples_per_pixel : 1)),
+              image_width(static_cast<uint64_t>(image_width > 0 ? image_width : 1)),
+              bases(type == sampler_type::halton ? &sampler_detail::halton_bases() : nullptr),
+              mask(type == sampler_type::blue_noise ? sampler_detail::blue_noise_mask().data() : nullptr) {}
+
+        sampler_type type_of() const { return type; }
+
+        double get_1d(uint64_t pixel, uint64_t sample, uint32_t dimension) const;
+        sample_2d get_2d(uint64_t pixel, uint64_t sample, uint32_t dimension) const;
+
+        // The independent sampler, split so a caller drawing many dimensions of one sample
+        // can hash pixel and sample once.
+        static uint64_t independent_key(uint64_t pixel, uint64_t sample) {
+            return sampler_detail::mix(pixel ^ sampler_detail::mix(sample + 0x9E3779B97F4A7C15ull));
+        }
+
+        static double independent_value(uint64_t key, uint64_t dimension) {
+            // Top 53 bits, scaled into [0,1).
+            return (sampler_detail::mix(key + (dimension + 1) * 0x9E3779B97F4A7C15ull) >> 11)
+                * (1.0 / 9007199254740992.0);
+        }
+
+    private:
+        // Samples past the first samples_per_pixel (adaptive top-ups) start another round
+        // with fresh strata.
+        uint32_t stratum_seed(uint64_t pixel, uint64_t sample, uint32_t dimension) const {
+            return sampler_detail::hash(pixel ^ ((sample / samples_per_pixel) << 40), dimension);
+        }
+
+        // Owen-scrambled Sobol, the sample order shuffled by a scramble of its own.
+        static sample_2d sobol_2d(uint64_t sample, uint32_t seed) {
+            using namespace sampler_detail;
+            auto index = nested_uniform_scramble(static_cast<uint32_t>(sample), seed);
+            return { to_unit(nested_uniform_scramble(sobol_0(index), hash(seed, 1))),
+                     to_unit(nested_uniform_scramble(sobol_1(index), hash(seed, 2))) };
+        }
+
+        // The blue-noise sampler shares scrambles across each mask-sized tile of pixels and
+        // offsets them per pixel and dimension by the mask, read at a shift per dimension.
+        uint32_t tile_seed(uint64_t pixel, uint32_t dimension) const {
+            auto x = pixel % image_width, y = pixel / image_width;
+            auto tile = (y / sampler_detail::blue_noise_size) << 32 | (x / sampler_detail::blue_noise_size);
+            return sampler_detail::hash(tile, dimension);
+        }
+
+        double mask_offset(uint64_t pixel, uint32_t dimension) const {
+            const uint64_t wrap = sampler_detail::blue_noise_size - 1;
+            auto shift = sampler_detail::hash(0x51633e2d, dimension);
+            auto x = (pixel % image_width + shift) & wrap;
+            auto y = (pixel / image_width + (shift >> 16)) & wrap;
+            return mask[y * sampler_detail::blue_noise_size + x];
+        }
+
+        static double wrap(double x) {
+            return x < 1 ? x : x - 1;
+        }
+
+    private:
+        sampler_type type;
+        uint32_t samples_per_pixel;
+        uint64_t image_width;
+        const std::vector<uint32_t>* bases;
+        const float* mask;
+};
+
+
+inline double sampler::get_1d(uint64_t pixel, uint64_t sample, uint32_t dimension) const {
+    using namespace sampler_detail;
+
+    switch (type) {
+        case sampler_type::stratified: {
+            auto seed = stratum_seed(pixel, sample, dimension);
+            auto s = static_cast<uint32_t>(sample % samples_per_pixel);
+            auto stratum = permute(s, samples_per_pixel, seed);
+            return (stratum + to_unit(hash(seed, s))) / samples_per_pixel;
+        }
+        case sampler_type::halton:
+            if (dimension < bases->size())
+                return scrambled_radical_inverse((*bases)[dimension], sample, samples_per_pixel, mix(pixel) ^ dimension);
+            break;
+        case sampler_type::sobol: {
+            auto seed = hash(pixel, dimension);
+            auto index = nested_uniform_scramble(static_cast<uint32_t>(sample), seed);
+            return to_unit(nested_uniform_scramble(sobol_0(index), hash(seed, 1)));
+        }
+        case sampler_type::blue_noise: {
+            auto seed = tile_seed(pixel, dimension);
+            auto index = nested_uniform_scramble(static_cast<uint32_t>(sample), seed);
+            return wrap(to_unit(nested_uniform_scramble(sobol_0(index), hash(seed, 1))) + mask_offset(pixel, dimension));
+        }
+        default:
+            break;
+    }
+    return independent_value(independent_key(pixel, sample), dimension);
+}
+
+
+inline sample_2d sampler::get_2d(uint64_t pixel, uint64_t sample, uint32_t dimension) const {
+    using namespace sampler_detail;
+
+    switch (type) {
+        case sampler_type::stratified: {
+            // Correlated multi-jittered (Kensler): an m x n grid of cells whose x and y
+            // coordinates are each stratified over all m * n samples too. When the count is
+            // short of m * n, each pixel and dimension fills its own random choice of cells,
+            // so every cell is as likely to be used as any other.
+            auto seed = stratum_seed(pixel, sample, dimension);
+            auto count = samples_per_pixel;
+            auto m = static_cast<uint32_t>(sqrt(static_cast<double>(count)));
+            auto n = (count + m - 1) / m;
+            auto s = permute(static_cast<uint32_t>(sample % count), m * n, seed * 0x51633e2du);
+            auto sx = permute(s % m, m, seed * 0x68bc21ebu);
+            auto sy = permute(s / m, n, seed * 0x02e5be93u);
+            auto jx = to_unit(hash(seed * 0x967a889bu, s));
+            auto jy = to_unit(hash(seed * 0x368cc8b7u, s));
+            return { (s % m + (sy + jx) / n) / m, (s / m + (sx + jy) / m) / n };
+        }
+        case sampler_type::sobol:
+            return sobol_2d(sample, hash(pixel, dimension));
+        case sampler_type::blue_noise: {
+            auto p = sobol_2d(sample, tile_seed(pixel, dimension));
+            return { wrap(p.u + mask_offset(pixel, dimension)), wrap(p.v + mask_offset(pixel, dimension + 1)) };
+        }
+        default:
+            return { get_1d(pixel, sample, dimension), get_1d(pixel, sample, dimension + 1) };
+    }
+}
+
+
+// The sampler pixel samples draw from, set up once before rendering starts.
+inline sampler& active_sampler() {
+    static sampler chosen;
+    return chosen;
+}
+
+
+#endif
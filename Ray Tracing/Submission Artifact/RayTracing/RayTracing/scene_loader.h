@@ -0,0 +1,582 @@
+#ifndef SCENE_LOADER_H
+#define SCENE_LOADER_H
+
+#include "constants.h"
+
+#include "aarect.h"
+#include "affine_transform.h"
+#include "box.h"
+#include "camera.h"
+#include "constant_medium.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "integrator.h"
+#include "linear_bvh.h"
+#include "material.h"
+#include "mesh_cache.h"
+#include "moving_sphere.h"
+#include "sphere.h"
+#include "texture.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Text scene files. One statement per line, '#' starts a comment:
+//
+//   camera [lookfrom X Y Z] [lookat X Y Z] [up X Y Z] [vfov DEG] [aperture A] [focus D]
+//          [shutter T0 T1]
+//   image [width N] [aspect A] [spp N] [max_depth N] [roulette_depth N] [background R G B]
+//   texture NAME solid R G B | checker TEX TEX | noise SCALE | image FILE
+//   material NAME lambertian TEX | metal R G B FUZZ | dielectric IOR | light TEX | isotropic TEX
+//   object NAME SHAPE [TRANSFORM...]     define a shape without adding it
+//   add SHAPE [TRANSFORM...]             add a shape to the scene, or to the open group
+//   group NAME ... end                   the adds in between form one object with its own BVH
+//
+// SHAPE is one of
+//   sphere X Y Z R MAT                   moving_sphere X0 Y0 Z0 X1 Y1 Z1 T0 T1 R MAT
+//   xy_rect X0 X1 Y0 Y1 K MAT            (likewise xz_rect and yz_rect)
+//   box X0 Y0 Z0 X1 Y1 Z1 MAT            mesh FILE [MAT]
+//   medium DENSITY TEX SHAPE             flip SHAPE                  NAME
+// TEX is a texture name or an R G B triple and MAT a material name, or "none". Shapes made
+// of a light material are sampled as lights, unless they sit inside a transform or a mesh.
+// A TRANSFORM is translate X Y Z, rotate_y DEG, rotate X Y Z DEG or scale S | X Y Z,
+// applied in the order given; a transformed shape becomes an instance of it.
+// File names are relative to the scene file and may be put in double quotes.
+
+
+// What a scene file sets up besides its objects. Values a file leaves out keep these defaults.
+struct scene_description {
+    hittable_list world;
+    camera cam;
+    int image_width = 500;
+    double aspect_ratio = 1.0;
+    int samples_per_pixel = 2000;
+    integrator_settings integrator;
+};
+
+
+class scene_loader {
+    public:
+        scene_loader(material_table& materials, thread_pool& pool, const bvh_options& options)
+            : materials(materials), pool(pool), options(options) {}
+
+        // Reads `filename` into `scene`. On an error prints "file:line: reason" to std::cerr
+        // and returns false. Progress and timings go to std::cerr as well.
+        bool load(const std::string& filename, scene_description& scene);
+
+    public:
+        // Whether meshes are read from and saved to their binary caches (see mesh_cache.h).
+        bool use_mesh_cache = true;
+
+    private:
+        struct statement {
+            int line;
+            std::vector<std::string> tokens;
+        };
+
+        // Walks the tokens of one statement. The first failure is kept in `error` and makes
+        // every later read fail too, so parse functions can carry on without checking.
+        struct cursor {
+            const statement& s;
+            size_t next;
+            std::string error;
+
+            bool done() const { return next >= s.tokens.size(); }
+            bool ok() const { return error.empty(); }
+            const std::string& peek() const { static const std::string none; return done() ? none : s.tokens[next]; }
+
+            void fail(const std::string& message) {
+                if (error.empty())
+                    error = message;
+            }
+
+            std::string word(const char* what) {
+                if (!ok()) return std::string();
+                if (done()) { fail(std::string("expected ") + what); return std::string(); }
+                return s.tokens[next++];
+            }
+
+            double number(const char* what = "a number") {
+                if (!ok()) return 0;
+                if (done()) { fail(std::string("expected ") + what); return 0; }
+                char* end;
+                auto value = strtod(s.tokens[next].c_str(), &end);
+                if (*end != '\0') { fail(std::string("expected ") + what + ", got '" + s.tokens[next] + "'"); return 0; }
+                next++;
+                return value;
+            }
+
+            vector3 triple() {
+                auto x = number();
+                auto y = number();
+                auto z = number();
+                return vector3(x, y, z);
+            }
+
+            bool next_is_number() const {
+                if (done()) return false;
+                char* end;
+                strtod(s.tokens[next].c_str(), &end);
+                return end != s.tokens[next].c_str() && *end == '\0';
+            }
+        };
+
+        bool read_statements(const std::string& filename);
+        void load_assets();
+        bool run(const statement& s, scene_description& scene);
+
+        void set_camera(cursor& c, scene_description& scene);
+        void set_image(cursor& c, scene_description& scene);
+        void define_texture(cursor& c);
+        void define_material(cursor& c);
+
+        shared_ptr<texture> parse_texture(cursor& c);
+        const material* parse_material(cursor& c);
+        shared_ptr<hittable> parse_shape(cursor& c);
+        shared_ptr<hittable> parse_transforms(cursor& c, shared_ptr<hittable> shape);
+
+        std::string resolve(const std::string& file) const { return directory + file; }
+
+    private:
+        material_table& materials;
+        thread_pool& pool;
+        bvh_options options;
+
+        std::string filename;
+        std::string directory;
+        std::vector<statement> statements;
+
+        std::unordered_map<std::string, shared_ptr<texture>> textures;
+        std::unordered_map<std::string, const material*> named_materials;
+        std::unordered_map<std::string, shared_ptr<hittable>> objects;
+
+        // Filled in parallel by load_assets() before the statements run.
+        std::unordered_map<std::string, shared_ptr<image_texture>> images;
+        std::unordered_map<std::string, shared_ptr<triangle_mesh>> meshes;
+
+        struct open_group {
+            std::string name;
+            hittable_list members;
+        };
+        std::vector<open_group> groups;
+};
+
+
+// Splits a line at whitespace. A word in double quotes may contain spaces, for file names.
+inline bool split_words(const std::string& line, std::vector<std::string>& words) {
+    size_t i = 0;
+    while (true) {
+        while (i < line.size() && isspace(static_cast<unsigned char>(line[i])))
+            i++;
+        if (i == line.size())
+            return true;
+
+        if (line[i] == '"') {
+            auto close = line.find('"', i + 1);
+            if (close == std::string::npos)
+                return false;
+            words.push_back(line.substr(i + 1, close - i - 1));
+            i = close + 1;
+        } else {
+            auto start = i;
+            while (i < line.size() && !isspace(static_cast<unsigned char>(line[i])))
+                i++;
+            words.push_back(line.substr(start, i - start));
+        }
+    }
+}
+
+
+bool scene_loader::read_statements(const std::string& file) {
+    std::ifstream in(file);
+    if (!in) {
+        std::cerr << "ERROR: Could not open scene file '" << file << "'.\n";
+        return false;
+    }
+
+    std::string line;
+    int line_number = 0;
+    while (std::getline(in, line)) {
+        line_number++;
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        statement s;
+        s.line = line_number;
+        if (!split_words(line, s.tokens)) {
+            std::cerr << file << ":" << line_number << ": unterminated quote\n";
+            return false;
+        }
+        if (!s.tokens.empty())
+            statements.push_back(std::move(s));
+    }
+    return true;
+}
+
+
+// Image files and meshes are the slow part of a scene, so they are found by a first pass over
+// the statements and loaded on the pool, each mesh building its own BVH, before anything
+// else runs. Each mesh job gets a private material table for its MTL materials.
+void scene_loader::load_assets() {
+    std::vector<std::string> image_files, mesh_files;
+    for (const auto& s : statements) {
+        const auto& t = s.tokens;
+        // Object and group names are skipped, so a shape may be called "mesh".
+        auto first = t[0] == "object" || t[0] == "group" ? 2 : 1;
+        for (size_t i = first; i + 1 < t.size(); i++) {
+            if (t[0] == "texture" && i == 2 && t[i] == "image" && !images.count(t[i+1])) {
+                images[t[i+1]] = nullptr;
+                image_files.push_back(t[i+1]);
+            } else if (t[0] != "texture" && t[0] != "material" && t[i] == "mesh" && !meshes.count(t[i+1])) {
+                meshes[t[i+1]] = nullptr;
+                mesh_files.push_back(t[i+1]);
+            }
+        }
+    }
+
+    std::mutex merge_lock;
+    for (const auto& file : image_files) {
+        pool.submit([this, file, &merge_lock] {
+            auto image = make_shared<image_texture>(resolve(file).c_str());
+            std::lock_guard<std::mutex> guard(merge_lock);
+            images[file] = image;
+        });
+    }
+    for (const auto& file : mesh_files) {
+        pool.submit([this, file, &merge_lock] {
+            material_table mesh_materials;
+            auto mesh = load_mesh(resolve(file), mesh_materials, options, use_mesh_cache);
+
+            std::lock_guard<std::mutex> guard(merge_lock);
+            meshes[file] = mesh;
+            materials.merge(std::move(mesh_materials));
+        });
+    }
+    pool.wait();
+}
+
+
+bool scene_loader::load(const std::string& file, scene_description& scene) {
+    auto start = std::chrono::steady_clock::now();
+    auto seconds_since = [](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+    };
+
+    filename = file;
+    auto slash = file.find_last_of("/\\");
+    directory = slash == std::string::npos ? std::string() : file.substr(0, slash + 1);
+
+    if (!read_statements(file))
+        return false;
+    auto parsed = seconds_since(start);
+
+    load_assets();
+    auto loaded = seconds_since(start);
+
+    // The camera is set up once the image statement has fixed the aspect ratio.
+    point lookfrom(278, 278, -800), lookat(278, 278, 0);
+    vector3 up(0, 1, 0);
+    double vfov = 40, aperture = 0, focus = 10, t0 = 0, t1 = 1;
+
+    for (const auto& s : statements) {
+        if (s.tokens[0] == "camera") {
+            cursor c{ s, 1 };
+            while (c.ok() && !c.done()) {
+                auto key = c.word("a camera setting");
+                if (key == "lookfrom") lookfrom = c.triple();
+                else if (key == "lookat") lookat = c.triple();
+                else if (key == "up") up = c.triple();
+                else if (key == "vfov") vfov = c.number();
+                else if (key == "aperture") aperture = c.number();
+                else if (key == "focus") focus = c.number();
+                else if (key == "shutter") { t0 = c.number(); t1 = c.number(); }
+                else c.fail("unknown camera setting '" + key + "'");
+            }
+            if (!c.ok()) {
+                std::cerr << filename << ":" << s.line << ": " << c.error << "\n";
+                return false;
+            }
+        } else if (!run(s, scene)) {
+            return false;
+        }
+    }
+
+    if (!groups.empty()) {
+        std::cerr << filename << ": group '" << groups.back().name << "' has no end.\n";
+        return false;
+    }
+
+    scene.cam = camera(lookfrom, lookat, up, vfov, scene.aspect_ratio, aperture, focus, t0, t1);
+
+    std::cerr << filename << ": " << statements.size() << " statements read in " << parsed
+              << "s, " << images.size() << " images and " << meshes.size() << " meshes loaded in "
+              << loaded - parsed << "s on " << pool.size() << " threads, scene assembled in "
+              << seconds_since(start) - loaded << "s.\n";
+    return true;
+}
+
+
+bool scene_loader::run(const statement& s, scene_description& scene) {
+    cursor c{ s, 1 };
+    const auto& keyword = s.tokens[0];
+
+    if (keyword == "image") {
+        set_image(c, scene);
+    } else if (keyword == "texture") {
+        define_texture(c);
+    } else if (keyword == "material") {
+        define_material(c);
+    } else if (keyword == "object") {
+        auto name = c.word("an object name");
+        auto shape = parse_transforms(c, parse_shape(c));
+        if (c.ok())
+            objects[name] = shape;
+    } else if (keyword == "add") {
+        auto shape = parse_transforms(c, parse_shape(c));
+        if (c.ok())
+            (groups.empty() ? scene.world : groups.back().members).add(shape);
+    } else if (keyword == "group") {
+        groups.push_back(open_group{ c.word("a group name"), hittable_list() });
+    } else if (keyword == "end") {
+        if (groups.empty()) {
+            c.fail("'end' without 'group'");
+        } else {
+            auto group = std::move(groups.back());
+            groups.pop_back();
+            objects[group.name] = make_shared<linear_bvh>(group.members, 0, 1, options);
+        }
+    } else {
+        c.fail("unknown statement '" + keyword + "'");
+    }
+
+    if (c.ok() && !c.done())
+        c.fail("unexpected '" + c.peek() + "'");
+
+    if (!c.ok()) {
+        std::cerr << filename << ":" << s.line << ": " << c.error << "\n";
+        return false;
+    }
+    return true;
+}
+
+
+void scene_loader::set_image(cursor& c, scene_description& scene) {
+    while (c.ok() && !c.done()) {
+        auto key = c.word("an image setting");
+        if (key == "width") scene.image_width = static_cast<int>(c.number());
+        else if (key == "aspect") scene.aspect_ratio = c.number();
+        else if (key == "spp") scene.samples_per_pixel = static_cast<int>(c.number());
+        else if (key == "max_depth") scene.integrator.max_depth = static_cast<int>(c.number());
+        else if (key == "roulette_depth") scene.integrator.roulette_depth = static_cast<int>(c.number());
+        else if (key == "background") scene.integrator.background = c.triple();
+        else c.fail("unknown image setting '" + key + "'");
+    }
+}
+
+
+void scene_loader::define_texture(cursor& c) {
+    auto name = c.word("a texture name");
+    auto kind = c.word("a texture type");
+    shared_ptr<texture> tex;
+
+    if (kind == "solid") {
+        tex = make_shared<solid_colour>(c.triple());
+    } else if (kind == "checker") {
+        auto even = parse_texture(c);
+        auto odd = parse_texture(c);
+        tex = make_shared<checker_texture>(even, odd);
+    } else if (kind == "noise") {
+        tex = make_shared<noise_texture>(c.number("a noise scale"));
+    } else if (kind == "image") {
+        tex = images[c.word("an image file")];
+    } else if (c.ok()) {
+        c.fail("unknown texture type '" + kind + "'");
+    }
+
+    if (c.ok())
+        textures[name] = tex;
+}
+
+
+void scene_loader::define_material(cursor& c) {
+    auto name = c.word("a material name");
+    auto kind = c.word("a material type");
+    const material* mat = nullptr;
+
+    if (kind == "lambertian") {
+        auto albedo = parse_texture(c);
+        if (c.ok()) mat = materials.make<lambertian>(albedo);
+    } else if (kind == "metal") {
+        auto albedo = c.triple();
+        auto fuzz = c.number("a fuzz amount");
+        if (c.ok()) mat = materials.make<metal>(albedo, fuzz);
+    } else if (kind == "dielectric") {
+        auto ior = c.number("an index of refraction");
+        if (c.ok()) mat = materials.make<dielectric>(ior);
+    } else if (kind == "light") {
+        auto emit = parse_texture(c);
+        if (c.ok()) mat = materials.make<diffuse_light>(emit);
+    } else if (kind == "isotropic") {
+        auto albedo = parse_texture(c);
+        if (c.ok()) mat = materials.make<isotropic>(albedo);
+    } else if (c.ok()) {
+        c.fail("unknown material type '" + kind + "'");
+    }
+
+    if (c.ok())
+        named_materials[name] = mat;
+}
+
+
+shared_ptr<texture> scene_loader::parse_texture(cursor& c) {
+    if (c.next_is_number())
+        return make_shared<solid_colour>(c.triple());
+
+    auto name = c.word("a texture");
+    auto found = textures.find(name);
+    if (found == textures.end()) {
+        c.fail("unknown texture '" + name + "'");
+        return nullptr;
+    }
+    return found->second;
+}
+
+
+const material* scene_loader::parse_material(cursor& c) {
+    auto name = c.word("a material");
+    if (name == "none")
+        return nullptr;
+
+    auto found = named_materials.find(name);
+    if (found == named_materials.end()) {
+        c.fail("unknown material '" + name + "'");
+        return nullptr;
+    }
+    return found->second;
+}
+
+
+shared_ptr<hittable> scene_loader::parse_shape(cursor& c) {
+    auto kind = c.word("a shape");
+    if (!c.ok())
+        return nullptr;
+
+    if (kind == "sphere") {
+        auto centre = c.triple();
+        auto radius = c.number("a radius");
+        auto mat = parse_material(c);
+        return make_shared<sphere>(centre, radius, mat);
+    }
+    if (kind == "moving_sphere") {
+        auto centre0 = c.triple();
+        auto centre1 = c.triple();
+        auto t0 = c.number();
+        auto t1 = c.number();
+        auto radius = c.number("a radius");
+        auto mat = parse_material(c);
+        return make_shared<moving_sphere>(centre0, centre1, t0, t1, radius, mat);
+    }
+    if (kind == "xy_rect" || kind == "xz_rect" || kind == "yz_rect") {
+        auto a0 = c.number(), a1 = c.number(), b0 = c.number(), b1 = c.number(), k = c.number();
+        auto mat = parse_material(c);
+        if (kind == "xy_rect") return make_shared<xy_rect>(a0, a1, b0, b1, k, mat);
+        if (kind == "xz_rect") return make_shared<xz_rect>(a0, a1, b0, b1, k, mat);
+        return make_shared<yz_rect>(a0, a1, b0, b1, k, mat);
+    }
+    if (kind == "box") {
+        auto p0 = c.triple();
+        auto p1 = c.triple();
+        auto mat = parse_material(c);
+        return make_shared<box>(p0, p1, mat);
+    }
+    if (kind == "mesh") {
+        auto file = c.word("a mesh file");
+        auto mesh = meshes[file];
+        if (!mesh) {
+            c.fail("could not load mesh '" + file + "'");
+            return nullptr;
+        }
+        if (!c.done() && named_materials.count(c.peek())) {
+            // Faces without a usemtl take this material. A mesh used with two different
+            // defaults needs its own copy.
+            auto mat = parse_material(c);
+            if (mesh->materials[0] != mat) {
+                mesh = make_shared<triangle_mesh>(*mesh);
+                mesh->materials[0] = mat;
+            }
+        }
+        return mesh;
+    }
+    if (kind == "medium") {
+        auto density = c.number("a density");
+        auto albedo = parse_texture(c);
+        auto boundary = parse_shape(c);
+        if (!c.ok())
+            return nullptr;
+        return make_shared<constant_medium>(boundary, density, albedo);
+    }
+    if (kind == "flip") {
+        auto shape = parse_shape(c);
+        if (!c.ok())
+            return nullptr;
+        return make_shared<flip_face>(shape);
+    }
+
+    auto found = objects.find(kind);
+    if (found == objects.end()) {
+        c.fail("unknown shape or object '" + kind + "'");
+        return nullptr;
+    }
+    return found->second;
+}
+
+
+shared_ptr<hittable> scene_loader::parse_transforms(cursor& c, shared_ptr<hittable> shape) {
+    affine_transform transform;
+    bool transformed = false;
+
+    while (c.ok() && !c.done()) {
+        auto op = c.peek();
+        if (op == "translate") {
+            c.next++;
+            transform = affine_transform::translation(c.triple()) * transform;
+        } else if (op == "rotate_y") {
+            c.next++;
+            transform = affine_transform::rotation(vector3(0, 1, 0), c.number("an angle")) * transform;
+        } else if (op == "rotate") {
+            c.next++;
+            auto axis = c.triple();
+            transform = affine_transform::rotation(axis, c.number("an angle")) * transform;
+        } else if (op == "scale") {
+            c.next++;
+            vector3 factors;
+            factors[0] = factors[1] = factors[2] = c.number("a scale");
+            if (c.next_is_number()) {
+                factors[1] = c.number();
+                factors[2] = c.number();
+            }
+            transform = affine_transform::scaling(factors) * transform;
+        } else {
+            break;
+        }
+        transformed = true;
+    }
+
+    if (!c.ok() || !transformed)
+        return shape;
+    return make_shared<instance>(shape, transform);
+}
+
+
+#endif
@@ -20,33 +20,55 @@
 class sphere : public hittable {
 public:
 	sphere() {}
-	sphere(point cen, double r, shared_ptr<material> m)
+	sphere(point cen, double r, const material* m)
 		: center(cen), radius(r), mat_ptr(m) {};
 	virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+	virtual void finalize_hit(const ray& r, hit_record& rec) const;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const;
+	virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const;
+	virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const;
 	virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 	virtual double pdf_value(const point& o, const vector3& v) const;
 	virtual vector3 random(const point& o) const;
+	virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {
+		shapes.push_back({ this, this, mat_ptr, center, 4 * pi * radius * radius, vector3(0, 0, 0) });
+	}
+
+private:
+	uint32_t packet_hits(const ray_packet& packet, double* t) const;
 
 public:
 	point center;
 	double radius;
-	shared_ptr<material> mat_ptr;
+	const material* mat_ptr;
 };
 
+// Seen from outside, directions are sampled evenly over the cone the sphere fills, so a
+// direction's pdf is one over the cone's solid angle if it passes within a radius of the
+// centre and zero if not. From inside, every direction meets the sphere once and they are
+// sampled evenly over all of them.
 double sphere::pdf_value(const point& o, const vector3& v) const {
-	hit_record rec;
-	if (!this->hit(ray(o, v), 0.001, infinity, rec))
-		return 0;
+	auto to_center = center - o;
+	auto distance_squared = to_center.length_squared();
+	auto radius_squared = radius * radius;
+	if (distance_squared <= radius_squared)
+		return 1 / (4 * pi);
 
-	auto cos_theta_max = sqrt(1 - radius * radius / (center - o).length_squared());
-	auto solid_angle = 2 * pi * (1 - cos_theta_max);
+	if (dot(v, to_center) <= 0 || cross(v, to_center).length_squared() > radius_squared * v.length_squared() * (1 + 1e-9))
+		return 0;
 
-	return  1 / solid_angle;
+	// 1 - cos(theta_max), worked out without cancelling for small cones.
+	auto sin2_theta_max = radius_squared / distance_squared;
+	auto one_minus_cos = sin2_theta_max / (1 + sqrt(1 - sin2_theta_max));
+	return 1 / (2 * pi * one_minus_cos);
 }
 
 vector3 sphere::random(const point& o) const {
 	vector3 direction = center - o;
 	auto distance_squared = direction.length_squared();
+	if (distance_squared <= radius * radius)
+		return random_unit_vector();
+
 	onb uvw;
 	uvw.build_from_w(direction);
 	return uvw.local(random_to_sphere(radius, distance_squared));
@@ -73,22 +95,14 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
         auto temp = (-half_b - root)/a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.at(rec.t);
-            vector3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            get_sphere_uv((rec.p-center)/radius, rec.u, rec.v);
-            rec.mat_ptr = mat_ptr;
+            rec.object = this;
             return true;
         }
 
         temp = (-half_b + root)/a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.at(rec.t);
-            vector3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            get_sphere_uv((rec.p-center)/radius, rec.u, rec.v);
-            rec.mat_ptr = mat_ptr;
+            rec.object = this;
             return true;
         }
     }
@@ -96,5 +110,77 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     return false;
 }
 
+bool sphere::occluded(const ray& r, double t_min, double t_max) const {
+    vector3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius*radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant <= 0)
+        return false;
+
+    auto root = sqrt(discriminant);
+    auto near_t = (-half_b - root)/a;
+    auto far_t = (-half_b + root)/a;
+    return (near_t < t_max && near_t > t_min) || (far_t < t_max && far_t > t_min);
+}
+
+
+// hit() across every lane of a packet: the same arithmetic, without branches so the loop
+// vectorizes. Returns the lanes that hit, with their distances in t.
+uint32_t sphere::packet_hits(const ray_packet& packet, double* t) const {
+    uint32_t hits = 0;
+    for (int i = 0; i < packet_size; i++) {
+        auto ox = packet.origin_x[i] - center.x();
+        auto oy = packet.origin_y[i] - center.y();
+        auto oz = packet.origin_z[i] - center.z();
+        auto dx = packet.direction_x[i], dy = packet.direction_y[i], dz = packet.direction_z[i];
+
+        auto a = dx*dx + dy*dy + dz*dz;
+        auto half_b = ox*dx + oy*dy + oz*dz;
+        auto c = (ox*ox + oy*oy + oz*oz) - radius*radius;
+        auto discriminant = half_b*half_b - a*c;
+
+        auto root = sqrt(discriminant > 0 ? discriminant : 0);
+        auto near_t = (-half_b - root)/a;
+        auto far_t = (-half_b + root)/a;
+        auto near_hit = discriminant > 0 && near_t < packet.t_max[i] && near_t > packet.t_min;
+        auto far_hit = discriminant > 0 && far_t < packet.t_max[i] && far_t > packet.t_min;
+
+        t[i] = near_hit ? near_t : far_t;
+        hits |= static_cast<uint32_t>(near_hit || far_hit) << i;
+    }
+    return hits;
+}
+
+
+uint32_t sphere::hit_packet(ray_packet& packet, uint32_t lanes) const {
+    double t[packet_size];
+    auto hits = packet_hits(packet, t) & lanes;
+    packet.record_hits(hits, t, this);
+    return hits;
+}
+
+
+uint32_t sphere::occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+    double t[packet_size];
+    return packet_hits(packet, t) & lanes;
+}
+
+void sphere::finalize_hit(const ray& r, hit_record& rec) const {
+    // Put the point back on the sphere, so its error is that of these few operations
+    // rather than growing with how far along the ray it lies.
+    auto to_p = r.at(rec.t) - center;
+    to_p *= radius / to_p.length();
+    rec.p = center + to_p;
+    rec.p_error = rounding_gamma<double>(5) * abs(to_p) + rounding_gamma<double>(1) * abs(rec.p);
+    vector3 outward_normal = to_p / radius;
+    rec.geometric_normal = outward_normal;
+    rec.set_face_normal(r, outward_normal);
+    get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.mat_ptr = mat_ptr;
+}
+
 
 #endif
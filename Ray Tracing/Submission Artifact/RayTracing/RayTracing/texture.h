@@ -103,6 +103,8 @@ class image_texture : public texture {
             delete data;
         }
 
+        bool loaded() const { return data != nullptr; }
+
         virtual colour value(double u, double v, const vector3& p) const {
             // If we have no texture data, then return solid cyan as a debugging aid.
             if (data == nullptr)
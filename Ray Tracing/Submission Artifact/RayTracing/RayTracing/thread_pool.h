@@ -0,0 +1,154 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// A fixed-size pool of worker threads. Every worker owns a task queue; a worker takes work
+// from the back of its own queue and, once that runs dry, steals from the front of the
+// other workers' queues, so uneven tiles (glass, smoke) don't leave cores idle.
+class thread_pool {
+    public:
+        explicit thread_pool(int thread_count);
+        ~thread_pool();
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        int size() const { return static_cast<int>(threads.size()); }
+
+        void submit(std::function<void()> task);
+
+        // Blocks until every submitted task has finished.
+        void wait();
+
+        static int default_thread_count() {
+            auto n = std::thread::hardware_concurrency();
+            return n == 0 ? 1 : static_cast<int>(n);
+        }
+
+    private:
+        struct worker_queue {
+            std::mutex lock;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        bool pop_task(size_t index, std::function<void()>& task);
+        void worker_loop(size_t index);
+
+    private:
+        std::vector<std::unique_ptr<worker_queue>> queues;
+        std::vector<std::thread> threads;
+
+        std::mutex state_lock;
+        std::condition_variable work_available;
+        std::condition_variable work_done;
+        std::atomic<size_t> queued;
+        size_t pending;
+        size_t next_queue;
+        bool stopping;
+};
+
+
+thread_pool::thread_pool(int thread_count) : queued(0), pending(0), next_queue(0), stopping(false) {
+    if (thread_count < 1)
+        thread_count = 1;
+
+    for (int i = 0; i < thread_count; i++)
+        queues.push_back(std::unique_ptr<worker_queue>(new worker_queue));
+
+    for (int i = 0; i < thread_count; i++)
+        threads.emplace_back(&thread_pool::worker_loop, this, static_cast<size_t>(i));
+}
+
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        stopping = true;
+    }
+    work_available.notify_all();
+
+    for (auto& t : threads)
+        t.join();
+}
+
+
+void thread_pool::submit(std::function<void()> task) {
+    std::unique_lock<std::mutex> state(state_lock);
+    auto index = next_queue++ % queues.size();
+    {
+        std::lock_guard<std::mutex> guard(queues[index]->lock);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    ++queued;
+    ++pending;
+    state.unlock();
+
+    work_available.notify_one();
+}
+
+
+void thread_pool::wait() {
+    std::unique_lock<std::mutex> state(state_lock);
+    work_done.wait(state, [this] { return pending == 0; });
+}
+
+
+bool thread_pool::pop_task(size_t index, std::function<void()>& task) {
+    {
+        auto& own = *queues[index];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --queued;
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < queues.size(); i++) {
+        auto& victim = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --queued;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void thread_pool::worker_loop(size_t index) {
+    std::function<void()> task;
+
+    while (true) {
+        if (pop_task(index, task)) {
+            task();
+            task = nullptr;
+
+            std::lock_guard<std::mutex> guard(state_lock);
+            if (--pending == 0)
+                work_done.notify_all();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> state(state_lock);
+        work_available.wait(state, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0)
+            return;
+    }
+}
+
+
+#endif
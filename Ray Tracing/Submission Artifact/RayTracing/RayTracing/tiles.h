@@ -0,0 +1,72 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+
+// A rectangle of pixels [x0,x1) x [y0,y1), rendered as one unit of work.
+struct tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+
+// Splits the image into tiles, top row of tiles first so the picture fills in the way the
+// old scanline loop did.
+std::vector<tile> make_tiles(int image_width, int image_height, int tile_size) {
+    std::vector<tile> tiles;
+
+    for (int y1 = image_height; y1 > 0; y1 -= tile_size) {
+        auto y0 = y1 - tile_size < 0 ? 0 : y1 - tile_size;
+        for (int x0 = 0; x0 < image_width; x0 += tile_size) {
+            auto x1 = x0 + tile_size > image_width ? image_width : x0 + tile_size;
+            tiles.push_back(tile{x0, y0, x1, y1});
+        }
+    }
+
+    return tiles;
+}
+
+
+// Thread-safe replacement for the "Scanlines remaining" counter. Workers call tile_done()
+// and the remaining count is redrawn on std::cerr.
+class progress_reporter {
+    public:
+        progress_reporter(size_t total_tiles)
+            : total(total_tiles), completed(0), start(std::chrono::steady_clock::now())
+        {
+            report(0);
+        }
+
+        void tile_done() {
+            std::lock_guard<std::mutex> guard(output_lock);
+            report(++completed);
+        }
+
+        double elapsed_seconds() const {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count();
+        }
+
+        void finish() {
+            std::lock_guard<std::mutex> guard(output_lock);
+            std::cerr << "\nDone in " << elapsed_seconds() << "s.\n";
+        }
+
+    private:
+        void report(size_t done) {
+            std::cerr << "\rTiles remaining: " << total - done << ' ' << std::flush;
+        }
+
+    private:
+        size_t total;
+        size_t completed;
+        std::chrono::steady_clock::time_point start;
+        std::mutex output_lock;
+};
+
+
+#endif
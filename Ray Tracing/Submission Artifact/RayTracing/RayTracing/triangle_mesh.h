@@ -0,0 +1,592 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "constants.h"
+
+#include "hittable.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+
+// A read-only run of elements owned elsewhere: by a triangle_mesh's own vectors or by a
+// mapped cache file.
+template <typename T>
+struct array_view {
+    const T* data = nullptr;
+    size_t count = 0;
+
+    array_view() {}
+    array_view(const T* data, size_t count) : data(data), count(count) {}
+    array_view(const std::vector<T>& v) : data(v.data()), count(v.size()) {}
+
+    const T& operator[](size_t i) const { return data[i]; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* begin() const { return data; }
+    const T* end() const { return data + count; }
+};
+
+
+// One shared mesh vertex, stored in single precision to keep large meshes small. A zero
+// normal means the file gave none and the face normal is used instead.
+struct mesh_vertex {
+    float position[3];
+    float normal[3];
+    float uv[2];
+};
+
+
+// Three indices into the vertex array and an index into the mesh's material list.
+struct mesh_triangle {
+    uint32_t v[3];
+    uint32_t material;
+};
+
+
+// Everything a triangle_mesh is built from. Loaders fill this in, and callers may move or
+// scale the vertices before the mesh and its BVH are built.
+struct mesh_data {
+    std::vector<mesh_vertex> vertices;
+    std::vector<mesh_triangle> triangles;
+    std::vector<const material*> materials;
+
+    aabb bounds() const {
+        point lo( infinity,  infinity,  infinity);
+        point hi(-infinity, -infinity, -infinity);
+        for (const auto& vertex : vertices) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = fmin(lo[a], vertex.position[a]);
+                hi[a] = fmax(hi[a], vertex.position[a]);
+            }
+        }
+        return aabb(lo, hi);
+    }
+};
+
+
+// Scales the mesh uniformly about its centre so it fits in `region`, then stands it on the
+// region's floor (its lowest y).
+void fit_mesh(mesh_data& mesh, const aabb& region) {
+    auto box = mesh.bounds();
+    auto size = box.max() - box.min();
+    auto room = region.max() - region.min();
+
+    auto scale = infinity;
+    for (int a = 0; a < 3; a++)
+        if (size[a] > 0)
+            scale = fmin(scale, room[a] / size[a]);
+    if (scale == infinity)
+        scale = 1;
+
+    auto centre = 0.5 * (box.min() + box.max());
+    auto target = 0.5 * (region.min() + region.max());
+    target[1] = region.min().y() + 0.5 * size.y() * scale;
+
+    for (auto& vertex : mesh.vertices)
+        for (int a = 0; a < 3; a++)
+            vertex.position[a] = static_cast<float>((vertex.position[a] - centre[a]) * scale + target[a]);
+}
+
+
+// Whether meshes test rays against their triangles in float, the precision the vertices are
+// stored in, rather than in double. Set once before rendering. It is only meshes: spheres,
+// rects and media are always tested in double, and BVH boxes in the precision each BVH
+// stores them in.
+inline bool& float_geometry() {
+    static bool enabled = true;
+    return enabled;
+}
+
+
+// Ray constants for the watertight triangle test of Woop, Benthin and Wald (2013), worked
+// out once per ray in `Scalar` precision. The ray is sheared so it runs down +z from the
+// origin, which reduces the test to signed 2D edge functions that agree exactly on the edge
+// two triangles share.
+template <typename Scalar>
+struct watertight_ray {
+    watertight_ray() {}
+    watertight_ray(const ray& r) : origin(r.origin()) {
+        basic_vector3<Scalar> d(r.direction());
+        kz = std::fabs(d.x()) > std::fabs(d.y()) ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                                                 : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+
+        shear_x = d[kx] / d[kz];
+        shear_y = d[ky] / d[kz];
+        shear_z = 1 / d[kz];
+    }
+
+    // On a hit inside (t_min, t_max) sets t and the barycentric weights of p1 and p2.
+    bool hit(const float* p0, const float* p1, const float* p2, double t_min, double t_max,
+             double& t, double& b1, double& b2) const {
+        Scalar a[3], b[3], c[3];
+        for (int i = 0; i < 3; i++) {
+            a[i] = p0[i] - origin[i];
+            b[i] = p1[i] - origin[i];
+            c[i] = p2[i] - origin[i];
+        }
+
+        auto ax = a[kx] - shear_x * a[kz], ay = a[ky] - shear_y * a[kz];
+        auto bx = b[kx] - shear_x * b[kz], by = b[ky] - shear_y * b[kz];
+        auto cx = c[kx] - shear_x * c[kz], cy = c[ky] - shear_y * c[kz];
+
+        auto u = cx * by - cy * bx;
+        auto v = ax * cy - ay * cx;
+        auto w = bx * ay - by * ax;
+
+        // An edge function of exactly zero in float may be rounding; work it out again in
+        // double, where the products are exact, so shared edges stay watertight.
+        if (sizeof(Scalar) < sizeof(double) && (u == 0 || v == 0 || w == 0)) {
+            u = static_cast<Scalar>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+            v = static_cast<Scalar>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+            w = static_cast<Scalar>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+        }
+
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+            return false;
+
+        auto det = u + v + w;
+        if (det == 0)
+            return false;
+
+        // Compare the scaled distance against the range before dividing.
+        auto scaled_t = shear_z * (u * a[kz] + v * b[kz] + w * c[kz]);
+        auto lo = static_cast<Scalar>(t_min), hi = static_cast<Scalar>(t_max);
+        if (det < 0 ? (scaled_t >= lo * det || scaled_t <= hi * det)
+                    : (scaled_t <= lo * det || scaled_t >= hi * det))
+            return false;
+
+        auto inv_det = 1 / det;
+        auto hit_t = scaled_t * inv_det;
+
+        // Reject a t no larger than the bound on its rounding error (Pharr, Jakob and
+        // Humphreys, 2016, 3.9.6): it can't be told from zero, and is most likely the
+        // surface the ray left.
+        auto max_x = std::max(std::fabs(ax), std::max(std::fabs(bx), std::fabs(cx)));
+        auto max_y = std::max(std::fabs(ay), std::max(std::fabs(by), std::fabs(cy)));
+        auto max_z = std::fabs(shear_z) * std::max(std::fabs(a[kz]), std::max(std::fabs(b[kz]), std::fabs(c[kz])));
+        auto max_e = std::max(std::fabs(u), std::max(std::fabs(v), std::fabs(w)));
+        auto delta_x = rounding_gamma<Scalar>(5) * (max_x + max_z);
+        auto delta_y = rounding_gamma<Scalar>(5) * (max_y + max_z);
+        auto delta_z = rounding_gamma<Scalar>(3) * max_z;
+        auto delta_e = 2 * (rounding_gamma<Scalar>(2) * max_x * max_y + delta_y * max_x + delta_x * max_y);
+        auto delta_t = 3 * (rounding_gamma<Scalar>(3) * max_e * max_z + delta_e * max_z + delta_z * max_e) * std::fabs(inv_det);
+        if (hit_t <= delta_t)
+            return false;
+
+        t = hit_t;
+        b1 = v * inv_det;
+        b2 = w * inv_det;
+        return true;
+    }
+
+    basic_vector3<Scalar> origin;
+    int kx, ky, kz;
+    Scalar shear_x, shear_y, shear_z;
+};
+
+
+// An indexed triangle mesh with its own BVH. Triangles are reordered into leaf order when
+// the BVH is built, so leaves index them directly. Costs about 16 bytes per triangle, 32 per
+// vertex and 32 per BVH node.
+//
+// The geometry and BVH are read through views of arrays held by `storage`, which is either
+// the mesh's own vectors or a mapped cache file (see mesh_cache.h). Copies of a mesh share
+// them and differ only in their material lists.
+class triangle_mesh : public hittable {
+    public:
+        triangle_mesh() {}
+
+        triangle_mesh(mesh_data data, const bvh_options& options = bvh_options())
+            : materials(std::move(data.materials))
+        {
+            build_bvh(std::move(data.vertices), std::move(data.triangles), options);
+            widen_bvh(options.width);
+        }
+
+        // Adopts arrays built earlier, kept alive by `storage`.
+        triangle_mesh(
+            shared_ptr<const void> storage, array_view<mesh_vertex> vertices,
+            array_view<mesh_triangle> triangles, array_view<linear_bvh_node> nodes,
+            std::vector<const material*> materials, const aabb& box
+        ) : vertices(vertices), triangles(triangles), nodes(nodes), materials(std::move(materials)),
+            box(box), storage(std::move(storage)) {}
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual void finalize_hit(const ray& r, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const;
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const;
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const;
+
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+            output_box = box;
+            return !nodes.empty();
+        }
+
+        size_t memory_bytes() const {
+            return vertices.size() * sizeof(mesh_vertex)
+                 + triangles.size() * sizeof(mesh_triangle)
+                 + nodes.size() * sizeof(linear_bvh_node)
+                 + nodes4.size() * sizeof(wide_bvh_node<4>)
+                 + nodes8.size() * sizeof(wide_bvh_node<8>)
+                 + materials.size() * sizeof(const material*);
+        }
+
+        // Collapses the BVH into a 4 or 8 wide one to render with; width 2 keeps the binary
+        // one. The binary nodes stay, as they are what the mesh cache holds.
+        void widen_bvh(int width);
+
+    private:
+        void build_bvh(std::vector<mesh_vertex> vertex_list, std::vector<mesh_triangle> triangle_list,
+                       const bvh_options& options);
+
+        // Walks the BVH calling leaf_hit(triangle index) on every triangle whose leaf the
+        // ray reaches. leaf_hit returns true to stop the walk. Wide BVHs visit children
+        // nearest first if asked.
+        template <typename LeafHit>
+        void traverse(const ray& r, double t_min, double& t_max, bool nearest_first, LeafHit leaf_hit) const;
+
+        // traverse_packet over whichever BVH the mesh renders with.
+        template <typename VisitLeaf>
+        void walk_packet(const ray_packet& packet, uint32_t lanes, VisitLeaf visit_leaf) const;
+
+        // The queries above, testing triangles in `Scalar` precision.
+        template <typename Scalar>
+        bool hit_with(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        template <typename Scalar>
+        bool occluded_with(const ray& r, double t_min, double t_max) const;
+        template <typename Scalar>
+        uint32_t hit_packet_with(ray_packet& packet, uint32_t lanes) const;
+        template <typename Scalar>
+        uint32_t occluded_packet_with(const ray_packet& packet, uint32_t lanes) const;
+
+    public:
+        array_view<mesh_vertex> vertices;
+        array_view<mesh_triangle> triangles;
+        array_view<linear_bvh_node> nodes;
+        std::vector<const material*> materials;
+        aabb box;
+        shared_ptr<const void> storage;
+
+        // The collapsed BVH, if any, shared by copies like the arrays above.
+        array_view<wide_bvh_node<4>> nodes4;
+        array_view<wide_bvh_node<8>> nodes8;
+        shared_ptr<const void> wide_storage;
+};
+
+
+// The builder asks for each triangle's bounds many times, so they are worked out once into a
+// temporary array that is sorted in place of the triangles themselves.
+void triangle_mesh::build_bvh(
+    std::vector<mesh_vertex> vertex_list, std::vector<mesh_triangle> triangle_list,
+    const bvh_options& options
+) {
+    struct build_triangle {
+        float lo[3], hi[3];
+        uint32_t index;
+    };
+
+    struct owned_arrays {
+        std::vector<mesh_vertex> vertices;
+        std::vector<mesh_triangle> triangles;
+        std::vector<linear_bvh_node> nodes;
+    };
+    auto owned = make_shared<owned_arrays>();
+    owned->vertices = std::move(vertex_list);
+    const auto& vertices = owned->vertices;
+    const auto& triangles = triangle_list;
+
+    std::vector<build_triangle> refs(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        auto& ref = refs[i];
+        ref.index = static_cast<uint32_t>(i);
+        for (int a = 0; a < 3; a++) {
+            ref.lo[a] = ref.hi[a] = vertices[triangles[i].v[0]].position[a];
+            for (int k = 1; k < 3; k++) {
+                auto x = vertices[triangles[i].v[k]].position[a];
+                ref.lo[a] = x < ref.lo[a] ? x : ref.lo[a];
+                ref.hi[a] = x > ref.hi[a] ? x : ref.hi[a];
+            }
+        }
+    }
+
+    auto bounds_of = [](const build_triangle& t) {
+        return aabb(point(t.lo[0], t.lo[1], t.lo[2]), point(t.hi[0], t.hi[1], t.hi[2]));
+    };
+    owned->nodes = build_linear_bvh(refs, bounds_of, options);
+    if (!refs.empty())
+        box = range_bounds(refs, bounds_of, 0, refs.size());
+
+    owned->triangles.reserve(triangles.size());
+    for (const auto& ref : refs)
+        owned->triangles.push_back(triangles[ref.index]);
+
+    this->vertices = owned->vertices;
+    this->triangles = owned->triangles;
+    this->nodes = owned->nodes;
+    storage = owned;
+}
+
+
+void triangle_mesh::widen_bvh(int width) {
+    nodes4 = array_view<wide_bvh_node<4>>();
+    nodes8 = array_view<wide_bvh_node<8>>();
+    wide_storage = nullptr;
+    if (width == 4) {
+        auto wide = make_shared<std::vector<wide_bvh_node<4>>>(collapse_linear_bvh<4>(nodes.begin(), nodes.size()));
+        nodes4 = *wide;
+        wide_storage = wide;
+    } else if (width == 8) {
+        auto wide = make_shared<std::vector<wide_bvh_node<8>>>(collapse_linear_bvh<8>(nodes.begin(), nodes.size()));
+        nodes8 = *wide;
+        wide_storage = wide;
+    }
+}
+
+
+template <typename LeafHit>
+void triangle_mesh::traverse(const ray& r, double t_min, double& t_max, bool nearest_first, LeafHit leaf_hit) const {
+    if (nodes.empty())
+        return;
+
+    auto visit_leaf = [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++)
+            if (leaf_hit(i))
+                return true;
+        return false;
+    };
+    if (!nodes4.empty())
+        return traverse_wide(nodes4.begin(), r, t_min, t_max, nearest_first, visit_leaf);
+    if (!nodes8.empty())
+        return traverse_wide(nodes8.begin(), r, t_min, t_max, nearest_first, visit_leaf);
+
+    linear_bvh_ray fr(r);
+    uint32_t stack[linear_bvh_max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const auto& node = nodes[current];
+        if (fr.hit(node, static_cast<float>(t_min), static_cast<float>(t_max))) {
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    if (leaf_hit(i))
+                        return;
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            } else if (fr.dir_is_neg[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+            }
+        } else {
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+}
+
+
+bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    return float_geometry() ? hit_with<float>(r, t_min, t_max, rec) : hit_with<double>(r, t_min, t_max, rec);
+}
+
+
+bool triangle_mesh::occluded(const ray& r, double t_min, double t_max) const {
+    return float_geometry() ? occluded_with<float>(r, t_min, t_max) : occluded_with<double>(r, t_min, t_max);
+}
+
+
+uint32_t triangle_mesh::hit_packet(ray_packet& packet, uint32_t lanes) const {
+    return float_geometry() ? hit_packet_with<float>(packet, lanes) : hit_packet_with<double>(packet, lanes);
+}
+
+
+uint32_t triangle_mesh::occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+    return float_geometry() ? occluded_packet_with<float>(packet, lanes) : occluded_packet_with<double>(packet, lanes);
+}
+
+
+// Leaves the barycentric weights of the winning triangle in rec.u and rec.v for
+// finalize_hit, which replaces them with texture coordinates.
+template <typename Scalar>
+bool triangle_mesh::hit_with(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    watertight_ray<Scalar> wr(r);
+    bool hit_anything = false;
+
+    traverse(r, t_min, t_max, true, [&](uint32_t i) {
+        const auto& tri = triangles[i];
+        double t, b1, b2;
+        if (wr.hit(vertices[tri.v[0]].position, vertices[tri.v[1]].position,
+                   vertices[tri.v[2]].position, t_min, t_max, t, b1, b2)) {
+            hit_anything = true;
+            t_max = t;
+            rec.t = t;
+            rec.u = b1;
+            rec.v = b2;
+            rec.primitive = i;
+        }
+        return false;
+    });
+
+    if (hit_anything)
+        rec.object = this;
+    return hit_anything;
+}
+
+
+template <typename Scalar>
+bool triangle_mesh::occluded_with(const ray& r, double t_min, double t_max) const {
+    watertight_ray<Scalar> wr(r);
+    bool blocked = false;
+
+    traverse(r, t_min, t_max, false, [&](uint32_t i) {
+        const auto& tri = triangles[i];
+        double t, b1, b2;
+        blocked = wr.hit(vertices[tri.v[0]].position, vertices[tri.v[1]].position,
+                         vertices[tri.v[2]].position, t_min, t_max, t, b1, b2);
+        return blocked;
+    });
+
+    return blocked;
+}
+
+
+template <typename VisitLeaf>
+void triangle_mesh::walk_packet(const ray_packet& packet, uint32_t lanes, VisitLeaf visit_leaf) const {
+    if (!nodes4.empty())
+        traverse_wide_packet(nodes4.begin(), packet, lanes, visit_leaf);
+    else if (!nodes8.empty())
+        traverse_wide_packet(nodes8.begin(), packet, lanes, visit_leaf);
+    else
+        traverse_packet(nodes.begin(), packet, lanes, visit_leaf);
+}
+
+
+// The packet walk visits each leaf once for all the rays that reach it, so a triangle's
+// vertices are loaded once and tested against each of those rays in turn.
+template <typename Scalar>
+uint32_t triangle_mesh::hit_packet_with(ray_packet& packet, uint32_t lanes) const {
+    if (nodes.empty())
+        return 0;
+
+    watertight_ray<Scalar> wr[packet_size];
+    for (int lane = 0; lane < packet_size; lane++)
+        if (ray_packet::in_lanes(lanes, lane))
+            wr[lane] = watertight_ray<Scalar>(packet.rays[lane]);
+
+    uint32_t hits = 0;
+    walk_packet(packet, lanes, [&](uint32_t first, uint32_t count, uint32_t reached) {
+        for (uint32_t i = first; i < first + count; i++) {
+            const auto& tri = triangles[i];
+            const auto* p0 = vertices[tri.v[0]].position;
+            const auto* p1 = vertices[tri.v[1]].position;
+            const auto* p2 = vertices[tri.v[2]].position;
+            for (int lane = 0; lane < packet_size; lane++) {
+                double t, b1, b2;
+                if (ray_packet::in_lanes(reached, lane) &&
+                    wr[lane].hit(p0, p1, p2, packet.t_min, packet.t_max[lane], t, b1, b2)) {
+                    auto& rec = packet.records[lane];
+                    packet.t_max[lane] = t;
+                    rec.t = t;
+                    rec.u = b1;
+                    rec.v = b2;
+                    rec.primitive = i;
+                    rec.object = this;
+                    hits |= 1u << lane;
+                }
+            }
+        }
+        return 0u;
+    });
+    return hits;
+}
+
+
+template <typename Scalar>
+uint32_t triangle_mesh::occluded_packet_with(const ray_packet& packet, uint32_t lanes) const {
+    if (nodes.empty())
+        return 0;
+
+    watertight_ray<Scalar> wr[packet_size];
+    for (int lane = 0; lane < packet_size; lane++)
+        if (ray_packet::in_lanes(lanes, lane))
+            wr[lane] = watertight_ray<Scalar>(packet.rays[lane]);
+
+    uint32_t blocked = 0;
+    walk_packet(packet, lanes, [&](uint32_t first, uint32_t count, uint32_t reached) {
+        uint32_t done = 0;
+        for (uint32_t i = first; i < first + count && done != reached; i++) {
+            const auto& tri = triangles[i];
+            for (int lane = 0; lane < packet_size; lane++) {
+                double t, b1, b2;
+                if (ray_packet::in_lanes(reached & ~done, lane) &&
+                    wr[lane].hit(vertices[tri.v[0]].position, vertices[tri.v[1]].position,
+                                 vertices[tri.v[2]].position, packet.t_min, packet.t_max[lane], t, b1, b2))
+                    done |= 1u << lane;
+            }
+        }
+        blocked |= done;
+        return done;
+    });
+    return blocked;
+}
+
+
+void triangle_mesh::finalize_hit(const ray& r, hit_record& rec) const {
+    const auto& tri = triangles[rec.primitive];
+    const auto& v0 = vertices[tri.v[0]];
+    const auto& v1 = vertices[tri.v[1]];
+    const auto& v2 = vertices[tri.v[2]];
+    auto b1 = rec.u;
+    auto b2 = rec.v;
+    auto b0 = 1 - b1 - b2;
+
+    auto position = [](const mesh_vertex& v) {
+        return point(v.position[0], v.position[1], v.position[2]);
+    };
+    auto p0 = position(v0);
+    auto p1 = position(v1);
+    auto p2 = position(v2);
+    auto geometric_normal = cross(p1 - p0, p2 - p0);
+
+    // Weighting the vertices puts p on the triangle's plane, whatever precision the
+    // weights were found in, and bounds its error by that of the sum rather than by how
+    // far along the ray it lies.
+    rec.p = b0 * p0 + b1 * p1 + b2 * p2;
+    rec.p_error = rounding_gamma<double>(7) * (abs(b0 * p0) + abs(b1 * p1) + abs(b2 * p2));
+    rec.geometric_normal = unit_vector(geometric_normal);
+    rec.u = b0 * v0.uv[0] + b1 * v1.uv[0] + b2 * v2.uv[0];
+    rec.v = b0 * v0.uv[1] + b1 * v1.uv[1] + b2 * v2.uv[1];
+
+    // Interpolate the vertex normals when there are any, turned to the side of the
+    // geometric normal so front_face still comes from the true surface.
+    vector3 normal(
+        b0 * v0.normal[0] + b1 * v1.normal[0] + b2 * v2.normal[0],
+        b0 * v0.normal[1] + b1 * v1.normal[1] + b2 * v2.normal[1],
+        b0 * v0.normal[2] + b1 * v1.normal[2] + b2 * v2.normal[2]);
+    if (normal.length_squared() == 0)
+        normal = geometric_normal;
+    else if (dot(normal, geometric_normal) < 0)
+        normal = -normal;
+
+    rec.front_face = dot(r.direction(), geometric_normal) < 0;
+    normal = unit_vector(normal);
+    rec.normal = rec.front_face ? normal : -normal;
+    rec.mat_ptr = materials[tri.material];
+}
+
+
+#endif
@@ -16,42 +16,52 @@
 
 using std::sqrt;
 
-class vector3 {
+// A 3D vector of `Scalar` components. Everything works in double through vector3 except the
+// float triangle test of triangle meshes, which uses basic_vector3<float>.
+template <typename Scalar>
+class basic_vector3 {
     public:
-        vector3() : e{0,0,0} {}
-        vector3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+        typedef Scalar scalar;
 
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        basic_vector3() : e{0,0,0} {}
+        basic_vector3(Scalar e0, Scalar e1, Scalar e2) : e{e0, e1, e2} {}
 
-        vector3 operator-() const { return vector3(-e[0], -e[1], -e[2]); }
-        double operator[](int i) const { return e[i]; }
-        double& operator[](int i) { return e[i]; }
+        // Converts between precisions, rounding to nearest when narrowing.
+        template <typename Other>
+        explicit basic_vector3(const basic_vector3<Other>& v)
+            : e{static_cast<Scalar>(v.e[0]), static_cast<Scalar>(v.e[1]), static_cast<Scalar>(v.e[2])} {}
 
-        vector3& operator+=(const vector3 &v) {
+        Scalar x() const { return e[0]; }
+        Scalar y() const { return e[1]; }
+        Scalar z() const { return e[2]; }
+
+        basic_vector3 operator-() const { return basic_vector3(-e[0], -e[1], -e[2]); }
+        Scalar operator[](int i) const { return e[i]; }
+        Scalar& operator[](int i) { return e[i]; }
+
+        basic_vector3& operator+=(const basic_vector3 &v) {
             e[0] += v.e[0];
             e[1] += v.e[1];
             e[2] += v.e[2];
             return *this;
         }
 
-        vector3& operator*=(const double t) {
+        basic_vector3& operator*=(const Scalar t) {
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
             return *this;
         }
 
-        vector3& operator/=(const double t) {
+        basic_vector3& operator/=(const Scalar t) {
             return *this *= 1/t;
         }
 
-        double length() const {
+        Scalar length() const {
             return sqrt(length_squared());
         }
 
-        double length_squared() const {
+        Scalar length_squared() const {
             return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
         }
 
@@ -75,91 +85,122 @@ class vector3 {
                 << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
         }
 
-        inline static vector3 random() {
-            return vector3(random_double(), random_double(), random_double());
+        inline static basic_vector3 random() {
+            return basic_vector3(random_double(), random_double(), random_double());
         }
 
-        inline static vector3 random(double min, double max) {
-            return vector3(random_double(min,max), random_double(min,max), random_double(min,max));
+        inline static basic_vector3 random(double min, double max) {
+            return basic_vector3(random_double(min,max), random_double(min,max), random_double(min,max));
         }
 
     public:
-        double e[3];
+        Scalar e[3];
 };
 
 
 // Type aliases for vec3
+using vector3 = basic_vector3<double>;
 using point = vector3;   // 3D point
 using colour = vector3;    // RGB color
 
 
 // vec3 Utility Functions
+//
+// Scalars are taken as typename basic_vector3<T>::scalar so that T is deduced from the vector
+// alone, and a literal such as the 2 in 2*v converts to whichever precision v is in.
 
-inline std::ostream& operator<<(std::ostream &out, const vector3 &v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream &out, const basic_vector3<T> &v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vector3 operator+(const vector3 &u, const vector3 &v) {
-    return vector3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T>
+inline basic_vector3<T> operator+(const basic_vector3<T> &u, const basic_vector3<T> &v) {
+    return basic_vector3<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vector3 operator-(const vector3 &u, const vector3 &v) {
-    return vector3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T>
+inline basic_vector3<T> operator-(const basic_vector3<T> &u, const basic_vector3<T> &v) {
+    return basic_vector3<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vector3 operator*(const vector3 &u, const vector3 &v) {
-    return vector3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T>
+inline basic_vector3<T> operator*(const basic_vector3<T> &u, const basic_vector3<T> &v) {
+    return basic_vector3<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vector3 operator*(double t, const vector3 &v) {
-    return vector3(t*v.e[0], t*v.e[1], t*v.e[2]);
+template <typename T>
+inline basic_vector3<T> operator*(typename basic_vector3<T>::scalar t, const basic_vector3<T> &v) {
+    return basic_vector3<T>(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vector3 operator*(const vector3 &v, double t) {
+template <typename T>
+inline basic_vector3<T> operator*(const basic_vector3<T> &v, typename basic_vector3<T>::scalar t) {
     return t * v;
 }
 
-inline vector3 operator/(vector3 v, double t) {
+template <typename T>
+inline basic_vector3<T> operator/(basic_vector3<T> v, typename basic_vector3<T>::scalar t) {
     return (1/t) * v;
 }
 
-inline double dot(const vector3 &u, const vector3 &v) {
+template <typename T>
+inline T dot(const basic_vector3<T> &u, const basic_vector3<T> &v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
 }
 
-inline vector3 cross(const vector3 &u, const vector3 &v) {
-    return vector3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+template <typename T>
+inline basic_vector3<T> cross(const basic_vector3<T> &u, const basic_vector3<T> &v) {
+    return basic_vector3<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
                 u.e[2] * v.e[0] - u.e[0] * v.e[2],
                 u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vector3 unit_vector(vector3 v) {
+template <typename T>
+inline basic_vector3<T> unit_vector(basic_vector3<T> v) {
     return v / v.length();
 }
 
+// Each component's magnitude.
+template <typename T>
+inline basic_vector3<T> abs(const basic_vector3<T> &v) {
+    return basic_vector3<T>(std::fabs(v.e[0]), std::fabs(v.e[1]), std::fabs(v.e[2]));
+}
+
+// The sampling functions below map a fixed number of dimensions rather than rejecting
+// points, so every sample draws the same dimensions for the same decisions and the samplers
+// that stratify them can.
+
 inline vector3 random_in_unit_disk() {
-    while (true) {
-        auto p = vector3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
+    // Shirley and Chiu's concentric map, which keeps strata of the square compact.
+    auto s = random_2d();
+    auto a = 2*s.u - 1;
+    auto b = 2*s.v - 1;
+    if (a == 0 && b == 0)
+        return vector3(0, 0, 0);
+    double r, phi;
+    if (a*a > b*b) {
+        r = a;
+        phi = (pi/4) * (b/a);
+    } else {
+        r = b;
+        phi = pi/2 - (pi/4) * (a/b);
     }
+    return vector3(r*cos(phi), r*sin(phi), 0);
 }
 
 inline vector3 random_unit_vector() {
-    auto a = random_double(0, 2*pi);
-    auto z = random_double(-1, 1);
+    auto s = random_2d();
+    auto a = 2*pi * s.u;
+    auto z = -1 + 2 * s.v;
     auto r = sqrt(1 - z*z);
     return vector3(r*cos(a), r*sin(a), z);
 }
 
 inline vector3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vector3::random(-1,1);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+    return random_unit_vector() * std::cbrt(random_double());
 }
 
 inline vector3 random_in_hemisphere(const vector3& normal) {
@@ -183,8 +224,9 @@ inline vector3 refract(const vector3& uv, const vector3& n, double etai_over_eta
 
 
 inline vector3 random_cosine_direction() {
-	float r1 = random_double();
-	float r2 = random_double();
+	auto s = random_2d();
+	float r1 = s.u;
+	float r2 = s.v;
 	float z = sqrt(1 - r2);
 	float phi = 2 * pi * r1;
 	float x = cos(phi) * sqrt(r2);
@@ -193,13 +235,18 @@ inline vector3 random_cosine_direction() {
 }
 
 inline vector3 random_to_sphere(double radius, double distance_squared) {
-	auto r1 = random_double();
-	auto r2 = random_double();
-	auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
+	auto s = random_2d();
+	auto r1 = s.u;
+	auto r2 = s.v;
+	// 1 - z and 1 - cos(theta_max) are kept as such, as small cones would cancel them away.
+	auto sin2_theta_max = radius * radius / distance_squared;
+	auto one_minus_z = r2 * sin2_theta_max / (1 + sqrt(1 - sin2_theta_max));
+	auto z = 1 - one_minus_z;
+	auto sin_theta = sqrt(one_minus_z * (2 - one_minus_z));
 
 	auto phi = 2 * pi * r1;
-	auto x = cos(phi) * sqrt(1 - z * z);
-	auto y = sin(phi) * sqrt(1 - z * z);
+	auto x = cos(phi) * sin_theta;
+	auto y = sin(phi) * sin_theta;
 
 	return vector3(x, y, z);
 }
@@ -0,0 +1,230 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "constants.h"
+
+#include "hittable.h"
+#include "integrator.h"
+#include "light_sampler.h"
+#include "material.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// How many paths the renderer hands the wavefront integrator at once.
+const size_t wavefront_size = 4096;
+
+
+// One path of a path_batch, as references to its fields, so the integrator's shading code
+// runs on it as it does on a path_state.
+struct path_ref {
+    colour& radiance;
+    colour& throughput;
+    ray& r;
+    int& depth;
+
+    uint8_t& weighted;
+    double& material_pdf;
+    size_t& picked;
+    double& picked_probability;
+    point& origin;
+    vector3& normal;
+};
+
+
+// The fields of path_state, an array to each, with each path's random stream alongside. A
+// stage of the wavefront only streams through the fields it reads and writes.
+class path_batch {
+    public:
+        void resize(size_t n) {
+            radiance.resize(n);
+            throughput.resize(n);
+            r.resize(n);
+            depth.resize(n);
+            weighted.resize(n);
+            material_pdf.resize(n);
+            picked.resize(n);
+            picked_probability.resize(n);
+            origin.resize(n);
+            normal.resize(n);
+            streams.resize(n);
+        }
+
+        size_t size() const { return r.size(); }
+
+        // Sets path i off along a camera ray, as path_state(camera_ray) does.
+        void start(size_t i, const ray& camera_ray, const random_stream& stream) {
+            radiance[i] = colour(0, 0, 0);
+            throughput[i] = colour(1, 1, 1);
+            r[i] = camera_ray;
+            depth[i] = 0;
+            weighted[i] = false;
+            streams[i] = stream;
+        }
+
+        path_ref operator[](size_t i) {
+            return path_ref{ radiance[i], throughput[i], r[i], depth[i], weighted[i], material_pdf[i],
+                             picked[i], picked_probability[i], origin[i], normal[i] };
+        }
+
+    public:
+        std::vector<colour> radiance;
+        std::vector<colour> throughput;
+        std::vector<ray> r;
+        std::vector<int> depth;
+
+        std::vector<uint8_t> weighted;
+        std::vector<double> material_pdf;
+        std::vector<size_t> picked;
+        std::vector<double> picked_probability;
+        std::vector<point> origin;
+        std::vector<vector3> normal;
+
+        std::vector<random_stream> streams;
+};
+
+
+// ray_colours for a large batch of camera rays, a bounce at a time across the whole batch.
+// Each bounce intersects the rays of every live path, queues the hits by the type of
+// material they landed on, shades each queue in turn and then traces the shadow rays the
+// shading left, so the BVH walk, each material's code and the occlusion tests each run in
+// a loop of their own. Every path draws from its own random stream, in the order ray_colour
+// would draw, so the result for each ray is the one ray_colour gives it.
+//
+// The buffers are kept from one call to the next; an integrator is meant to be reused by
+// one thread.
+class wavefront_integrator {
+    public:
+        void trace(
+            const ray* camera_rays,
+            const random_stream* camera_streams,
+            size_t count,
+            const hittable& world,
+            const light_sampler& lights,
+            const integrator_settings& settings,
+            path_stats& stats,
+            colour* radiance
+        );
+
+    private:
+        // Shades the hits in `queue`, whose materials are all of type Material, adding the
+        // paths that carry on to `live` and those with a shadow ray to `shadowed`.
+        template <typename Material>
+        void shade_queue(
+            const std::vector<uint32_t>& queue,
+            const light_sampler& lights,
+            const integrator_settings& settings,
+            path_stats& stats
+        );
+
+    private:
+        path_batch paths;
+        std::vector<hit_record> records;
+        std::vector<shadow_ray> shadows;
+
+        std::vector<uint32_t> live;
+        std::vector<uint32_t> next;
+        std::vector<uint32_t> queues[material_type_count];
+        std::vector<uint32_t> shadowed;
+};
+
+
+void wavefront_integrator::trace(
+    const ray* camera_rays,
+    const random_stream* camera_streams,
+    size_t count,
+    const hittable& world,
+    const light_sampler& lights,
+    const integrator_settings& settings,
+    path_stats& stats,
+    colour* radiance
+) {
+    if (paths.size() < count) {
+        paths.resize(count);
+        records.resize(count);
+        shadows.resize(count);
+    }
+
+    live.clear();
+    for (size_t i = 0; i < count; i++) {
+        paths.start(i, camera_rays[i], camera_streams[i]);
+        live.push_back(static_cast<uint32_t>(i));
+    }
+
+    auto& stream = thread_random_stream();
+    while (true) {
+        next.clear();
+        for (auto i : live) {
+            auto path = paths[i];
+            if (start_bounce(path, settings, stats))
+                next.push_back(i);
+        }
+        live.swap(next);
+        if (live.empty())
+            break;
+
+        // Extend every path. Misses end here; hits are finalized and queued by material.
+        for (auto& queue : queues)
+            queue.clear();
+        for (auto i : live) {
+            auto& rec = records[i];
+            stream = paths.streams[i];
+            auto hit = world.hit(paths.r[i], 0, infinity, rec);
+            paths.streams[i] = stream;
+
+            if (!hit) {
+                auto path = paths[i];
+                shade_miss(path, settings, stats);
+                continue;
+            }
+            rec.object->finalize_hit(paths.r[i], rec);
+            queues[static_cast<int>(rec.mat_ptr->type_of())].push_back(i);
+        }
+
+        next.clear();
+        shadowed.clear();
+        shade_queue<lambertian>(queues[static_cast<int>(material_type::lambertian)], lights, settings, stats);
+        shade_queue<metal>(queues[static_cast<int>(material_type::metal)], lights, settings, stats);
+        shade_queue<dielectric>(queues[static_cast<int>(material_type::dielectric)], lights, settings, stats);
+        shade_queue<isotropic>(queues[static_cast<int>(material_type::isotropic)], lights, settings, stats);
+        shade_queue<diffuse_light>(queues[static_cast<int>(material_type::diffuse_light)], lights, settings, stats);
+        shade_queue<material>(queues[static_cast<int>(material_type::other)], lights, settings, stats);
+
+        for (auto i : shadowed) {
+            auto path = paths[i];
+            stream = paths.streams[i];
+            trace_shadow(world, shadows[i], path, stats);
+            paths.streams[i] = stream;
+        }
+
+        live.swap(next);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        radiance[i] = paths.radiance[i];
+}
+
+
+template <typename Material>
+void wavefront_integrator::shade_queue(
+    const std::vector<uint32_t>& queue,
+    const light_sampler& lights,
+    const integrator_settings& settings,
+    path_stats& stats
+) {
+    auto& stream = thread_random_stream();
+    for (auto i : queue) {
+        auto path = paths[i];
+        const auto& rec = records[i];
+        stream = paths.streams[i];
+        if (shade_hit(path, static_cast<const Material&>(*rec.mat_ptr), rec, lights, settings, stats, shadows[i]))
+            next.push_back(i);
+        paths.streams[i] = stream;
+        if (shadows[i].pending)
+            shadowed.push_back(i);
+    }
+}
+
+
+#endif
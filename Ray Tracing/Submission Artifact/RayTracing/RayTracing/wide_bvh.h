@@ -0,0 +1,413 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "constants.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+
+// A node of a wide BVH with up to Width children (4 or 8). The children's bounds are stored
+// axis by axis, so one ray is tested against all of them at once: four to an SSE register,
+// or eight to an AVX one. A child is an interior node, by index, or a leaf's range of
+// primitives. Slots from `children` on are unused. 32 bytes a child, so a BVH4 node is two
+// cache lines and a BVH8 node four.
+template <int Width>
+struct wide_bvh_node {
+    float bounds_min[3][Width];
+    float bounds_max[3][Width];
+    uint32_t child[Width];      // interior: the node's index; leaf: its first primitive
+    uint16_t count[Width];      // leaf: its primitive count; interior: 0
+    uint8_t children;
+    uint8_t pad[2 * Width - 1];
+};
+
+static_assert(sizeof(wide_bvh_node<4>) == 128, "wide_bvh_node<4> must stay 128 bytes");
+static_assert(sizeof(wide_bvh_node<8>) == 256, "wide_bvh_node<8> must stay 256 bytes");
+
+
+inline float linear_bvh_node_area(const linear_bvh_node& node) {
+    auto dx = node.bounds_max[0] - node.bounds_min[0];
+    auto dy = node.bounds_max[1] - node.bounds_min[1];
+    auto dz = node.bounds_max[2] - node.bounds_min[2];
+    return dx*dy + dy*dz + dz*dx;
+}
+
+
+template <int Width>
+uint32_t collapse_linear_bvh_node(
+    const linear_bvh_node* nodes, uint32_t index, std::vector<wide_bvh_node<Width>>& wide
+) {
+    // Start from the binary node's children and keep opening the largest interior one.
+    uint32_t slots[Width];
+    int used = 0;
+    if (nodes[index].count > 0) {
+        slots[used++] = index;
+    } else {
+        slots[used++] = index + 1;
+        slots[used++] = nodes[index].offset;
+    }
+
+    while (used < Width) {
+        int largest = -1;
+        float largest_area = -1;
+        for (int i = 0; i < used; i++) {
+            if (nodes[slots[i]].count == 0 && linear_bvh_node_area(nodes[slots[i]]) > largest_area) {
+                largest = i;
+                largest_area = linear_bvh_node_area(nodes[slots[i]]);
+            }
+        }
+        if (largest < 0)
+            break;
+        auto opened = slots[largest];
+        slots[largest] = opened + 1;
+        slots[used++] = nodes[opened].offset;
+    }
+
+    auto wide_index = static_cast<uint32_t>(wide.size());
+    wide.push_back(wide_bvh_node<Width>());
+    wide[wide_index].children = static_cast<uint8_t>(used);
+    for (int i = 0; i < used; i++) {
+        const auto& child = nodes[slots[i]];
+        for (int a = 0; a < 3; a++) {
+            wide[wide_index].bounds_min[a][i] = child.bounds_min[a];
+            wide[wide_index].bounds_max[a][i] = child.bounds_max[a];
+        }
+        if (child.count > 0) {
+            wide[wide_index].child[i] = child.offset;
+            wide[wide_index].count[i] = child.count;
+        } else {
+            // The recursion grows `wide`, so index it again afterwards.
+            auto child_index = collapse_linear_bvh_node(nodes, slots[i], wide);
+            wide[wide_index].child[i] = child_index;
+            wide[wide_index].count[i] = 0;
+        }
+    }
+    return wide_index;
+}
+
+
+// Collapses a binary linear BVH into a wide one over the same primitive order. Each wide
+// node takes a binary node's children and opens its largest interior child, by surface
+// area, until it has Width children or only leaves, so the tree is log2(Width) times
+// shallower and a ray visits that many times fewer nodes.
+template <int Width>
+std::vector<wide_bvh_node<Width>> collapse_linear_bvh(const linear_bvh_node* nodes, size_t count) {
+    std::vector<wide_bvh_node<Width>> wide;
+    if (count == 0)
+        return wide;
+
+    wide.reserve(count / (Width - 1) + 1);
+    collapse_linear_bvh_node(nodes, 0, wide);
+    return wide;
+}
+
+
+// linear_bvh_ray's slab test against every child of a wide node at once, with the same NaN
+// rules and widening. Returns the children the ray reaches within (t_min, t_max), leaving
+// their entry distances in t_near.
+template <int Width>
+uint32_t wide_bvh_hit(
+    const linear_bvh_ray& fr, const wide_bvh_node<Width>& node, float t_min, float t_max, float* t_near
+) {
+    const float widen = 1 + 3 * std::numeric_limits<float>::epsilon();
+    uint32_t reached = 0;
+#if defined(__AVX__)
+    if (Width == 8) {
+        auto near8 = _mm256_set1_ps(t_min);
+        auto far8 = _mm256_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            auto o = _mm256_set1_ps(fr.origin[a]);
+            auto inv = _mm256_set1_ps(fr.inv_dir[a]);
+            auto t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds_min[a]), o), inv);
+            auto t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds_max[a]), o), inv);
+            auto nan = _mm256_cmp_ps(t0, t1, _CMP_UNORD_Q);
+            t0 = _mm256_or_ps(t0, nan);
+            t1 = _mm256_or_ps(t1, nan);
+            near8 = _mm256_max_ps(_mm256_min_ps(t0, t1), near8);
+            far8 = _mm256_min_ps(_mm256_mul_ps(_mm256_max_ps(t0, t1), _mm256_set1_ps(widen)), far8);
+        }
+        _mm256_storeu_ps(t_near, near8);
+        reached = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(near8, far8, _CMP_LE_OQ)));
+        return reached & ((1u << node.children) - 1);
+    }
+#endif
+#ifdef AABB_USE_SSE2
+    for (int g = 0; g < Width; g += 4) {
+        auto t_near4 = _mm_set1_ps(t_min);
+        auto t_far4 = _mm_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            auto o = _mm_set1_ps(fr.origin[a]);
+            auto inv = _mm_set1_ps(fr.inv_dir[a]);
+            auto t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds_min[a] + g), o), inv);
+            auto t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds_max[a] + g), o), inv);
+            auto nan = _mm_cmpunord_ps(t0, t1);
+            t0 = _mm_or_ps(t0, nan);
+            t1 = _mm_or_ps(t1, nan);
+            t_near4 = _mm_max_ps(_mm_min_ps(t0, t1), t_near4);
+            t_far4 = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t0, t1), _mm_set1_ps(widen)), t_far4);
+        }
+        _mm_storeu_ps(t_near + g, t_near4);
+        reached |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t_near4, t_far4))) << g;
+    }
+#else
+    for (int c = 0; c < Width; c++) {
+        auto near_c = t_min, far_c = t_max;
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (node.bounds_min[a][c] - fr.origin[a]) * fr.inv_dir[a];
+            auto t1 = (node.bounds_max[a][c] - fr.origin[a]) * fr.inv_dir[a];
+            if (std::isnan(t0) || std::isnan(t1))
+                continue;
+            auto near_a = t0 < t1 ? t0 : t1;
+            auto far_a  = (t0 > t1 ? t0 : t1) * widen;
+            near_c = near_a > near_c ? near_a : near_c;
+            far_c  = far_a  < far_c  ? far_a  : far_c;
+        }
+        t_near[c] = near_c;
+        reached |= static_cast<uint32_t>(near_c <= far_c) << c;
+    }
+#endif
+    return reached & ((1u << node.children) - 1);
+}
+
+
+// Walks a wide BVH for one ray. With nearest_first the children a node's test finds are
+// visited in order of entry distance, and any whose entry a closer hit has since passed is
+// skipped. visit_leaf(first, count) tests a leaf's primitives, lowering t_max on a hit, and
+// returns true to end the walk.
+template <int Width, typename VisitLeaf>
+void traverse_wide(
+    const wide_bvh_node<Width>* nodes, const ray& r, double t_min, const double& t_max,
+    bool nearest_first, VisitLeaf visit_leaf
+) {
+    struct entry {
+        uint32_t child;
+        uint32_t count;
+        float t_near;
+    };
+
+    linear_bvh_ray fr(r);
+    entry stack[(Width - 1) * linear_bvh_max_depth + 1];
+    int stack_size = 0;
+    entry current = { 0, 0, 0 };
+
+    while (true) {
+        if (current.count > 0) {
+            if (visit_leaf(current.child, current.count))
+                return;
+        } else {
+            const auto& node = nodes[current.child];
+            float t_near[Width];
+            auto reached = wide_bvh_hit(fr, node, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+
+            // Go on to the nearest child and stack the others, farthest deepest.
+            int order[Width];
+            int n = 0;
+            for (int c = 0; c < Width; c++) {
+                if (!((reached >> c) & 1))
+                    continue;
+                int k = n++;
+                for (; nearest_first && k > 0 && t_near[order[k - 1]] < t_near[c]; k--)
+                    order[k] = order[k - 1];
+                order[k] = c;
+            }
+            if (n > 0) {
+                for (int k = 0; k < n - 1; k++)
+                    stack[stack_size++] = { node.child[order[k]], node.count[order[k]], t_near[order[k]] };
+                current = { node.child[order[n - 1]], node.count[order[n - 1]], t_near[order[n - 1]] };
+                continue;
+            }
+        }
+
+        // Take the next child whose entry a closer hit hasn't passed.
+        do {
+            if (stack_size == 0)
+                return;
+            current = stack[--stack_size];
+        } while (current.t_near > static_cast<float>(t_max));
+    }
+}
+
+
+// traverse_packet for a wide BVH: each node's children are tested against the packet one
+// at a time, with interval culling first, and those some ray reaches are visited nearest
+// first along the packet's direction. visit_leaf is as for traverse_packet.
+template <int Width, typename VisitLeaf>
+void traverse_wide_packet(
+    const wide_bvh_node<Width>* nodes, const ray_packet& packet, uint32_t lanes, VisitLeaf visit_leaf
+) {
+    if (lanes == 0)
+        return;
+
+    struct entry {
+        uint32_t child;
+        uint32_t count;
+        uint32_t lanes;     // the rays that reached it
+    };
+
+    linear_bvh_packet fp(packet, lanes);
+    entry stack[(Width - 1) * linear_bvh_max_depth + 1];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, lanes };
+
+    while (stack_size > 0 && lanes != 0) {
+        auto e = stack[--stack_size];
+        auto live = e.lanes & lanes;
+        if (live == 0)
+            continue;
+        if (e.count > 0) {
+            lanes &= ~visit_leaf(e.child, e.count, live);
+            continue;
+        }
+
+        const auto& node = nodes[e.child];
+        entry reached[Width];
+        float distance[Width];
+        int n = 0;
+        for (int c = 0; c < node.children; c++) {
+            float lo[3] = { node.bounds_min[0][c], node.bounds_min[1][c], node.bounds_min[2][c] };
+            float hi[3] = { node.bounds_max[0][c], node.bounds_max[1][c], node.bounds_max[2][c] };
+            if (!fp.may_hit(lo, hi))
+                continue;
+            auto hit = fp.hit(lo, hi, packet, live);
+            if (hit == 0)
+                continue;
+
+            // How far along the packet's direction the box starts, for ordering.
+            float along = 0;
+            for (int a = 0; a < 3; a++)
+                along += fp.dir_is_neg(a, hit) ? -hi[a] : lo[a];
+
+            int k = n++;
+            for (; k > 0 && distance[k - 1] < along; k--) {
+                reached[k] = reached[k - 1];
+                distance[k] = distance[k - 1];
+            }
+            reached[k] = { node.child[c], node.count[c], hit };
+            distance[k] = along;
+        }
+        for (int k = 0; k < n; k++)
+            stack[stack_size++] = reached[k];
+    }
+}
+
+
+// A BVH over scene objects like linear_bvh, built the same way and collapsed to Width
+// children a node.
+template <int Width>
+class wide_bvh : public hittable {
+    public:
+        wide_bvh() {}
+
+        wide_bvh(const hittable_list& list, double time0, double time1,
+                 const bvh_options& options = bvh_options())
+            : objects(list.objects)
+        {
+            auto binary = build_linear_bvh(objects, object_bounds{time0, time1}, options);
+            nodes = collapse_linear_bvh<Width>(binary.data(), binary.size());
+            for (const auto& object : objects)
+                primitives.push_back(object.get());
+            if (!nodes.empty())
+                box = range_bounds(objects, object_bounds{time0, time1}, 0, objects.size());
+        }
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+            if (nodes.empty())
+                return false;
+
+            bool hit_anything = false;
+            traverse_wide(nodes.data(), r, t_min, t_max, true, [&](uint32_t first, uint32_t count) {
+                for (uint32_t i = first; i < first + count; i++) {
+                    if (primitives[i]->hit(r, t_min, t_max, rec)) {
+                        hit_anything = true;
+                        t_max = rec.t;
+                    }
+                }
+                return false;
+            });
+            return hit_anything;
+        }
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const {
+            if (nodes.empty())
+                return false;
+
+            bool blocked = false;
+            traverse_wide(nodes.data(), r, t_min, t_max, false, [&](uint32_t first, uint32_t count) {
+                for (uint32_t i = first; i < first + count && !blocked; i++)
+                    blocked = primitives[i]->occluded(r, t_min, t_max);
+                return blocked;
+            });
+            return blocked;
+        }
+
+        virtual uint32_t hit_packet(ray_packet& packet, uint32_t lanes) const {
+            if (nodes.empty())
+                return 0;
+
+            uint32_t hits = 0;
+            traverse_wide_packet(nodes.data(), packet, lanes, [&](uint32_t first, uint32_t count, uint32_t reached) {
+                for (uint32_t i = first; i < first + count; i++)
+                    hits |= primitives[i]->hit_packet(packet, reached);
+                return 0u;
+            });
+            return hits;
+        }
+
+        virtual uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes) const {
+            if (nodes.empty())
+                return 0;
+
+            uint32_t blocked = 0;
+            traverse_wide_packet(nodes.data(), packet, lanes, [&](uint32_t first, uint32_t count, uint32_t reached) {
+                uint32_t done = 0;
+                for (uint32_t i = first; i < first + count && done != reached; i++)
+                    done |= primitives[i]->occluded_packet(packet, reached & ~done);
+                blocked |= done;
+                return done;
+            });
+            return blocked;
+        }
+
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+            output_box = box;
+            return !nodes.empty();
+        }
+
+        virtual void gather_light_shapes(std::vector<light_shape>& shapes) const {
+            for (auto object : primitives)
+                object->gather_light_shapes(shapes);
+        }
+
+    public:
+        std::vector<shared_ptr<hittable>> objects;
+        std::vector<const hittable*> primitives;   // objects in leaf order, without refcounts
+        std::vector<wide_bvh_node<Width>> nodes;
+        aabb box;
+};
+
+
+// The scene's top-level BVH, binary or as wide as options.width asks. Every width finds the
+// same closest hits, so renders match bit for bit except in scenes with media: a medium's
+// hit() draws random numbers that depend on the t_max it is called with, which the order
+// nodes are visited in changes, so there the widths only agree in distribution.
+shared_ptr<hittable> make_scene_bvh(
+    const hittable_list& list, double time0, double time1, const bvh_options& options
+) {
+    if (options.width == 8)
+        return make_shared<wide_bvh<8>>(list, time0, time1, options);
+    if (options.width == 4)
+        return make_shared<wide_bvh<4>>(list, time0, time1, options);
+    return make_shared<linear_bvh>(list, time0, time1, options);
+}
+
+
+#endif